@@ -0,0 +1,539 @@
+#include <inttypes.h>
+#include <malloc.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cmap/log.h>
+#include <cmap/map.h>
+#include <cmap/typed.h>
+#include <cmap/wal.h>
+
+#define BENCH_DEFAULT_OPS 100000
+#define BENCH_LIST_SIZE 1000
+#define BENCH_DEEP_LEVELS 8
+#define BENCH_DEEP_FANOUT 4
+#define BENCH_ZIPF_SKEW 0.99
+
+CMAP_DEFINE(bench_u64_map, uint64_t, uint64_t, cmap_hash_u64, CMAP_EQ)
+
+/*
+ * Allocation counters. The benchmark is linked with --wrap for the allocation
+ * functions, so every call made by the library goes through these wrappers.
+ */
+static uint64_t alloc_count = 0;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t nmemb, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+char* __real_strdup(const char* str);
+
+void* __wrap_malloc(size_t size)
+{
+    alloc_count++;
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t nmemb, size_t size)
+{
+    alloc_count++;
+    return __real_calloc(nmemb, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size)
+{
+    alloc_count++;
+    return __real_realloc(ptr, size);
+}
+
+char* __wrap_strdup(const char* str)
+{
+    alloc_count++;
+    return __real_strdup(str);
+}
+
+typedef struct {
+    const char* name;
+    size_t ops;
+    uint64_t* latencies;
+    uint64_t total_ns;
+    uint64_t allocs;
+} bench_t;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static long peak_rss_kb(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+static int compare_u64(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief xorshift64* generator, so runs are reproducible across builds
+ */
+static uint64_t rng_state = 0x9E3779B97F4A7C15ull;
+
+static uint64_t rng_next(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1Dull;
+}
+
+static double rng_double(void)
+{
+    return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * @brief Zipfian generator over [0, n) using a precomputed CDF
+ */
+typedef struct {
+    double* cdf;
+    size_t n;
+} zipf_t;
+
+static void zipf_init(zipf_t* zipf, size_t n, double skew)
+{
+    double sum = 0;
+
+    zipf->n = n;
+    zipf->cdf = malloc(n * sizeof(double));
+
+    for (size_t i = 0; i < n; i++) {
+        sum += 1.0 / pow((double)(i + 1), skew);
+        zipf->cdf[i] = sum;
+    }
+    for (size_t i = 0; i < n; i++) {
+        zipf->cdf[i] /= sum;
+    }
+}
+
+static size_t zipf_next(zipf_t* zipf)
+{
+    double u = rng_double();
+    size_t left = 0;
+    size_t right = zipf->n - 1;
+
+    while (left < right) {
+        size_t mid = left + (right - left) / 2;
+        if (zipf->cdf[mid] < u) {
+            left = mid + 1;
+        } else {
+            right = mid;
+        }
+    }
+
+    return left;
+}
+
+static void zipf_free(zipf_t* zipf)
+{
+    free(zipf->cdf);
+    zipf->cdf = NULL;
+}
+
+static void bench_begin(bench_t* bench, const char* name, size_t ops)
+{
+    bench->name = name;
+    bench->ops = ops;
+    bench->latencies = calloc(ops, sizeof(uint64_t));
+    bench->total_ns = 0;
+    bench->allocs = alloc_count;
+}
+
+#define BENCH_OP(bench, i, op)                      \
+    do {                                            \
+        uint64_t start_ = now_ns();                 \
+        op;                                         \
+        (bench)->latencies[i] = now_ns() - start_;  \
+        (bench)->total_ns += (bench)->latencies[i]; \
+    } while (0)
+
+/**
+ * @brief Prints the results of a workload as a single JSON line
+ */
+static void bench_end(bench_t* bench, const char* extra)
+{
+    uint64_t allocs = alloc_count - bench->allocs;
+
+    qsort(bench->latencies, bench->ops, sizeof(uint64_t), compare_u64);
+
+    printf("{\"bench\":\"%s\",\"ops\":%zu,\"ns_per_op\":%.1f,"
+           "\"p50_ns\":%" PRIu64 ",\"p99_ns\":%" PRIu64 ",\"p999_ns\":%" PRIu64 ","
+           "\"allocs_per_op\":%.2f,\"peak_rss_kb\":%ld%s%s}\n",
+        bench->name, bench->ops, (double)bench->total_ns / bench->ops,
+        bench->latencies[bench->ops / 2],
+        bench->latencies[(size_t)(bench->ops * 0.99)],
+        bench->latencies[(size_t)(bench->ops * 0.999)],
+        (double)allocs / bench->ops, peak_rss_kb(),
+        extra ? "," : "", extra ? extra : "");
+    fflush(stdout);
+
+    free(bench->latencies);
+    bench->latencies = NULL;
+}
+
+static char** make_keys(size_t n)
+{
+    char** keys = malloc(n * sizeof(char*));
+    char buffer[32];
+
+    for (size_t i = 0; i < n; i++) {
+        snprintf(buffer, sizeof(buffer), "KEY%zu", i);
+        keys[i] = strdup(buffer);
+    }
+
+    return keys;
+}
+
+static void free_keys(char** keys, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        free(keys[i]);
+    }
+    free(keys);
+}
+
+static hashmap_t* bench_bulk_load(char** keys, size_t n)
+{
+    bench_t bench;
+    hashmap_t* hm = hm_create_default();
+    struct mallinfo2 before = mallinfo2();
+    char extra[64];
+
+    bench_begin(&bench, "bulk_load", n);
+    for (size_t i = 0; i < n; i++) {
+        BENCH_OP(&bench, i, hm_insert(hm, HM_VALUE_STR, keys[i], keys[i], NULL));
+    }
+
+    // Heap held by nodes, keys and values, bucket arrays mapped on huge pages are not counted
+    struct mallinfo2 after = mallinfo2();
+    snprintf(extra, sizeof(extra), "\"heap_bytes_per_op\":%.1f",
+        (double)((after.uordblks + after.hblkhd) - (before.uordblks + before.hblkhd)) / n);
+    bench_end(&bench, extra);
+
+    return hm;
+}
+
+static void bench_lookup_uniform(hashmap_t* hm, char** keys, size_t n)
+{
+    bench_t bench;
+    void* val = NULL;
+
+    bench_begin(&bench, "lookup_uniform", n);
+    for (size_t i = 0; i < n; i++) {
+        char* key = keys[rng_next() % n];
+        BENCH_OP(&bench, i, hm_search(hm, &val, key, NULL));
+    }
+    bench_end(&bench, NULL);
+}
+
+static void bench_lookup_zipf(hashmap_t* hm, char** keys, size_t n)
+{
+    bench_t bench;
+    zipf_t zipf;
+    void* val = NULL;
+
+    zipf_init(&zipf, n, BENCH_ZIPF_SKEW);
+
+    bench_begin(&bench, "lookup_zipf", n);
+    for (size_t i = 0; i < n; i++) {
+        char* key = keys[zipf_next(&zipf)];
+        BENCH_OP(&bench, i, hm_search(hm, &val, key, NULL));
+    }
+    bench_end(&bench, NULL);
+
+    zipf_free(&zipf);
+}
+
+static void bench_resize_growth(char** keys, size_t n)
+{
+    bench_t bench;
+    size_t batch = 1000;
+    hashmap_t* hm = NULL;
+
+    // Many small maps growing from the initial capacity, so resizes dominate
+    bench_begin(&bench, "resize_growth", n);
+    for (size_t i = 0; i < n; i++) {
+        if (i % batch == 0) {
+            hm_free((void**)&hm);
+            hm = hm_create_default();
+        }
+        BENCH_OP(&bench, i, hm_insert(hm, HM_VALUE_MAP, NULL, keys[i], NULL));
+    }
+    bench_end(&bench, NULL);
+
+    hm_free((void**)&hm);
+}
+
+/**
+ * @brief Builds the path of the i-th leaf of a tree with the given fanout
+ */
+static void tree_path(char** keys, size_t i, size_t levels, size_t fanout, char** path)
+{
+    for (size_t level = 0; level < levels; level++) {
+        path[levels - level - 1] = keys[i % fanout];
+        i /= fanout;
+    }
+    path[levels] = NULL;
+}
+
+static void bench_deep_tree(char** keys, size_t n)
+{
+    bench_t bench;
+    hashmap_t* hm = hm_create_default();
+    char* p[BENCH_DEEP_LEVELS + 1];
+    void* val = NULL;
+
+    bench_begin(&bench, "deep_insert", n);
+    for (size_t i = 0; i < n; i++) {
+        tree_path(keys, i, BENCH_DEEP_LEVELS, BENCH_DEEP_FANOUT, p);
+        BENCH_OP(&bench, i, hm_insert(hm, HM_VALUE_STR, "leaf", p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7], NULL));
+    }
+    bench_end(&bench, NULL);
+
+    bench_begin(&bench, "deep_lookup", n);
+    for (size_t i = 0; i < n; i++) {
+        tree_path(keys, rng_next() % n, BENCH_DEEP_LEVELS, BENCH_DEEP_FANOUT, p);
+        BENCH_OP(&bench, i, hm_search(hm, &val, p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7], NULL));
+    }
+    bench_end(&bench, NULL);
+
+    hm_free((void**)&hm);
+}
+
+static void bench_wide_tree(char** keys, size_t n)
+{
+    bench_t bench;
+    hashmap_t* hm = hm_create_default();
+    size_t fanout = (size_t)sqrt((double)n) + 1;
+    void* val = NULL;
+
+    bench_begin(&bench, "wide_insert", n);
+    for (size_t i = 0; i < n; i++) {
+        BENCH_OP(&bench, i, hm_insert(hm, HM_VALUE_STR, "leaf", keys[i / fanout], keys[i % fanout], NULL));
+    }
+    bench_end(&bench, NULL);
+
+    bench_begin(&bench, "wide_lookup", n);
+    for (size_t i = 0; i < n; i++) {
+        size_t j = rng_next() % n;
+        BENCH_OP(&bench, i, hm_search(hm, &val, keys[j / fanout], keys[j % fanout], NULL));
+    }
+    bench_end(&bench, NULL);
+
+    hm_free((void**)&hm);
+}
+
+static void bench_list_contains(char** keys, size_t n)
+{
+    bench_t bench;
+    size_t list_size = n < BENCH_LIST_SIZE ? n : BENCH_LIST_SIZE;
+    list_t* list = hm_list_create_default();
+
+    for (size_t i = 0; i < list_size; i++) {
+        hm_list_append_str(list, keys[i]);
+    }
+
+    // Half of the queries miss
+    bench_begin(&bench, "list_contains", n);
+    for (size_t i = 0; i < n; i++) {
+        char* key = keys[rng_next() % (list_size * 2 < n ? list_size * 2 : n)];
+        BENCH_OP(&bench, i, hm_list_contains(list, key));
+    }
+    bench_end(&bench, NULL);
+
+    hm_list_free((void**)&list);
+}
+
+static void bench_serialize(hashmap_t* hm)
+{
+    bench_t bench;
+    size_t runs = 20;
+    size_t bytes = 0;
+    char extra[128];
+
+    bench_begin(&bench, "serialize", runs);
+    for (size_t i = 0; i < runs; i++) {
+        char* json = NULL;
+        BENCH_OP(&bench, i, json = hm_serialize(hm));
+        bytes = json ? strlen(json) : 0;
+        free(json);
+    }
+
+    snprintf(extra, sizeof(extra), "\"bytes\":%zu,\"mb_per_s\":%.1f",
+        bytes, (double)bytes * runs / ((double)bench.total_ns / 1e9) / (1024 * 1024));
+    bench_end(&bench, extra);
+}
+
+static void bench_typed_lookup(size_t n)
+{
+    bench_t bench;
+    bench_u64_map_t map;
+    volatile uint64_t* val = NULL;
+
+    bench_u64_map_init(&map, 0);
+
+    bench_begin(&bench, "typed_insert", n);
+    for (size_t i = 0; i < n; i++) {
+        BENCH_OP(&bench, i, bench_u64_map_put(&map, i, i));
+    }
+    bench_end(&bench, NULL);
+
+    bench_begin(&bench, "typed_lookup_uniform", n);
+    for (size_t i = 0; i < n; i++) {
+        uint64_t key = rng_next() % n;
+        BENCH_OP(&bench, i, val = bench_u64_map_get(&map, key));
+    }
+    bench_end(&bench, NULL);
+
+    (void)val;
+    bench_u64_map_destroy(&map);
+}
+
+static void bench_durable(char** keys, size_t n)
+{
+    bench_t bench;
+    char dir[] = "/tmp/cmap_bench_XXXXXX";
+    char path[64];
+    hashmap_t* hm = NULL;
+
+    if (mkdtemp(dir) == NULL || (hm = hm_open_durable(dir)) == NULL) {
+        return;
+    }
+
+    bench_begin(&bench, "durable_insert", n);
+    for (size_t i = 0; i < n; i++) {
+        BENCH_OP(&bench, i, hm_insert(hm, HM_VALUE_STR, keys[i], keys[i], NULL));
+    }
+    hm_wal_sync(hm);
+    bench_end(&bench, NULL);
+    hm_free((void**)&hm);
+
+    // Each run replays the whole log, the last one recovers from a snapshot instead
+    size_t runs = 5;
+    bench_begin(&bench, "durable_recover", runs);
+    for (size_t i = 0; i < runs; i++) {
+        BENCH_OP(&bench, i, hm = hm_open_durable(dir));
+        if (i + 2 == runs) {
+            hm_checkpoint(hm);
+        }
+        hm_free((void**)&hm);
+    }
+    bench_end(&bench, NULL);
+
+    snprintf(path, sizeof(path), "%s/cmap.wal", dir);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/cmap.snapshot", dir);
+    unlink(path);
+    rmdir(dir);
+}
+
+static void bench_path_str(char** keys, size_t n)
+{
+    bench_t bench;
+    zipf_t zipf;
+    hashmap_t* hm = hm_create_default();
+    char** paths = malloc(n * sizeof(char*));
+    char* p[BENCH_DEEP_LEVELS + 1];
+    void* val = NULL;
+
+    // Dynamic paths as read from requests, such as "k1/k3/k0/k2/..."
+    for (size_t i = 0; i < n; i++) {
+        size_t len = 0;
+
+        tree_path(keys, i, BENCH_DEEP_LEVELS, BENCH_DEEP_FANOUT, p);
+        for (size_t level = 0; level < BENCH_DEEP_LEVELS; level++) {
+            len += strlen(p[level]) + 1;
+        }
+        paths[i] = malloc(len);
+        paths[i][0] = '\0';
+        for (size_t level = 0; level < BENCH_DEEP_LEVELS; level++) {
+            strcat(paths[i], p[level]);
+            if (level + 1 < BENCH_DEEP_LEVELS) {
+                strcat(paths[i], "/");
+            }
+        }
+    }
+
+    bench_begin(&bench, "path_insert", n);
+    for (size_t i = 0; i < n; i++) {
+        BENCH_OP(&bench, i, hm_insert_str(hm, HM_VALUE_STR, "leaf", paths[i], '/'));
+    }
+    bench_end(&bench, NULL);
+
+    zipf_init(&zipf, n, BENCH_ZIPF_SKEW);
+
+    bench_begin(&bench, "path_lookup_zipf", n);
+    for (size_t i = 0; i < n; i++) {
+        char* path = paths[zipf_next(&zipf)];
+        BENCH_OP(&bench, i, hm_search_str(hm, &val, path, '/'));
+    }
+    bench_end(&bench, NULL);
+
+    hm_enable_path_cache(hm, 4096);
+    bench_begin(&bench, "path_lookup_zipf_cached", n);
+    for (size_t i = 0; i < n; i++) {
+        char* path = paths[zipf_next(&zipf)];
+        BENCH_OP(&bench, i, hm_search_str(hm, &val, path, '/'));
+    }
+    bench_end(&bench, NULL);
+
+    zipf_free(&zipf);
+    for (size_t i = 0; i < n; i++) {
+        free(paths[i]);
+    }
+    free(paths);
+    hm_free((void**)&hm);
+}
+
+int main(int argc, char** argv)
+{
+    size_t n = BENCH_DEFAULT_OPS;
+
+    if (argc > 1 && (n = strtoull(argv[1], NULL, 10)) == 0) {
+        fprintf(stderr, "usage: %s [ops]\n", argv[0]);
+        return 1;
+    }
+
+    global_log_level = LOG_LEVEL_NOLOG;
+
+    char** keys = make_keys(n);
+
+    hashmap_t* hm = bench_bulk_load(keys, n);
+    bench_lookup_uniform(hm, keys, n);
+    bench_lookup_zipf(hm, keys, n);
+    bench_serialize(hm);
+    hm_free((void**)&hm);
+
+    bench_resize_growth(keys, n);
+    bench_deep_tree(keys, n);
+    bench_wide_tree(keys, n);
+    bench_list_contains(keys, n);
+    bench_typed_lookup(n);
+    bench_durable(keys, n);
+    bench_path_str(keys, n);
+
+    free_keys(keys, n);
+
+    return 0;
+}
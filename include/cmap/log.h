@@ -1,6 +1,8 @@
 #ifndef __HM_LOG_H_
 #define __HM_LOG_H_
 
+#include <stddef.h>
+
 typedef enum {
     LOG_LEVEL_NOLOG,
     LOG_LEVEL_INFO,
@@ -9,13 +11,34 @@ typedef enum {
     LOG_LEVEL_DEBUG
 } log_lv_t;
 
+// Messages above this level are removed at compile time, arguments included
+#ifndef HM_LOG_COMPILE_LEVEL
+#define HM_LOG_COMPILE_LEVEL LOG_LEVEL_ERROR
+#endif
+
+// Longer messages are truncated
+#define HM_LOG_MESSAGE_MAX 256
+
+// Per thread ring buffers used by the default sink
+#ifndef HM_LOG_MAX_THREADS
+#define HM_LOG_MAX_THREADS 16
+#endif
+#define HM_LOG_RING_SLOTS 128
+
+typedef void (*hm_log_sink_t)(log_lv_t lv, const char* file, const char* function, int line, const char* message, size_t len, void* ctx);
+
 extern log_lv_t global_log_level;
 
 void logger(log_lv_t lv, const char* file, const char* function, int line, const char* fmt, ...);
+void hm_log_set_sink(hm_log_sink_t sink, void* ctx);
+void hm_log_sink_async(log_lv_t lv, const char* file, const char* function, int line, const char* message, size_t len, void* ctx);
+void hm_log_sink_stdout(log_lv_t lv, const char* file, const char* function, int line, const char* message, size_t len, void* ctx);
+void hm_log_flush(void);
+unsigned long hm_log_dropped(void);
 
 #define HM_LOG(lv, fmt, ...)                                                  \
     do {                                                                      \
-        if (lv <= global_log_level) {                                         \
+        if (lv <= HM_LOG_COMPILE_LEVEL && lv <= global_log_level) {           \
             logger(lv, __FILE__, __FUNCTION__, __LINE__, fmt, ##__VA_ARGS__); \
         }                                                                     \
     } while (0)
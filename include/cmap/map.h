@@ -1,12 +1,33 @@
 #ifndef __MAP_H_
 #define __MAP_H_
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
 #define HM_LIST_INITIAL_CAPACITY 5
 #define HM_LIST_RESIZE_FACTOR 2.0
 
 #define HM_INITIAL_CAPACITY 5
 #define HM_LOAD_FACTOR_THRESHOLD 0.75
 #define HM_RESIZE_FACTOR 2.0
+#define HM_SHRINK_LOAD_FACTOR_THRESHOLD 0.2
+#define HM_SHRINK_FACTOR 0.5
+
+#define HM_MAX_PATH_DEPTH 32
+
+// Longest path, in bytes, remembered by the path cache of hm_search_str
+#define HM_PATH_CACHE_KEY_MAX 120
+
+// Bucket arrays of at least this many bytes are backed by huge pages, 0 disables
+#ifndef HM_HUGE_TABLE_BYTES
+#define HM_HUGE_TABLE_BYTES (2 * 1024 * 1024)
+#endif
+
+// Timer wheel used by TTLs: levels of slots, each slot of level n spans 2^(n * bits) ms
+#define HM_WHEEL_LEVELS 4
+#define HM_WHEEL_BITS 6
 
 #define HM_SUCCESS -1
 #define HM_ERROR -2
@@ -15,47 +36,226 @@
 typedef enum {
     HM_VALUE_STR,
     HM_VALUE_MAP,
-    HM_VALUE_LIST
+    HM_VALUE_LIST,
+    HM_VALUE_INT64,
+    HM_VALUE_DOUBLE,
+    HM_VALUE_BOOL,
+    HM_VALUE_BLOB
 } node_value_t;
 
+typedef struct {
+    void* data;
+    size_t len;
+} hm_blob_t;
+
+typedef enum {
+    HM_OWN_COPY,
+    HM_OWN_BORROW,
+    HM_OWN_TAKE
+} hm_own_t;
+
+typedef enum {
+    HM_MERGE_KEEP,
+    HM_MERGE_OVERWRITE
+} hm_merge_t;
+
+typedef enum {
+    HM_DIFF_ADDED,
+    HM_DIFF_REMOVED,
+    HM_DIFF_CHANGED
+} hm_diff_op_t;
+
+#define HM_NODE_KEY_BORROWED 0x01
+#define HM_NODE_VALUE_BORROWED 0x02
+
+// Length delimited key, may hold any byte including NULs
+typedef struct {
+    const char* data;
+    size_t len;
+} hm_key_t;
+
+#define HM_KEY(str) ((hm_key_t) { (str), strlen(str) })
+#define HM_KEYN(data, len) ((hm_key_t) { (data), (len) })
+
+typedef struct hm_timer hm_timer_t;
+typedef struct hm_wheel hm_wheel_t;
+
+/*
+ * The digest, timer and reference bit make a node 72 bytes instead of 56,
+ * whether or not digests, TTLs or budgets are used. With glibc that is an
+ * 80 byte chunk instead of 64: bench bulk_load measures 166.6 heap bytes per
+ * key instead of 150.6. Moving them behind one pointer would leave a 64 byte
+ * node, still an 80 byte chunk, and add an allocation per node wherever they
+ * are used, so they are kept inline.
+ */
 typedef struct node {
     char* key;
-    void* value;
+    size_t key_len;
+    uint64_t hash;
+    // Pointer values (STR, MAP, LIST) live in value, scalars are stored inline
+    union {
+        void* value;
+        int64_t i64;
+        double f64;
+        bool boolean;
+        hm_blob_t blob;
+    };
     node_value_t value_type;
+    uint8_t flags;
+    // CLOCK reference bit, set by searches in hashmaps with memory accounting
+    uint8_t referenced;
+    // Digest of key and value, only maintained in digest enabled hashmaps
+    uint64_t digest;
+    // Expiration timer, NULL unless inserted with hm_insert_ttl
+    hm_timer_t* timer;
     struct node* next;
 } node_t;
 
 typedef struct {
     node_t** items;
-    int size;
-    int capacity;
+    size_t size;
+    size_t capacity;
 } list_t;
 
-typedef struct
-{
+// Per hashmap operation counters, only compiled in with HM_ENABLE_COUNTERS
+typedef struct {
+    uint64_t inserts;
+    uint64_t searches;
+    uint64_t hits;
+    uint64_t misses;
+} hm_counters_t;
+
+typedef struct hm_wal hm_wal_t;
+typedef struct hm_path_cache hm_path_cache_t;
+
+typedef struct hashmap {
     node_t** list;
-    int size;
-    int capacity;
+    size_t size;
+    size_t capacity;
+    // Whether list is mapped on huge pages, see HM_HUGE_TABLE_BYTES
+    bool mapped;
+    hm_own_t key_policy;
+    hm_own_t value_policy;
+    uint32_t resize_count;
+    uint64_t resize_ns;
+    // Order independent digest of the subtree, see hm_enable_digest
+    bool digest_enabled;
+    uint64_t digest;
+    struct hashmap* parent;
+    node_t* parent_node;
+    // Bytes held by the subtree, maintained once accounting is enabled by hm_set_budget
+    bool accounting;
+    size_t bytes;
+    // Memory budget of the tree, 0 for none, and bucket of the CLOCK eviction hand
+    size_t budget;
+    size_t hand;
+    // Write ahead log of a durable root, see hm_open_durable
+    hm_wal_t* wal;
+    // Timers of the entries inserted with a TTL through this hashmap
+    hm_wheel_t* wheel;
+    // Leaves resolved by hm_search_str, see hm_enable_path_cache
+    hm_path_cache_t* path_cache;
+    // Changes whenever nodes of the subtree may have been freed
+    uint64_t generation;
+#ifdef HM_ENABLE_COUNTERS
+    hm_counters_t counters;
+#endif
 } hashmap_t;
 
+// Receives each difference found by hm_diff, any status other than HM_SUCCESS stops the walk
+typedef int (*hm_diff_cb_t)(hm_diff_op_t op, const hm_key_t* path, size_t depth, node_t* old_node, node_t* new_node, void* ctx);
+
+typedef struct {
+    hm_diff_op_t op;
+    hm_key_t* path;
+    size_t depth;
+    // Copy of the new value, NULL for removals
+    node_t* node;
+} hm_patch_op_t;
+
+typedef struct {
+    hm_patch_op_t* ops;
+    size_t size;
+    size_t capacity;
+} hm_patch_t;
+
+#define HM_STATS_HISTOGRAM_SIZE 8
+
+typedef struct {
+    size_t maps;
+    size_t lists;
+    size_t entries;
+    size_t list_items;
+    size_t buckets;
+    size_t used_buckets;
+    size_t collisions;
+    size_t max_chain;
+    double avg_chain;
+    // Number of buckets per chain length, the last slot counts longer chains
+    size_t chain_histogram[HM_STATS_HISTOGRAM_SIZE];
+    uint64_t resize_count;
+    uint64_t resize_ns;
+    size_t key_bytes;
+    size_t value_bytes;
+    size_t struct_bytes;
+    // Zeroed unless the library is built with HM_ENABLE_COUNTERS
+    hm_counters_t counters;
+} hm_stats_t;
+
 node_t* hm_node_new(void);
 node_t* hm_node_create(char* key, node_value_t value_type, void* value, void* next);
+void hm_node_swap_value(node_t* a, node_t* b);
 list_t* hm_list_new(void);
-list_t* hm_list_create(int capacity);
+list_t* hm_list_create(size_t capacity);
 list_t* hm_list_create_default(void);
+list_t* hm_list_clone(list_t* list);
 hashmap_t* hm_new(void);
-hashmap_t* hm_create(int capacity);
+hashmap_t* hm_create(size_t capacity);
 hashmap_t* hm_create_default(void);
+int hm_set_ownership(hashmap_t* hm, hm_own_t key_policy, hm_own_t value_policy);
 char* hm_serialize(hashmap_t* hm);
 char* hm_serialize_node(node_t* node);
-int hm_hash(hashmap_t* hm, char* str);
+int64_t hm_hash(hashmap_t* hm, char* str);
+uint64_t hm_key_hash(const char* key, size_t len);
 int hm_search(hashmap_t* hm, void** value, ...);
+int hm_searchn(hashmap_t* hm, void** value, const hm_key_t* keys, size_t depth);
+int hm_search_str(hashmap_t* hm, void** value, const char* path, char delim);
+int hm_enable_path_cache(hashmap_t* hm, size_t entries);
+int hm_update_str(hashmap_t* hm, char* str, ...);
+int hm_update_strn(hashmap_t* hm, char* str, const hm_key_t* keys, size_t depth);
+int hm_node_update_str(node_t* node, char* str);
+int hm_remove(hashmap_t* hm, ...);
+int hm_removen(hashmap_t* hm, const hm_key_t* keys, size_t depth);
+int hm_incr(hashmap_t* hm, int64_t delta, int64_t* result, ...);
+int hm_incrn(hashmap_t* hm, int64_t delta, int64_t* result, const hm_key_t* keys, size_t depth);
 int hm_resize(hashmap_t* hm, float factor);
+int hm_compact(hashmap_t* hm);
+int hm_reserve(hashmap_t* hm, size_t entries);
+hashmap_t* hm_clone(hashmap_t* hm);
+int hm_merge(hashmap_t* dst, hashmap_t* src, hm_merge_t policy);
+int hm_enable_digest(hashmap_t* hm);
+bool hm_equal(hashmap_t* a, hashmap_t* b);
+int hm_diff(hashmap_t* a, hashmap_t* b, hm_diff_cb_t callback, void* ctx);
+hm_patch_t* hm_patch_create(hashmap_t* from, hashmap_t* to);
+int hm_patch(hashmap_t* hm, const hm_patch_t* patch);
+void hm_patch_free(void** patch_p);
 int hm_node_compare(const void* a, const void* b);
 int hm_list_contains(list_t* list, char* str);
 float hm_get_load_factor(hashmap_t* hm);
+int hm_stats(hashmap_t* hm, hm_stats_t* stats, bool recursive);
 void hm_insert(hashmap_t* hm, node_value_t value_type, void* value, ...);
-void hm_rehash_insert(hashmap_t* hm, char* key, node_value_t value_type, void* value);
+void hm_insertn(hashmap_t* hm, node_value_t value_type, void* value, const hm_key_t* keys, size_t depth);
+void hm_insert_str(hashmap_t* hm, node_value_t value_type, void* value, const char* path, char delim);
+void hm_insert_ttl(hashmap_t* hm, uint64_t ttl_ms, node_value_t value_type, void* value, ...);
+void hm_insert_ttln(hashmap_t* hm, uint64_t ttl_ms, node_value_t value_type, void* value, const hm_key_t* keys, size_t depth);
+int hm_expire_tick(hashmap_t* hm, uint64_t now, int budget);
+uint64_t hm_clock_ms(void);
+int hm_set_budget(hashmap_t* hm, size_t bytes);
+size_t hm_get_memory_usage(hashmap_t* hm);
+node_t* hm_upsert(hashmap_t* hm, node_value_t value_type, void* value, ...);
+node_t* hm_upsertn(hashmap_t* hm, node_value_t value_type, void* value, const hm_key_t* keys, size_t depth);
+int hm_upsert_commit(hashmap_t* hm, ...);
+int hm_upsert_commitn(hashmap_t* hm, const hm_key_t* keys, size_t depth);
 void hm_list_append(list_t* list, node_t* node);
 void hm_list_append_str(list_t* list, char* str);
 void hm_free(void** hm_p);
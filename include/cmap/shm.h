@@ -0,0 +1,41 @@
+#ifndef __HM_SHM_H_
+#define __HM_SHM_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <cmap/map.h>
+
+typedef struct hm_shm hm_shm_t;
+
+// Value found by hm_shm_search. Strings and blobs are copied into buf, maps and lists only report their size
+typedef struct {
+    node_value_t type;
+    // Set by the caller, a string needs its length plus one byte
+    void* buf;
+    size_t buf_len;
+    union {
+        const char* str;
+        size_t size;
+        int64_t i64;
+        double f64;
+        bool boolean;
+        struct {
+            const void* data;
+            size_t len;
+        } blob;
+    };
+} hm_shm_value_t;
+
+hm_shm_t* hm_shm_create(const char* name, size_t size);
+hm_shm_t* hm_shm_open(const char* name);
+int hm_shm_publish(hm_shm_t* shm, hashmap_t* hm);
+int hm_shm_search(hm_shm_t* shm, hm_shm_value_t* value, ...);
+int hm_shm_searchn(hm_shm_t* shm, hm_shm_value_t* value, const hm_key_t* keys, size_t depth);
+uint64_t hm_shm_generation(hm_shm_t* shm);
+bool hm_shm_retired(hm_shm_t* shm);
+void hm_shm_close(void** shm_p);
+int hm_shm_unlink(const char* name);
+
+#endif
@@ -0,0 +1,227 @@
+#ifndef __HM_TYPED_H_
+#define __HM_TYPED_H_
+
+/*
+ * Header only generator of type specialized hashmaps.
+ *
+ * CMAP_DEFINE(name, key_t, val_t, hash_fn, eq_fn) emits name_t and a set of
+ * static inline functions working directly on fixed size keys and values,
+ * without boxing them behind void pointers:
+ *
+ *  - int name_init(name_t* map, size_t capacity)
+ *  - void name_destroy(name_t* map)
+ *  - val_t* name_get(const name_t* map, key_t key)
+ *  - val_t* name_upsert(name_t* map, key_t key, bool* created)
+ *  - int name_put(name_t* map, key_t key, val_t val)
+ *  - int name_remove(name_t* map, key_t key)
+ *  - int name_resize(name_t* map, size_t capacity)
+ *
+ * hash_fn(key) must return a uint64_t and eq_fn(a, b) non-zero for equal
+ * keys; both may be macros. Tables use open addressing with linear probing
+ * and follow the same load factor, resize and shrink policy as hashmap_t.
+ * The value of a key created by name_upsert is zeroed. Pointers returned by
+ * name_get and name_upsert are invalidated by any later insertion or
+ * removal.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cmap/map.h>
+
+#define CMAP_EQ(a, b) ((a) == (b))
+
+/**
+ * @brief Finalizer of splitmix64, spreads integer keys over all bits
+ */
+static inline uint64_t cmap_hash_u64(uint64_t key)
+{
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ull;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebull;
+    key ^= key >> 31;
+    return key;
+}
+
+static inline uint64_t cmap_hash_u32(uint32_t key)
+{
+    return cmap_hash_u64(key);
+}
+
+/**
+ * @brief FNV-1a over raw bytes, for struct keys without padding
+ */
+static inline uint64_t cmap_hash_bytes(const void* data, size_t len)
+{
+    const unsigned char* bytes = data;
+    uint64_t hash = 0xcbf29ce484222325ull;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+
+    return hash;
+}
+
+#define CMAP_DEFINE(name, key_t, val_t, hash_fn, eq_fn)                                         \
+    typedef struct {                                                                            \
+        key_t* keys;                                                                            \
+        val_t* vals;                                                                            \
+        uint8_t* used;                                                                          \
+        size_t size;                                                                            \
+        size_t capacity;                                                                        \
+    } name##_t;                                                                                 \
+                                                                                                \
+    static inline int name##_init(name##_t* map, size_t capacity)                               \
+    {                                                                                           \
+        if (capacity < HM_INITIAL_CAPACITY) {                                                   \
+            capacity = HM_INITIAL_CAPACITY;                                                     \
+        }                                                                                       \
+        map->keys = malloc(capacity * sizeof(key_t));                                           \
+        map->vals = malloc(capacity * sizeof(val_t));                                           \
+        map->used = calloc(capacity, sizeof(uint8_t));                                          \
+        map->size = 0;                                                                          \
+        map->capacity = capacity;                                                               \
+        if (map->keys == NULL || map->vals == NULL || map->used == NULL) {                      \
+            free(map->keys);                                                                    \
+            free(map->vals);                                                                    \
+            free(map->used);                                                                    \
+            map->keys = NULL;                                                                   \
+            map->vals = NULL;                                                                   \
+            map->used = NULL;                                                                   \
+            map->capacity = 0;                                                                  \
+            return HM_ERROR;                                                                    \
+        }                                                                                       \
+        return HM_SUCCESS;                                                                      \
+    }                                                                                           \
+                                                                                                \
+    static inline void name##_destroy(name##_t* map)                                            \
+    {                                                                                           \
+        free(map->keys);                                                                        \
+        free(map->vals);                                                                        \
+        free(map->used);                                                                        \
+        map->keys = NULL;                                                                       \
+        map->vals = NULL;                                                                       \
+        map->used = NULL;                                                                       \
+        map->size = 0;                                                                          \
+        map->capacity = 0;                                                                      \
+    }                                                                                           \
+                                                                                                \
+    /* Slot holding the key, or the empty slot that ends its probe sequence */                  \
+    static inline size_t name##_slot(const name##_t* map, key_t key)                            \
+    {                                                                                           \
+        size_t slot = (size_t)(hash_fn(key) % map->capacity);                                   \
+        while (map->used[slot] && !(eq_fn(map->keys[slot], key))) {                             \
+            slot = slot + 1 == map->capacity ? 0 : slot + 1;                                    \
+        }                                                                                       \
+        return slot;                                                                            \
+    }                                                                                           \
+                                                                                                \
+    static inline val_t* name##_get(const name##_t* map, key_t key)                             \
+    {                                                                                           \
+        if (map->capacity == 0) {                                                               \
+            return NULL;                                                                        \
+        }                                                                                       \
+        size_t slot = name##_slot(map, key);                                                    \
+        return map->used[slot] ? &map->vals[slot] : NULL;                                       \
+    }                                                                                           \
+                                                                                                \
+    static inline int name##_resize(name##_t* map, size_t capacity)                             \
+    {                                                                                           \
+        name##_t resized;                                                                       \
+        if (capacity <= map->size || name##_init(&resized, capacity) == HM_ERROR) {             \
+            return HM_ERROR;                                                                    \
+        }                                                                                       \
+        for (size_t i = 0; i < map->capacity; i++) {                                            \
+            if (map->used[i]) {                                                                 \
+                size_t slot = name##_slot(&resized, map->keys[i]);                              \
+                resized.used[slot] = 1;                                                         \
+                resized.keys[slot] = map->keys[i];                                              \
+                resized.vals[slot] = map->vals[i];                                              \
+            }                                                                                   \
+        }                                                                                       \
+        resized.size = map->size;                                                               \
+        name##_destroy(map);                                                                    \
+        *map = resized;                                                                         \
+        return HM_SUCCESS;                                                                      \
+    }                                                                                           \
+                                                                                                \
+    static inline val_t* name##_upsert(name##_t* map, key_t key, bool* created)                 \
+    {                                                                                           \
+        if (created) {                                                                          \
+            *created = false;                                                                   \
+        }                                                                                       \
+        if (map->capacity == 0 && name##_init(map, HM_INITIAL_CAPACITY) == HM_ERROR) {          \
+            return NULL;                                                                        \
+        }                                                                                       \
+        size_t slot = name##_slot(map, key);                                                    \
+        if (map->used[slot]) {                                                                  \
+            return &map->vals[slot];                                                            \
+        }                                                                                       \
+        if ((double)(map->size + 1) / map->capacity >= HM_LOAD_FACTOR_THRESHOLD) {              \
+            if (name##_resize(map, (size_t)(map->capacity * HM_RESIZE_FACTOR)) == HM_ERROR) {   \
+                return NULL;                                                                    \
+            }                                                                                   \
+            slot = name##_slot(map, key);                                                       \
+        }                                                                                       \
+        map->used[slot] = 1;                                                                    \
+        map->keys[slot] = key;                                                                  \
+        memset(&map->vals[slot], 0, sizeof(val_t));                                             \
+        map->size++;                                                                            \
+        if (created) {                                                                          \
+            *created = true;                                                                    \
+        }                                                                                       \
+        return &map->vals[slot];                                                                \
+    }                                                                                           \
+                                                                                                \
+    static inline int name##_put(name##_t* map, key_t key, val_t val)                           \
+    {                                                                                           \
+        val_t* slot = name##_upsert(map, key, NULL);                                            \
+        if (slot == NULL) {                                                                     \
+            return HM_ERROR;                                                                    \
+        }                                                                                       \
+        *slot = val;                                                                            \
+        return HM_SUCCESS;                                                                      \
+    }                                                                                           \
+                                                                                                \
+    /* Backward shift deletion, so no tombstones are left behind */                             \
+    static inline int name##_remove(name##_t* map, key_t key)                                   \
+    {                                                                                           \
+        if (map->capacity == 0) {                                                               \
+            return HM_NOT_FOUND;                                                                \
+        }                                                                                       \
+        size_t hole = name##_slot(map, key);                                                    \
+        if (!map->used[hole]) {                                                                 \
+            return HM_NOT_FOUND;                                                                \
+        }                                                                                       \
+        size_t next = hole;                                                                     \
+        while (1) {                                                                             \
+            next = next + 1 == map->capacity ? 0 : next + 1;                                    \
+            if (!map->used[next]) {                                                             \
+                break;                                                                          \
+            }                                                                                   \
+            size_t home = (size_t)(hash_fn(map->keys[next]) % map->capacity);                   \
+            /* Moves the entry back unless its home lies cyclically in (hole, next] */          \
+            bool stays = hole <= next ? (hole < home && home <= next)                           \
+                                      : (hole < home || home <= next);                          \
+            if (!stays) {                                                                       \
+                map->keys[hole] = map->keys[next];                                              \
+                map->vals[hole] = map->vals[next];                                              \
+                hole = next;                                                                    \
+            }                                                                                   \
+        }                                                                                       \
+        map->used[hole] = 0;                                                                    \
+        map->size--;                                                                            \
+        if (map->capacity > HM_INITIAL_CAPACITY                                                 \
+            && (double)map->size / map->capacity < HM_SHRINK_LOAD_FACTOR_THRESHOLD) {           \
+            name##_resize(map, (size_t)(map->capacity * HM_SHRINK_FACTOR));                     \
+        }                                                                                       \
+        return HM_SUCCESS;                                                                      \
+    }
+
+#endif
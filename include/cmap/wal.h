@@ -0,0 +1,31 @@
+#ifndef __HM_WAL_H_
+#define __HM_WAL_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <cmap/map.h>
+
+// Records are fsynced together once this many bytes are pending
+#ifndef HM_WAL_GROUP_BYTES
+#define HM_WAL_GROUP_BYTES (1 << 20)
+#endif
+
+// Or once the oldest pending record is this old, by the sync thread of the root
+#ifndef HM_WAL_GROUP_MS
+#define HM_WAL_GROUP_MS 10
+#endif
+
+// The log is compacted into a snapshot once it grows past this size
+#ifndef HM_WAL_CHECKPOINT_BYTES
+#define HM_WAL_CHECKPOINT_BYTES (64 << 20)
+#endif
+
+hashmap_t* hm_open_durable(const char* dir);
+int hm_wal_log_set(hashmap_t* hm, const hm_key_t* keys, size_t depth, node_t* node);
+int hm_wal_log_remove(hashmap_t* hm, const hm_key_t* keys, size_t depth);
+int hm_wal_sync(hashmap_t* hm);
+int hm_checkpoint(hashmap_t* hm);
+int hm_wal_close(hashmap_t* hm);
+
+#endif
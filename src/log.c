@@ -1,54 +1,386 @@
+#include <linux/futex.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <cmap/log.h>
 
-log_lv_t global_log_level = LOG_LEVEL_INFO;
+log_lv_t global_log_level = LOG_LEVEL_NOLOG;
+// log_lv_t global_log_level = LOG_LEVEL_INFO;
 // log_lv_t global_log_level = LOG_LEVEL_DEBUG;
-// log_lv_t global_log_level = LOG_LEVEL_NOLOG;
 
-void logger(log_lv_t lv, const char* file, const char* function, int line, const char* fmt, ...)
+// Pause of the writer thread between drains while messages keep arriving
+#define HM_LOG_WRITER_SLEEP_NS 1000000
+
+typedef struct {
+    log_lv_t lv;
+    const char* file;
+    const char* function;
+    int line;
+    size_t len;
+    char message[HM_LOG_MESSAGE_MAX];
+} log_record_t;
+
+/*
+ * Single producer, single consumer ring. The owning thread is the only
+ * producer, consumers serialize on drain_lock.
+ */
+typedef struct {
+    uint32_t head;
+    uint32_t tail;
+    int in_use;
+    int released;
+    log_record_t records[HM_LOG_RING_SLOTS];
+} log_ring_t;
+
+static log_ring_t rings[HM_LOG_MAX_THREADS];
+static __thread log_ring_t* thread_ring = NULL;
+static __thread bool thread_ring_failed = false;
+
+static hm_log_sink_t log_sink = hm_log_sink_async;
+static void* log_sink_ctx = NULL;
+static unsigned long log_dropped = 0;
+
+static pthread_once_t writer_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Set while the writer waits on writer_wake, which producers bump to wake it
+static int writer_parked = 0;
+static uint32_t writer_wake = 0;
+
+static const char* log_level_str(log_lv_t lv)
 {
-    const char* log_level_str;
     switch (lv) {
     case LOG_LEVEL_INFO:
-        log_level_str = "[INFO]";
-        break;
+        return "[INFO]";
     case LOG_LEVEL_WARNING:
-        log_level_str = "[WARNING]";
-        break;
+        return "[WARNING]";
+    case LOG_LEVEL_ERROR:
+        return "[ERROR]";
     case LOG_LEVEL_DEBUG:
-        log_level_str = "[DEBUG]";
-        break;
+        return "[DEBUG]";
     default:
-        log_level_str = "[UNKNOWN]";
-        break;
+        return "[UNKNOWN]";
     }
+}
 
-    va_list args;
-    va_start(args, fmt);
+/**
+ * @brief Writes a message to stdout, blocking the caller.
+ *
+ * Can be installed with hm_log_set_sink when ordering across threads matters
+ * more than latency.
+ */
+void hm_log_sink_stdout(log_lv_t lv, const char* file, const char* function, int line, const char* message, size_t len, void* ctx)
+{
+    (void)ctx;
 
-    int size = vsnprintf(NULL, 0, fmt, args);
-    va_end(args);
+    if (lv == LOG_LEVEL_DEBUG) {
+        printf("%s [%s:%d - %s]: %.*s\n", log_level_str(lv), file, line, function, (int)len, message);
+    } else {
+        printf("%s %.*s\n", log_level_str(lv), (int)len, message);
+    }
+}
+
+/**
+ * @brief Writes every pending record of a ring and releases the ring if its
+ * thread is gone. Must be called with drain_lock held.
+ *
+ * @param ring Pointer to the ring
+ * @return size_t Number of records written
+ */
+static size_t log_ring_drain(log_ring_t* ring)
+{
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    size_t written = head - tail;
+
+    for (; tail != head; tail++) {
+        log_record_t* record = &ring->records[tail % HM_LOG_RING_SLOTS];
+        hm_log_sink_stdout(record->lv, record->file, record->function, record->line, record->message, record->len, NULL);
+    }
+
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+    // The owner exited, after the last drain the ring can be claimed again
+    if (__atomic_load_n(&ring->released, __ATOMIC_ACQUIRE)
+        && __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail) {
+        __atomic_store_n(&ring->released, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&ring->in_use, 0, __ATOMIC_RELEASE);
+    }
+
+    return written;
+}
+
+/**
+ * @brief Writes every pending record of every ring
+ *
+ * @return size_t Number of records written
+ */
+static size_t log_drain_all(void)
+{
+    size_t written = 0;
+
+    pthread_mutex_lock(&drain_lock);
+    for (int i = 0; i < HM_LOG_MAX_THREADS; i++) {
+        if (__atomic_load_n(&rings[i].in_use, __ATOMIC_ACQUIRE)) {
+            written += log_ring_drain(&rings[i]);
+        }
+    }
+    fflush(stdout);
+    pthread_mutex_unlock(&drain_lock);
+
+    return written;
+}
+
+/**
+ * @brief Writes every pending message of the default sink.
+ *
+ * Called by the writer thread and at exit. Can be called by users before
+ * reading the output.
+ */
+void hm_log_flush(void)
+{
+    log_drain_all();
+}
+
+/**
+ * @brief Checks whether any ring holds records not written yet
+ */
+static bool log_pending(void)
+{
+    for (int i = 0; i < HM_LOG_MAX_THREADS; i++) {
+        if (__atomic_load_n(&rings[i].head, __ATOMIC_RELAXED) != __atomic_load_n(&rings[i].tail, __ATOMIC_RELAXED)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * @brief Puts the writer to sleep until a producer wakes it up.
+ *
+ * Producers check writer_parked after publishing a record, and the writer
+ * checks the rings after setting it, so one of the two always sees the
+ * other. A wake up between the check and the wait changes writer_wake,
+ * which makes the wait return at once.
+ */
+static void log_writer_park(void)
+{
+    uint32_t wake = __atomic_load_n(&writer_wake, __ATOMIC_ACQUIRE);
+
+    __atomic_store_n(&writer_parked, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (!log_pending()) {
+        syscall(SYS_futex, &writer_wake, FUTEX_WAIT_PRIVATE, wake, NULL, NULL, 0);
+    }
+
+    __atomic_store_n(&writer_parked, 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Wakes the writer up if it is parked
+ */
+static void log_writer_wake(void)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&writer_parked, __ATOMIC_RELAXED)) {
+        __atomic_add_fetch(&writer_wake, 1, __ATOMIC_RELEASE);
+        syscall(SYS_futex, &writer_wake, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+static void* log_writer(void* arg)
+{
+    struct timespec idle = { 0, HM_LOG_WRITER_SLEEP_NS };
+    (void)arg;
+
+    while (1) {
+        // Polls while messages keep arriving, so bursts are written in batches
+        if (log_drain_all() > 0) {
+            nanosleep(&idle, NULL);
+            continue;
+        }
+
+        // Sleeps without waking up at all while nothing is logged
+        log_writer_park();
+    }
+
+    return NULL;
+}
+
+static void log_ring_release(void* ring)
+{
+    __atomic_store_n(&((log_ring_t*)ring)->released, 1, __ATOMIC_RELEASE);
+}
+
+static void log_writer_spawn(void)
+{
+    pthread_t writer;
+
+    if (pthread_create(&writer, NULL, log_writer, NULL) == 0) {
+        pthread_detach(writer);
+    }
+}
+
+/**
+ * @brief Keeps the writer from holding drain_lock across a fork, so the
+ * child can drain at exit
+ */
+static void log_fork_prepare(void)
+{
+    pthread_mutex_lock(&drain_lock);
+}
+
+static void log_fork_parent(void)
+{
+    pthread_mutex_unlock(&drain_lock);
+}
+
+/**
+ * @brief Gives the child its own writer. The records pending at the fork are
+ * written by the parent, the child starts with empty rings.
+ */
+static void log_fork_child(void)
+{
+    for (int i = 0; i < HM_LOG_MAX_THREADS; i++) {
+        rings[i].head = 0;
+        rings[i].tail = 0;
+        rings[i].in_use = 0;
+        rings[i].released = 0;
+    }
+
+    // The forking thread is the only one left, it claims a ring again on its next message
+    thread_ring = NULL;
+    thread_ring_failed = false;
+    pthread_setspecific(ring_key, NULL);
+
+    writer_parked = 0;
+    writer_wake = 0;
+
+    pthread_mutex_unlock(&drain_lock);
+    log_writer_spawn();
+}
+
+static void log_writer_start(void)
+{
+    pthread_key_create(&ring_key, log_ring_release);
+    pthread_atfork(log_fork_prepare, log_fork_parent, log_fork_child);
+    log_writer_spawn();
+    atexit(hm_log_flush);
+}
+
+/**
+ * @brief Claims a free ring for the calling thread
+ *
+ * @return log_ring_t* Ring owned by the thread or NULL if all are taken
+ */
+static log_ring_t* log_ring_claim(void)
+{
+    pthread_once(&writer_once, log_writer_start);
+
+    for (int i = 0; i < HM_LOG_MAX_THREADS; i++) {
+        int expected = 0;
+        if (__atomic_compare_exchange_n(&rings[i].in_use, &expected, 1, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            pthread_setspecific(ring_key, &rings[i]);
+            return &rings[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Default sink. Copies the message to the calling thread's ring, which
+ * is written to stdout by a background thread.
+ *
+ * Never blocks nor allocates: messages are dropped when the ring is full or
+ * when more than HM_LOG_MAX_THREADS threads are logging. See hm_log_dropped.
+ * The writer sleeps while nothing is logged, the first message after a pause
+ * wakes it up with a single system call.
+ */
+void hm_log_sink_async(log_lv_t lv, const char* file, const char* function, int line, const char* message, size_t len, void* ctx)
+{
+    (void)ctx;
 
-    char* message = (char*)malloc(size + 1); // +1 for null terminator
-    if (message == NULL) {
-        perror("Failed to allocate memory for log message");
+    if (thread_ring == NULL) {
+        if (thread_ring_failed || (thread_ring = log_ring_claim()) == NULL) {
+            thread_ring_failed = true;
+            __atomic_fetch_add(&log_dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+
+    uint32_t head = __atomic_load_n(&thread_ring->head, __ATOMIC_RELAXED);
+    uint32_t tail = __atomic_load_n(&thread_ring->tail, __ATOMIC_ACQUIRE);
+
+    if (head - tail == HM_LOG_RING_SLOTS) {
+        __atomic_fetch_add(&log_dropped, 1, __ATOMIC_RELAXED);
         return;
     }
 
+    log_record_t* record = &thread_ring->records[head % HM_LOG_RING_SLOTS];
+    record->lv = lv;
+    record->file = file;
+    record->function = function;
+    record->line = line;
+    record->len = len;
+    memcpy(record->message, message, len);
+
+    __atomic_store_n(&thread_ring->head, head + 1, __ATOMIC_RELEASE);
+    log_writer_wake();
+}
+
+/**
+ * @brief Number of messages dropped by the default sink
+ */
+unsigned long hm_log_dropped(void)
+{
+    return __atomic_load_n(&log_dropped, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Replaces the sink that receives every formatted message.
+ *
+ * Should be called before the library starts logging. Passing NULL restores
+ * the default asynchronous sink.
+ *
+ * @param sink Sink function
+ * @param ctx Opaque pointer given to the sink
+ */
+void hm_log_set_sink(hm_log_sink_t sink, void* ctx)
+{
+    __atomic_store_n(&log_sink_ctx, ctx, __ATOMIC_RELAXED);
+    __atomic_store_n(&log_sink, sink ? sink : hm_log_sink_async, __ATOMIC_RELEASE);
+}
+
+void logger(log_lv_t lv, const char* file, const char* function, int line, const char* fmt, ...)
+{
+    char message[HM_LOG_MESSAGE_MAX];
+
+    va_list args;
     va_start(args, fmt);
-    vsnprintf(message, size + 1, fmt, args);
+
+    // Formats once into the stack, truncating long messages
+    int size = vsnprintf(message, sizeof(message), fmt, args);
     va_end(args);
 
-    if (lv == LOG_LEVEL_DEBUG) {
-        printf("%s [%s:%d - %s]: %s\n", log_level_str, file, line, function, message);
-    } else {
-        printf("%s %s\n", log_level_str, message);
+    if (size < 0) {
+        return;
     }
 
-    // Clean up
-    free(message);
+    size_t len = (size_t)size < sizeof(message) ? (size_t)size : sizeof(message) - 1;
+
+    hm_log_sink_t sink = __atomic_load_n(&log_sink, __ATOMIC_ACQUIRE);
+    sink(lv, file, function, line, message, len, __atomic_load_n(&log_sink_ctx, __ATOMIC_RELAXED));
 }
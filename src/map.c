@@ -1,16 +1,44 @@
+#include <inttypes.h>
 #include <limits.h>
+#include <math.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <time.h>
 
 #include <cmap/log.h>
 #include <cmap/map.h>
+#include <cmap/wal.h>
 
 #include <openssl/sha.h>
 
+#ifdef HM_ENABLE_COUNTERS
+#define HM_COUNT(hashmap, counter) ((hashmap)->counters.counter++)
+#else
+#define HM_COUNT(hashmap, counter) ((void)0)
+#endif
+
+// Largest bucket or item array whose size in bytes fits a size_t
+#define HM_MAX_CAPACITY (SIZE_MAX / sizeof(node_t*))
+
+#define HM_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/**
+ * @brief Invalidates the path caches of a hashmap and of the hashmaps above
+ * it, called before nodes are freed
+ *
+ * @param hashmap Pointer to the hashmap whose subtree changes
+ */
+static void hm_generation_bump(hashmap_t* hashmap)
+{
+    for (; hashmap != NULL; hashmap = hashmap->parent) {
+        hashmap->generation++;
+    }
+}
+
 /**
  * @brief Hash's a string using SHA256
  *
@@ -47,7 +75,13 @@ node_t* hm_node_new(void)
     }
 
     node->key = NULL;
-    node->value = NULL;
+    node->key_len = 0;
+    node->hash = 0;
+    node->flags = 0;
+    node->referenced = 0;
+    node->digest = 0;
+    node->timer = NULL;
+    node->blob = (hm_blob_t) { 0 };
     node->value_type = HM_VALUE_MAP;
     node->next = NULL;
 
@@ -58,6 +92,10 @@ node_t* hm_node_new(void)
  * @brief Instantiates a heap allocated node using the given parameters as a
  * reference.
  *
+ * Pointer values (strings, maps and lists) are taken by the node. Scalars are
+ * copied from the pointed value into the node. Blobs are given as a pointer
+ * to a hm_blob_t whose data is taken by the node.
+ *
  * @param key Node key
  * @param value_type Node value type
  * @param value Node value
@@ -73,13 +111,321 @@ node_t* hm_node_create(char* key, node_value_t value_type, void* value, void* ne
     }
 
     node->key = key;
-    node->value = value;
+    node->key_len = key ? strlen(key) : 0;
+    node->hash = key ? hm_key_hash(key, node->key_len) : 0;
     node->value_type = value_type;
     node->next = next;
 
+    switch (value_type) {
+    case HM_VALUE_STR:
+    case HM_VALUE_MAP:
+    case HM_VALUE_LIST:
+        node->value = value;
+        break;
+    case HM_VALUE_INT64:
+        node->i64 = value ? *(int64_t*)value : 0;
+        break;
+    case HM_VALUE_DOUBLE:
+        node->f64 = value ? *(double*)value : 0.0;
+        break;
+    case HM_VALUE_BOOL:
+        node->boolean = value ? *(bool*)value : false;
+        break;
+    case HM_VALUE_BLOB:
+        node->blob = value ? *(hm_blob_t*)value : (hm_blob_t) { 0 };
+        break;
+    }
+
     return node;
 }
 
+/**
+ * @brief Releases the value held by a node, leaving the node itself intact.
+ *
+ * @param node Pointer to the node
+ */
+static void hm_node_value_free(node_t* node)
+{
+    if (node->flags & HM_NODE_VALUE_BORROWED) {
+        node->flags &= ~HM_NODE_VALUE_BORROWED;
+        node->blob = (hm_blob_t) { 0 };
+        return;
+    }
+
+    switch (node->value_type) {
+    case HM_VALUE_STR:
+        free(node->value);
+        break;
+    case HM_VALUE_MAP:
+        hm_generation_bump(node->value);
+        hm_free((void**)&node->value);
+        break;
+    case HM_VALUE_LIST:
+        hm_list_free((void**)&node->value);
+        break;
+    case HM_VALUE_BLOB:
+        free(node->blob.data);
+        break;
+    case HM_VALUE_INT64:
+    case HM_VALUE_DOUBLE:
+    case HM_VALUE_BOOL:
+        break;
+    }
+    node->blob = (hm_blob_t) { 0 };
+}
+
+/**
+ * @brief Retrieves a pointer to the value held by a node.
+ *
+ * Strings, maps and lists are returned as they are stored. Scalars and blobs
+ * are returned as a pointer to the storage inside the node (int64_t*,
+ * double*, bool* or hm_blob_t*).
+ *
+ * @param node Pointer to the node
+ * @return void* Pointer to the value
+ */
+static void* hm_node_value_ref(node_t* node)
+{
+    switch (node->value_type) {
+    case HM_VALUE_INT64:
+        return &node->i64;
+    case HM_VALUE_DOUBLE:
+        return &node->f64;
+    case HM_VALUE_BOOL:
+        return &node->boolean;
+    case HM_VALUE_BLOB:
+        return &node->blob;
+    default:
+        return node->value;
+    }
+}
+
+#define HM_WHEEL_SLOTS (1 << HM_WHEEL_BITS)
+#define HM_WHEEL_MASK (HM_WHEEL_SLOTS - 1)
+
+struct hm_timer {
+    uint64_t expires_at;
+    node_t* node;
+    hashmap_t* owner;
+    hm_wheel_t* wheel;
+    // Intrusive list of the slot holding the timer
+    struct hm_timer* next;
+    struct hm_timer** pprev;
+    int level;
+};
+
+/*
+ * Hierarchical timing wheel. Level 0 has one slot per millisecond, each slot
+ * of level n spans the whole of level n - 1. Timers move down one level at a
+ * time as their slot comes up, so each one is touched at most
+ * HM_WHEEL_LEVELS times. Timers due past the last level wait in overflow.
+ */
+struct hm_wheel {
+    uint64_t now;
+    hm_timer_t* slots[HM_WHEEL_LEVELS][HM_WHEEL_SLOTS];
+    size_t counts[HM_WHEEL_LEVELS];
+    hm_timer_t* overflow;
+    // Due timers whose entries were not reclaimed yet
+    hm_timer_t* expired;
+};
+
+/**
+ * @brief Reads the monotonic clock used by TTLs
+ *
+ * @return uint64_t Milliseconds since an arbitrary point
+ */
+uint64_t hm_clock_ms(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void hm_timer_link(hm_timer_t** head, hm_timer_t* timer)
+{
+    timer->next = *head;
+    timer->pprev = head;
+    if (*head != NULL) {
+        (*head)->pprev = &timer->next;
+    }
+    *head = timer;
+}
+
+static void hm_timer_unlink(hm_timer_t* timer)
+{
+    if (timer->pprev == NULL) {
+        return;
+    }
+
+    *timer->pprev = timer->next;
+    if (timer->next != NULL) {
+        timer->next->pprev = timer->pprev;
+    }
+    if (timer->level >= 0) {
+        timer->wheel->counts[timer->level]--;
+    }
+
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->level = -1;
+}
+
+/**
+ * @brief Files a timer in the slot matching its distance to the wheel's time
+ *
+ * @param wheel Pointer to the wheel
+ * @param timer Pointer to the timer
+ */
+static void hm_wheel_add(hm_wheel_t* wheel, hm_timer_t* timer)
+{
+    timer->wheel = wheel;
+    timer->level = -1;
+
+    if (timer->expires_at <= wheel->now) {
+        hm_timer_link(&wheel->expired, timer);
+        return;
+    }
+
+    uint64_t delta = timer->expires_at - wheel->now;
+
+    for (int level = 0; level < HM_WHEEL_LEVELS; level++) {
+        if (delta >> (HM_WHEEL_BITS * (level + 1)) == 0) {
+            int slot = (timer->expires_at >> (HM_WHEEL_BITS * level)) & HM_WHEEL_MASK;
+            hm_timer_link(&wheel->slots[level][slot], timer);
+            timer->level = level;
+            wheel->counts[level]++;
+            return;
+        }
+    }
+
+    hm_timer_link(&wheel->overflow, timer);
+}
+
+/**
+ * @brief Moves the timers of a list back through hm_wheel_add
+ *
+ * @param wheel Pointer to the wheel
+ * @param head List of timers
+ */
+static void hm_wheel_refile(hm_wheel_t* wheel, hm_timer_t** head)
+{
+    while (*head != NULL) {
+        hm_timer_t* timer = *head;
+        hm_timer_unlink(timer);
+        hm_wheel_add(wheel, timer);
+    }
+}
+
+/**
+ * @brief Advances the wheel up to the given time, moving due timers to the
+ * expired list.
+ *
+ * Stretches in which the lower levels are empty are skipped in one step, so
+ * the cost does not grow with the time elapsed between calls.
+ *
+ * @param wheel Pointer to the wheel
+ * @param now Current time, from hm_clock_ms
+ */
+static void hm_wheel_advance(hm_wheel_t* wheel, uint64_t now)
+{
+    while (wheel->now < now) {
+        int empty = 0;
+
+        while (empty < HM_WHEEL_LEVELS && wheel->counts[empty] == 0) {
+            empty++;
+        }
+
+        if (empty == HM_WHEEL_LEVELS && wheel->overflow == NULL) {
+            wheel->now = now;
+            break;
+        }
+
+        // Jumps to just before the next slot that may hold something
+        if (empty > 0) {
+            int bits = HM_WHEEL_BITS * (empty < HM_WHEEL_LEVELS ? empty : HM_WHEEL_LEVELS - 1);
+            uint64_t next = wheel->now | ((1ull << bits) - 1);
+            if (next >= now) {
+                wheel->now = now;
+                break;
+            }
+            wheel->now = next;
+        }
+
+        uint64_t tick = ++wheel->now;
+
+        // Higher levels first, so their timers can still land in the lower slots refiled below
+        for (int level = HM_WHEEL_LEVELS - 1; level > 0; level--) {
+            if ((tick & ((1ull << (HM_WHEEL_BITS * level)) - 1)) != 0) {
+                continue;
+            }
+            if (level == HM_WHEEL_LEVELS - 1) {
+                hm_wheel_refile(wheel, &wheel->overflow);
+            }
+            hm_wheel_refile(wheel, &wheel->slots[level][(tick >> (HM_WHEEL_BITS * level)) & HM_WHEEL_MASK]);
+        }
+
+        hm_wheel_refile(wheel, &wheel->slots[0][tick & HM_WHEEL_MASK]);
+    }
+}
+
+/**
+ * @brief Cancels and frees the timer of a node
+ *
+ * @param node Pointer to the node
+ */
+static void hm_node_timer_free(node_t* node)
+{
+    if (node->timer == NULL) {
+        return;
+    }
+
+    hm_timer_unlink(node->timer);
+    free(node->timer);
+    node->timer = NULL;
+}
+
+/**
+ * @brief Checks whether the TTL of a node ran out. Only nodes with a timer
+ * read the clock.
+ *
+ * @param node Pointer to the node
+ * @return bool Whether the node expired
+ */
+static bool hm_node_expired(node_t* node)
+{
+    return node->timer != NULL && node->timer->expires_at <= hm_clock_ms();
+}
+
+/**
+ * @brief Deallocates a wheel, detaching the timers still filed in it
+ *
+ * @param wheel Pointer to the wheel
+ */
+static void hm_wheel_free(hm_wheel_t* wheel)
+{
+    hm_timer_t** lists[HM_WHEEL_LEVELS * HM_WHEEL_SLOTS + 2];
+    size_t count = 0;
+
+    for (int level = 0; level < HM_WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < HM_WHEEL_SLOTS; slot++) {
+            lists[count++] = &wheel->slots[level][slot];
+        }
+    }
+    lists[count++] = &wheel->overflow;
+    lists[count++] = &wheel->expired;
+
+    for (size_t i = 0; i < count; i++) {
+        while (*lists[i] != NULL) {
+            node_t* node = (*lists[i])->node;
+            hm_node_timer_free(node);
+        }
+    }
+
+    free(wheel);
+}
+
 /**
  * @brief Deallocates the memory used by a node
  *
@@ -95,26 +441,14 @@ void hm_node_free(void** node_p)
 
     node_t* node = *node_p;
 
-    HM_LOG(LOG_LEVEL_DEBUG, "Freeing node key [%s][%p]", node->key, &node->key);
-    if (node->key) {
+    HM_LOG(LOG_LEVEL_DEBUG, "Freeing node key [%.*s][%p]", (int)node->key_len, node->key ? node->key : "", &node->key);
+    if (node->key && !(node->flags & HM_NODE_KEY_BORROWED)) {
         free(node->key);
-        node->key = NULL;
     }
+    node->key = NULL;
 
-    if (node->value) {
-        switch (node->value_type) {
-        case HM_VALUE_STR:
-            free(node->value);
-            break;
-        case HM_VALUE_MAP:
-            hm_free((void**)&node->value);
-            break;
-        case HM_VALUE_LIST:
-            hm_list_free((void**)&node->value);
-            break;
-        }
-        node->value = NULL;
-    }
+    hm_node_value_free(node);
+    hm_node_timer_free(node);
 
     free(node);
     *node_p = NULL;
@@ -146,7 +480,7 @@ list_t* hm_list_new(void)
  * @param capacity List capacity
  * @return list_t* List
  */
-list_t* hm_list_create(int capacity)
+list_t* hm_list_create(size_t capacity)
 {
     list_t* list = hm_list_new();
 
@@ -170,6 +504,30 @@ list_t* hm_list_create_default(void)
     return hm_list_create(HM_LIST_INITIAL_CAPACITY);
 }
 
+/**
+ * @brief Scales a capacity by a factor, failing instead of overflowing
+ *
+ * Computed in double precision, a float would round capacities above 2^24.
+ *
+ * @param capacity Current capacity
+ * @param factor Scale factor
+ * @param scaled Receives the new capacity
+ * @return int Status code (HM_SUCCESS or HM_ERROR)
+ */
+static int hm_scale_capacity(size_t capacity, double factor, size_t* scaled)
+{
+    double target = (double)capacity * factor;
+
+    if (target >= (double)HM_MAX_CAPACITY) {
+        HM_LOG(LOG_LEVEL_ERROR, "Capacity %zu can not be scaled by %.2f", capacity, factor);
+        return HM_ERROR;
+    }
+
+    *scaled = (size_t)target;
+
+    return HM_SUCCESS;
+}
+
 /**
  * @brief Appends a node to the end of the list
  *
@@ -183,7 +541,11 @@ void hm_list_append(list_t* list, node_t* node)
     }
 
     if (list->size == list->capacity) {
-        int new_capacity = HM_LIST_RESIZE_FACTOR * list->capacity;
+        size_t new_capacity = 0;
+
+        if (hm_scale_capacity(list->capacity, HM_LIST_RESIZE_FACTOR, &new_capacity) == HM_ERROR) {
+            return;
+        }
 
         node_t** new_items = realloc(list->items, new_capacity * sizeof(node_t*));
         if (new_items == NULL) {
@@ -236,10 +598,31 @@ int hm_node_compare(const void* a, const void* b)
     node_t* node_a = *(node_t**)a;
     node_t* node_b = *(node_t**)b;
 
-    if (node_a->value_type == HM_VALUE_STR && node_b->value_type == HM_VALUE_STR) {
+    // Nodes of different types are ordered by type
+    if (node_a->value_type != node_b->value_type) {
+        return node_a->value_type < node_b->value_type ? -1 : 1;
+    }
+
+    switch (node_a->value_type) {
+    case HM_VALUE_STR:
         return strcmp((char*)node_a->value, (char*)node_b->value);
+    case HM_VALUE_INT64:
+        return (node_a->i64 > node_b->i64) - (node_a->i64 < node_b->i64);
+    case HM_VALUE_DOUBLE:
+        return (node_a->f64 > node_b->f64) - (node_a->f64 < node_b->f64);
+    case HM_VALUE_BOOL:
+        return (int)node_a->boolean - (int)node_b->boolean;
+    case HM_VALUE_BLOB: {
+        size_t len = node_a->blob.len < node_b->blob.len ? node_a->blob.len : node_b->blob.len;
+        int cmp = len ? memcmp(node_a->blob.data, node_b->blob.data, len) : 0;
+        if (cmp != 0) {
+            return cmp;
+        }
+        return (node_a->blob.len > node_b->blob.len) - (node_a->blob.len < node_b->blob.len);
+    }
+    default:
+        return 0;
     }
-    return 0;
 }
 
 /**
@@ -251,6 +634,8 @@ int hm_node_compare(const void* a, const void* b)
  */
 int hm_list_contains(list_t* list, char* str)
 {
+    node_t needle = { .value = str, .value_type = HM_VALUE_STR };
+    node_t* needle_p = &needle;
     node_t* node = NULL;
 
     if (list == NULL || str == NULL || list->capacity == 0) {
@@ -262,23 +647,19 @@ int hm_list_contains(list_t* list, char* str)
         qsort(list->items, list->size, sizeof(node_t*), hm_node_compare);
     }
 
-    int left = 0;
-    int right = list->size - 1;
+    size_t left = 0;
+    size_t right = list->size;
 
-    while (left <= right) {
-        int mid = left + (right - left) / 2;
+    while (left < right) {
+        size_t mid = left + (right - left) / 2;
 
         node = list->items[mid];
 
-        if (node->value_type != HM_VALUE_STR) {
-            continue;
-        }
-
-        int cmp = strcmp(str, (char*)node->value);
+        int cmp = hm_node_compare(&needle_p, &node);
         if (cmp == 0) {
             return HM_SUCCESS;
         } else if (cmp < 0) {
-            right = mid - 1;
+            right = mid;
         } else {
             left = mid + 1;
         }
@@ -295,7 +676,7 @@ void hm_list_free(void** list_p)
 
     list_t* list = *(list_t**)list_p;
 
-    for (int i = 0; i < list->size; i++) {
+    for (size_t i = 0; i < list->size; i++) {
         hm_node_free((void**)&list->items[i]);
     }
 
@@ -306,6 +687,77 @@ void hm_list_free(void** list_p)
     *list_p = NULL;
 }
 
+/**
+ * @brief Returns the length of the mapping holding a bucket array
+ *
+ * @param capacity Number of buckets
+ * @return size_t Length rounded up to whole huge pages
+ */
+static size_t hm_buckets_mapped_len(size_t capacity)
+{
+    size_t bytes = capacity * sizeof(node_t*);
+
+    return (bytes + HM_HUGE_PAGE_SIZE - 1) / HM_HUGE_PAGE_SIZE * HM_HUGE_PAGE_SIZE;
+}
+
+/**
+ * @brief Allocates a zeroed bucket array
+ *
+ * Arrays of at least HM_HUGE_TABLE_BYTES are mapped on huge pages, reserved
+ * ones when the system has any and transparent ones otherwise, so probes in
+ * large tables stop missing the TLB on almost every access.
+ *
+ * @param capacity Number of buckets
+ * @param mapped Set to true if the array was mapped rather than allocated
+ * @return node_t** Bucket array or NULL on error
+ */
+static node_t** hm_buckets_alloc(size_t capacity, bool* mapped)
+{
+    void* list = MAP_FAILED;
+
+    *mapped = false;
+
+    if (capacity > HM_MAX_CAPACITY) {
+        return NULL;
+    }
+
+    if (HM_HUGE_TABLE_BYTES > 0 && capacity * sizeof(node_t*) >= (size_t)HM_HUGE_TABLE_BYTES) {
+        size_t len = hm_buckets_mapped_len(capacity);
+
+#ifdef MAP_HUGETLB
+        list = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+        if (list == MAP_FAILED && (list = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) != MAP_FAILED) {
+#ifdef MADV_HUGEPAGE
+            madvise(list, len, MADV_HUGEPAGE);
+#endif
+        }
+
+        if (list != MAP_FAILED) {
+            *mapped = true;
+            return list;
+        }
+    }
+
+    return calloc(capacity, sizeof(node_t*));
+}
+
+/**
+ * @brief Releases a bucket array from hm_buckets_alloc
+ *
+ * @param list Bucket array
+ * @param capacity Number of buckets
+ * @param mapped Whether the array was mapped
+ */
+static void hm_buckets_free(node_t** list, size_t capacity, bool mapped)
+{
+    if (mapped) {
+        munmap(list, hm_buckets_mapped_len(capacity));
+    } else {
+        free(list);
+    }
+}
+
 /**
  * @brief Initializes a new hashmap
  *
@@ -322,6 +774,26 @@ hashmap_t* hm_new(void)
     hashmap->list = NULL;
     hashmap->capacity = 0;
     hashmap->size = 0;
+    hashmap->mapped = false;
+    hashmap->key_policy = HM_OWN_COPY;
+    hashmap->value_policy = HM_OWN_COPY;
+    hashmap->resize_count = 0;
+    hashmap->resize_ns = 0;
+    hashmap->digest_enabled = false;
+    hashmap->digest = 0;
+    hashmap->parent = NULL;
+    hashmap->parent_node = NULL;
+    hashmap->accounting = false;
+    hashmap->bytes = 0;
+    hashmap->budget = 0;
+    hashmap->hand = 0;
+    hashmap->wal = NULL;
+    hashmap->wheel = NULL;
+    hashmap->path_cache = NULL;
+    hashmap->generation = 0;
+#ifdef HM_ENABLE_COUNTERS
+    memset(&hashmap->counters, 0, sizeof(hashmap->counters));
+#endif
 
     return hashmap;
 }
@@ -332,7 +804,7 @@ hashmap_t* hm_new(void)
  * @param capacity The hashmap's initial capacity
  * @return hashmap_t* Pointer to the new hashmap
  */
-hashmap_t* hm_create(int capacity)
+hashmap_t* hm_create(size_t capacity)
 {
     hashmap_t* hashmap = hm_new();
 
@@ -340,7 +812,7 @@ hashmap_t* hm_create(int capacity)
         return NULL;
     }
 
-    hashmap->list = calloc(capacity, sizeof(node_t*));
+    hashmap->list = hm_buckets_alloc(capacity, &hashmap->mapped);
     hashmap->capacity = capacity;
 
     return hashmap;
@@ -356,6 +828,42 @@ hashmap_t* hm_create_default(void)
     return hm_create(HM_INITIAL_CAPACITY);
 }
 
+/**
+ * @brief Sets how the hashmap stores the keys and values given to it.
+ *
+ *  - HM_OWN_COPY: Keys and strings/blobs are duplicated (default).
+ *
+ *  - HM_OWN_BORROW: The caller's pointer is stored and never freed. The
+ * caller must keep it alive and unchanged while the entry exists.
+ *
+ *  - HM_OWN_TAKE: Only for values. The heap allocated string or blob data is
+ * stored without being duplicated and freed along with the entry.
+ *
+ * Hashmaps created by hm_insert inherit the policies of their parent. Entries
+ * already in the hashmap keep the ownership they were inserted with.
+ * Inserting the pointer an entry already holds keeps it as it is.
+ *
+ * A value is only taken once it is stored. It stays owned by the caller when
+ * the insert fails and when hm_upsert finds the key already present, and the
+ * caller has to free it then.
+ *
+ * @param hashmap Pointer to the hashmap
+ * @param key_policy Ownership of keys (HM_OWN_COPY or HM_OWN_BORROW)
+ * @param value_policy Ownership of string and blob values
+ * @return int Status code (HM_SUCCESS or HM_ERROR)
+ */
+int hm_set_ownership(hashmap_t* hashmap, hm_own_t key_policy, hm_own_t value_policy)
+{
+    if (hashmap == NULL || key_policy == HM_OWN_TAKE) {
+        return HM_ERROR;
+    }
+
+    hashmap->key_policy = key_policy;
+    hashmap->value_policy = value_policy;
+
+    return HM_SUCCESS;
+}
+
 /**
  * @brief Retrieves the load factor of the hashmap
  *
@@ -372,7 +880,7 @@ float hm_get_load_factor(hashmap_t* hashmap)
         return 0.0;
     }
 
-    return (float)hashmap->size / hashmap->capacity;
+    return (float)((double)hashmap->size / hashmap->capacity);
 }
 
 /**
@@ -388,392 +896,3006 @@ void hm_free(void** hashmap_p)
 
     hashmap_t* hashmap = *hashmap_p;
 
-    for (int i = 0; i < hashmap->capacity; i++) {
+    if (hashmap->wal != NULL) {
+        hm_wal_close(hashmap);
+    }
+
+    // Stops as soon as every node was found, skipping the trailing empty buckets
+    for (size_t i = 0; i < hashmap->capacity && hashmap->size > 0; i++) {
         node_t* current_node = hashmap->list[i];
         while (current_node != NULL) {
             node_t* next_node = current_node->next;
             HM_LOG(LOG_LEVEL_DEBUG, "Freeing node [c:%p][n:%p]", current_node, next_node);
             hm_node_free((void**)&current_node);
+            hashmap->size--;
             current_node = next_node;
         }
         hashmap->list[i] = NULL;
     }
 
-    free(hashmap->list);
+    hm_buckets_free(hashmap->list, hashmap->capacity, hashmap->mapped);
     hashmap->list = NULL;
 
+    if (hashmap->wheel != NULL) {
+        hm_wheel_free(hashmap->wheel);
+    }
+
+    free(hashmap->path_cache);
+
     free(hashmap);
     *hashmap_p = NULL;
 }
 
 /**
- * @brief Hashes a key and returns the bucket index
+ * @brief Hashes a length delimited key
  *
- * @param hashmap Pointer to the hashmap
- * @param key Key to be hashed
- * @return int Bucket index
+ * The hash is cached inside each node, so tables never rehash keys when they
+ * are resized.
+ *
+ * @param key Key bytes
+ * @param len Number of bytes
+ * @return uint64_t Hash code
  */
-int hm_hash(hashmap_t* hashmap, char* key)
+uint64_t hm_key_hash(const char* key, size_t len)
 {
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    uint64_t code = 0;
 
-    unsigned char* hash = NULL;
-    unsigned int hash_code = 0;
+    SHA256((const unsigned char*)key, len, hash);
 
-    if ((hash = sha256_hash(key)) == NULL) {
-        return HM_ERROR;
+    for (int i = 0; i < 8; i++) {
+        code = (code << 8) | hash[i];
     }
 
-    hash_code = ((unsigned int)hash[0] << 24) | ((unsigned int)hash[1] << 16) | ((unsigned int)hash[2] << 8) | (unsigned int)hash[3];
-
-    free(hash);
-    hash = NULL;
-
-    return hash_code % hashmap->capacity;
+    return code;
 }
 
 /**
- * @brief Rehashes a key to a new hashmap
+ * @brief Hashes a key and returns the bucket index
  *
  * @param hashmap Pointer to the hashmap
- * @param key Key to be rehashed
- * @param value_type Value type
- * @param value Value
+ * @param key Key to be hashed
+ * @return int64_t Bucket index or HM_ERROR
  */
-void hm_rehash_insert(hashmap_t* hashmap, char* key, node_value_t value_type, void* value)
+int64_t hm_hash(hashmap_t* hashmap, char* key)
 {
-
-    int bucket = 0;
-    node_t* node = NULL;
-
-    if (key == NULL || key[0] == '\0') {
-        return;
-    }
-
-    bucket = hm_hash(hashmap, key);
-    if (bucket == HM_ERROR) {
-        HM_LOG(LOG_LEVEL_ERROR, "Error hashing key!", key);
-        return;
-    }
-
-    if ((node = hm_node_create(strdup(key), value_type, value, hashmap->list[bucket])) == NULL) {
-        return;
+    if (hashmap == NULL || key == NULL || hashmap->capacity == 0) {
+        return HM_ERROR;
     }
 
-    // Sets the new node as the head of the bucket
-    hashmap->list[bucket] = node;
+    return (int64_t)(hm_key_hash(key, strlen(key)) % hashmap->capacity);
 }
 
+static void hm_account_add(hashmap_t* hashmap, size_t add, size_t sub);
+
 /**
- * @brief Resizes the hashmap according to the given factor
+ * @brief Rebuilds the bucket array of the hashmap with the given capacity
  *
  * @param hashmap Pointer to the hashmap
- * @param resize_factor Resize factor
+ * @param capacity New capacity
  * @return int Status code (HM_SUCCESS or HM_ERROR)
  */
-int hm_resize(hashmap_t* hashmap, float resize_factor)
+static int hm_rebuild(hashmap_t* hashmap, size_t capacity)
 {
-    size_t new_size = 0;
-
-    hashmap_t* aux_hashmap = NULL;
+    node_t** new_list = NULL;
     node_t* current_node = NULL;
     node_t* next_node = NULL;
+    size_t old_capacity = hashmap->capacity;
+    size_t seen = 0;
+    bool mapped = false;
+    struct timespec start, end;
 
-    if (hashmap == NULL || resize_factor <= 1.0) {
-        return HM_ERROR;
-    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
-    // Creates a new auxiliar hashmap to store the rehashed nodes
-    new_size = (size_t)(hashmap->capacity * resize_factor);
-    aux_hashmap = hm_create(new_size);
-    if (aux_hashmap == NULL) {
+    if ((new_list = hm_buckets_alloc(capacity, &mapped)) == NULL) {
         return HM_ERROR;
     }
 
-    for (int i = 0; i < hashmap->capacity; i++) {
+    hashmap->capacity = capacity;
+
+    for (size_t i = 0; i < old_capacity && seen < hashmap->size; i++) {
         current_node = hashmap->list[i];
 
         while (current_node != NULL) {
-            hm_rehash_insert(aux_hashmap, current_node->key, current_node->value_type, current_node->value);
-
             next_node = current_node->next;
-            free(current_node);
+
+            // Relinks the node itself so pointers to it stay valid
+            size_t bucket = current_node->hash % capacity;
+            current_node->next = new_list[bucket];
+            new_list[bucket] = current_node;
+
             current_node = next_node;
+            seen++;
         }
     }
 
-    // Frees the old hashmap
-    free(hashmap->list);
-    hashmap->list = aux_hashmap->list;
-    hashmap->capacity = aux_hashmap->capacity;
+    hm_buckets_free(hashmap->list, old_capacity, hashmap->mapped);
+    hashmap->list = new_list;
+    hashmap->mapped = mapped;
+    hashmap->hand %= capacity;
+    hm_account_add(hashmap, capacity * sizeof(node_t*), old_capacity * sizeof(node_t*));
 
-    free(aux_hashmap);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    hashmap->resize_count++;
+    hashmap->resize_ns += (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000ull + (end.tv_nsec - start.tv_nsec);
 
     return HM_SUCCESS;
 }
 
 /**
- * @brief Searches for a value inside the hashmap.
+ * @brief Resizes the hashmap according to the given factor
+ *
+ * Factors below 1.0 shrink the hashmap. The capacity never drops below
+ * HM_INITIAL_CAPACITY and a shrink that would leave the hashmap above its
+ * load factor threshold is rejected.
+ *
+ * @param hashmap Pointer to the hashmap
+ * @param resize_factor Resize factor
+ * @return int Status code (HM_SUCCESS or HM_ERROR)
+ */
+int hm_resize(hashmap_t* hashmap, float resize_factor)
+{
+    size_t new_capacity = 0;
+
+    if (hashmap == NULL || hashmap->list == NULL || resize_factor <= 0.0 || resize_factor == 1.0) {
+        return HM_ERROR;
+    }
+
+    if (hm_scale_capacity(hashmap->capacity, resize_factor, &new_capacity) == HM_ERROR) {
+        return HM_ERROR;
+    }
+
+    if (new_capacity < HM_INITIAL_CAPACITY) {
+        new_capacity = HM_INITIAL_CAPACITY;
+    }
+
+    if (new_capacity == hashmap->capacity) {
+        return HM_SUCCESS;
+    }
+
+    if (new_capacity < hashmap->capacity && (double)hashmap->size / new_capacity >= HM_LOAD_FACTOR_THRESHOLD) {
+        return HM_ERROR;
+    }
+
+    return hm_rebuild(hashmap, new_capacity);
+}
+
+/**
+ * @brief Shrinks the hashmap if its load factor dropped below the shrink
+ * threshold.
+ *
+ * The gap between HM_SHRINK_LOAD_FACTOR_THRESHOLD and HM_LOAD_FACTOR_THRESHOLD
+ * keeps alternating inserts and removals from resizing back and forth.
+ *
+ * @param hashmap Pointer to the hashmap
+ */
+static void hm_shrink_if_sparse(hashmap_t* hashmap)
+{
+    if (hashmap->capacity <= HM_INITIAL_CAPACITY) {
+        return;
+    }
+
+    if (hm_get_load_factor(hashmap) < HM_SHRINK_LOAD_FACTOR_THRESHOLD) {
+        HM_LOG(LOG_LEVEL_DEBUG, "Shrink threshold reached. Resizing hashmap");
+        hm_resize(hashmap, HM_SHRINK_FACTOR);
+    }
+}
+
+/**
+ * @brief Shrinks a list's storage to its size
+ *
+ * @param list Pointer to the list
+ */
+static void hm_list_compact(list_t* list)
+{
+    size_t new_capacity = list->size > HM_LIST_INITIAL_CAPACITY ? list->size : HM_LIST_INITIAL_CAPACITY;
+
+    if (list->items == NULL || new_capacity >= list->capacity) {
+        return;
+    }
+
+    node_t** new_items = realloc(list->items, new_capacity * sizeof(node_t*));
+    if (new_items == NULL) {
+        return;
+    }
+
+    list->items = new_items;
+    list->capacity = new_capacity;
+}
+
+static int hm_compact_map(hashmap_t* hashmap);
+
+/**
+ * @brief Compacts the value held by a node
+ *
+ * @param node Pointer to the node
+ */
+static void hm_node_compact(node_t* node)
+{
+    if (node->value == NULL) {
+        return;
+    }
+
+    if (node->value_type == HM_VALUE_MAP) {
+        hm_compact_map(node->value);
+    } else if (node->value_type == HM_VALUE_LIST) {
+        list_t* list = node->value;
+        for (size_t i = 0; i < list->size; i++) {
+            hm_node_compact(list->items[i]);
+        }
+        hm_list_compact(list);
+    }
+}
+
+/**
+ * @brief Compacts a hashmap and everything beneath it
+ *
+ * @param hashmap Pointer to the hashmap
+ * @return int Status code (HM_SUCCESS or HM_ERROR)
+ */
+static int hm_compact_map(hashmap_t* hashmap)
+{
+    size_t seen = 0;
+
+    for (size_t i = 0; i < hashmap->capacity && seen < hashmap->size; i++) {
+        for (node_t* node = hashmap->list[i]; node != NULL; node = node->next) {
+            hm_node_compact(node);
+            seen++;
+        }
+    }
+
+    size_t new_capacity = (size_t)(hashmap->size / HM_LOAD_FACTOR_THRESHOLD) + 1;
+    if (new_capacity < HM_INITIAL_CAPACITY) {
+        new_capacity = HM_INITIAL_CAPACITY;
+    }
+
+    if (new_capacity >= hashmap->capacity) {
+        return HM_SUCCESS;
+    }
+
+    return hm_rebuild(hashmap, new_capacity);
+}
+
+static void hm_account_refresh(hashmap_t* hashmap);
+
+/**
+ * @brief Rebuilds every hashmap and list of the tree with the smallest
+ * capacity that keeps them under their load factor threshold.
+ *
+ * Useful after removing large parts of a tree, since empty buckets are still
+ * scanned by iteration and serialization.
+ *
+ * @param hashmap Pointer to the hashmap
+ * @return int Status code (HM_SUCCESS or HM_ERROR)
+ */
+int hm_compact(hashmap_t* hashmap)
+{
+    int status = HM_SUCCESS;
+
+    if (hashmap == NULL || hashmap->list == NULL) {
+        return HM_ERROR;
+    }
+
+    status = hm_compact_map(hashmap);
+
+    // Shrunk lists are not tracked one by one, the tree is accounted again
+    if (hashmap->accounting) {
+        hm_account_refresh(hashmap);
+    }
+
+    return status;
+}
+
+/**
+ * @brief Grows the hashmap so it can hold the given number of entries without
+ * crossing its load factor threshold.
+ *
+ * The capacity follows the same HM_RESIZE_FACTOR steps as regular growth.
+ *
+ * @param hashmap Pointer to the hashmap
+ * @param entries Expected number of entries
+ * @return int Status code (HM_SUCCESS or HM_ERROR)
+ */
+int hm_reserve(hashmap_t* hashmap, size_t entries)
+{
+    size_t new_capacity = 0;
+
+    if (hashmap == NULL || hashmap->list == NULL || hashmap->capacity == 0) {
+        return HM_ERROR;
+    }
+
+    new_capacity = hashmap->capacity;
+    while ((double)entries / new_capacity >= HM_LOAD_FACTOR_THRESHOLD) {
+        if (hm_scale_capacity(new_capacity, HM_RESIZE_FACTOR, &new_capacity) == HM_ERROR) {
+            return HM_ERROR;
+        }
+    }
+
+    if (new_capacity == hashmap->capacity) {
+        return HM_SUCCESS;
+    }
+
+    return hm_rebuild(hashmap, new_capacity);
+}
+
+/**
+ * @brief Collects a NULL terminated list of keys into an array.
+ *
+ * @param args Variable argument list positioned at the first key
+ * @param keys Array that receives the keys
+ * @return int Number of keys collected or HM_ERROR if the path is too deep
+ */
+static int hm_collect_keys(va_list args, hm_key_t* keys)
+{
+    int depth = 0;
+    char* key = NULL;
+
+    while ((key = va_arg(args, char*)) != NULL) {
+        if (depth == HM_MAX_PATH_DEPTH) {
+            HM_LOG(LOG_LEVEL_ERROR, "Key path deeper than %d levels", HM_MAX_PATH_DEPTH);
+            return HM_ERROR;
+        }
+        keys[depth].data = key;
+        keys[depth].len = strlen(key);
+        depth++;
+    }
+
+    return depth;
+}
+
+/**
+ * @brief Looks up a key inside a single level of the hashmap.
+ *
+ * @param hashmap Pointer to the hashmap
+ * @param key Key to be searched
+ * @param hash Hash of the key
+ * @return node_t* Node holding the key or NULL if it was not found
+ */
+static node_t* hm_bucket_find(hashmap_t* hashmap, const hm_key_t* key, uint64_t hash)
+{
+    for (node_t* node = hashmap->list[hash % hashmap->capacity]; node != NULL; node = node->next) {
+        if (node->hash == hash && node->key_len == key->len && !memcmp(key->data, node->key, key->len)) {
+            return node;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Walks a path of keys without creating anything.
+ *
+ * @param hashmap Pointer to the root hashmap
+ * @param keys Array of keys
+ * @param depth Number of keys
+ * @param owner Receives the hashmap that holds the returned node (optional)
+ * @return node_t* Node at the end of the path or NULL if it does not exist
+ */
+static node_t* hm_walk(hashmap_t* hashmap, const hm_key_t* keys, size_t depth, hashmap_t** owner)
+{
+    hashmap_t* current_hm = hashmap;
+    node_t* node = NULL;
+
+    for (size_t i = 0; i < depth; i++) {
+        if (current_hm == NULL || current_hm->list == NULL) {
+            return NULL;
+        }
+
+        HM_COUNT(current_hm, searches);
+
+        node = hm_bucket_find(current_hm, &keys[i], hm_key_hash(keys[i].data, keys[i].len));
+
+        // Expired entries are invisible until hm_expire_tick reclaims them
+        if (node == NULL || hm_node_expired(node)) {
+            HM_COUNT(current_hm, misses);
+            return NULL;
+        }
+
+        HM_COUNT(current_hm, hits);
+
+        if (i + 1 < depth) {
+            if (node->value_type != HM_VALUE_MAP) {
+                return NULL;
+            }
+            current_hm = node->value;
+        }
+    }
+
+    // Only written when clear, so hot entries do not keep dirtying their cache line
+    if (current_hm->accounting && !node->referenced) {
+        node->referenced = 1;
+    }
+
+    if (owner) {
+        *owner = current_hm;
+    }
+
+    return node;
+}
+
+/**
+ * @brief Finalizes a 64 bit digest (splitmix64)
+ *
+ * @param x Value to be mixed
+ * @return uint64_t Mixed value
+ */
+static uint64_t hm_digest_mix(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+
+    return x;
+}
+
+/**
+ * @brief Digests a run of bytes (FNV-1a followed by a final mix)
+ *
+ * @param data Bytes to be digested
+ * @param len Number of bytes
+ * @param seed Seed, used to tell value types apart
+ * @return uint64_t Digest
+ */
+static uint64_t hm_digest_bytes(const void* data, size_t len, uint64_t seed)
+{
+    const unsigned char* bytes = data;
+    uint64_t hash = 0xcbf29ce484222325ULL ^ hm_digest_mix(seed);
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hm_digest_mix(hash ^ len);
+}
+
+static void hm_digest_build(hashmap_t* hashmap);
+static void hm_unlink_node(hashmap_t* hashmap, node_t* node);
+static void hm_account_build(hashmap_t* hashmap, bool rebuild);
+
+/**
+ * @brief Computes the digest of a node from its key and value.
+ *
+ * Nested maps contribute their cached digest and get their parent pointers
+ * set, so later changes beneath them can be propagated upwards. Maps kept
+ * inside lists point to the node holding the list.
+ *
+ * @param owner Hashmap that holds the node, or the node holding its list
+ * @param holder Node held by owner
+ * @param node Node to be digested
+ * @param rebuild Recomputes nested maps instead of using their digest
+ * @return uint64_t Digest of the node
+ */
+static uint64_t hm_node_digest(hashmap_t* owner, node_t* holder, node_t* node, bool rebuild)
+{
+    uint64_t tag = (uint64_t)node->value_type + 1;
+    uint64_t value = 0;
+
+    switch (node->value_type) {
+    case HM_VALUE_STR:
+        value = hm_digest_bytes(node->value, node->value ? strlen(node->value) : 0, tag);
+        break;
+    case HM_VALUE_MAP: {
+        hashmap_t* map = node->value;
+        value = hm_digest_mix(tag);
+        if (map != NULL) {
+            if (rebuild || !map->digest_enabled) {
+                hm_digest_build(map);
+            }
+            map->parent = owner;
+            map->parent_node = holder;
+            value = hm_digest_mix(value + map->digest);
+        }
+        break;
+    }
+    case HM_VALUE_LIST: {
+        list_t* list = node->value;
+        // Lists are ordered, so their items are chained instead of summed
+        value = hm_digest_mix(tag);
+        for (size_t i = 0; list != NULL && i < list->size; i++) {
+            value = hm_digest_mix(value + hm_node_digest(owner, holder, list->items[i], rebuild));
+        }
+        break;
+    }
+    case HM_VALUE_INT64:
+        value = hm_digest_mix(hm_digest_mix(tag) ^ (uint64_t)node->i64);
+        break;
+    case HM_VALUE_DOUBLE: {
+        uint64_t bits = 0;
+        memcpy(&bits, &node->f64, sizeof(bits));
+        value = hm_digest_mix(hm_digest_mix(tag) ^ bits);
+        break;
+    }
+    case HM_VALUE_BOOL:
+        value = hm_digest_mix(hm_digest_mix(tag) ^ (uint64_t)node->boolean);
+        break;
+    case HM_VALUE_BLOB:
+        value = hm_digest_bytes(node->blob.data, node->blob.len, tag);
+        break;
+    }
+
+    return hm_digest_mix(hm_digest_bytes(node->key, node->key_len, 0) ^ (value * 0x9e3779b97f4a7c15ULL));
+}
+
+/**
+ * @brief Computes the digest of every node of a tree from scratch
+ *
+ * @param hashmap Pointer to the hashmap
+ */
+static void hm_digest_build(hashmap_t* hashmap)
+{
+    size_t seen = 0;
+
+    hashmap->digest_enabled = true;
+    hashmap->digest = 0;
+
+    for (size_t i = 0; i < hashmap->capacity && seen < hashmap->size; i++) {
+        for (node_t* node = hashmap->list[i]; node != NULL; node = node->next, seen++) {
+            node->digest = hm_node_digest(hashmap, node, node, true);
+            hashmap->digest += node->digest;
+        }
+    }
+}
+
+/**
+ * @brief Refreshes the digests of the ancestors of a hashmap whose digest
+ * changed.
+ *
+ * Map digests are the sum of their node digests, so each level only has to
+ * swap the old digest of one node for the new one.
+ *
+ * @param hashmap Pointer to the hashmap
+ */
+static void hm_digest_propagate(hashmap_t* hashmap)
+{
+    while (hashmap->parent != NULL && hashmap->parent->digest_enabled) {
+        hashmap_t* parent = hashmap->parent;
+        node_t* node = hashmap->parent_node;
+        uint64_t old = node->digest;
+
+        node->digest = hm_node_digest(parent, node, node, false);
+        parent->digest += node->digest - old;
+        hashmap = parent;
+    }
+}
+
+/**
+ * @brief Refreshes the digests along the path of a node that was inserted or
+ * modified.
+ *
+ * @param hashmap Hashmap that holds the node
+ * @param node Pointer to the node
+ */
+static void hm_digest_touch(hashmap_t* hashmap, node_t* node)
+{
+    if (!hashmap->digest_enabled) {
+        return;
+    }
+
+    uint64_t old = node->digest;
+
+    node->digest = hm_node_digest(hashmap, node, node, false);
+    hashmap->digest += node->digest - old;
+    hm_digest_propagate(hashmap);
+}
+
+/**
+ * @brief Refreshes the digests along the path of a node about to be removed.
+ *
+ * @param hashmap Hashmap that holds the node
+ * @param node Pointer to the node
+ */
+static void hm_digest_drop(hashmap_t* hashmap, node_t* node)
+{
+    if (!hashmap->digest_enabled) {
+        return;
+    }
+
+    hashmap->digest -= node->digest;
+    node->digest = 0;
+    hm_digest_propagate(hashmap);
+}
+
+/**
+ * @brief Computes the bytes held by a node's value.
+ *
+ * Follows hm_stats: borrowed values are not accounted, nested maps contribute
+ * their cached total and get their parent pointers set, lists are walked.
+ *
+ * @param owner Hashmap that holds the node, or the node holding its list
+ * @param holder Node held by owner
+ * @param node Node whose value is accounted
+ * @return size_t Number of bytes
+ */
+static size_t hm_value_bytes(hashmap_t* owner, node_t* holder, node_t* node)
+{
+    bool owned = !(node->flags & HM_NODE_VALUE_BORROWED);
+    size_t bytes = 0;
+
+    switch (node->value_type) {
+    case HM_VALUE_STR:
+        if (owned && node->value) {
+            bytes = strlen(node->value) + 1;
+        }
+        break;
+    case HM_VALUE_BLOB:
+        if (owned) {
+            bytes = node->blob.len;
+        }
+        break;
+    case HM_VALUE_MAP: {
+        hashmap_t* map = node->value;
+        if (map != NULL) {
+            if (!map->accounting) {
+                hm_account_build(map, false);
+            }
+            map->parent = owner;
+            map->parent_node = holder;
+            bytes = map->bytes;
+        }
+        break;
+    }
+    case HM_VALUE_LIST: {
+        list_t* list = node->value;
+        if (list != NULL) {
+            bytes = sizeof(list_t) + list->capacity * sizeof(node_t*);
+            for (size_t i = 0; i < list->size; i++) {
+                bytes += sizeof(node_t) + hm_value_bytes(owner, holder, list->items[i]);
+            }
+        }
+        break;
+    }
+    case HM_VALUE_INT64:
+    case HM_VALUE_DOUBLE:
+    case HM_VALUE_BOOL:
+        break;
+    }
+
+    return bytes;
+}
+
+/**
+ * @brief Computes the bytes held by a node, its key and its value
+ *
+ * @param hashmap Hashmap that holds the node
+ * @param node Pointer to the node
+ * @return size_t Number of bytes
+ */
+static size_t hm_node_bytes(hashmap_t* hashmap, node_t* node)
+{
+    size_t bytes = sizeof(node_t) + hm_value_bytes(hashmap, node, node);
+
+    if (!(node->flags & HM_NODE_KEY_BORROWED)) {
+        bytes += node->key_len + 1;
+    }
+
+    return bytes;
+}
+
+/**
+ * @brief Accounts every node of a tree from scratch
+ *
+ * @param hashmap Pointer to the hashmap
+ * @param rebuild Recomputes nested maps instead of using their total
+ */
+static void hm_account_build(hashmap_t* hashmap, bool rebuild)
+{
+    size_t seen = 0;
+
+    hashmap->accounting = true;
+    hashmap->bytes = sizeof(hashmap_t) + hashmap->capacity * sizeof(node_t*);
+
+    for (size_t i = 0; i < hashmap->capacity && seen < hashmap->size; i++) {
+        for (node_t* node = hashmap->list[i]; node != NULL; node = node->next, seen++) {
+            if (rebuild && node->value_type == HM_VALUE_MAP && node->value != NULL) {
+                hm_account_build(node->value, true);
+            }
+            hashmap->bytes += hm_node_bytes(hashmap, node);
+        }
+    }
+}
+
+/**
+ * @brief Adds a change in bytes to a hashmap and its accounted ancestors
+ *
+ * @param hashmap Pointer to the hashmap
+ * @param add Bytes allocated
+ * @param sub Bytes released
+ */
+static void hm_account_add(hashmap_t* hashmap, size_t add, size_t sub)
+{
+    for (; hashmap != NULL && hashmap->accounting; hashmap = hashmap->parent) {
+        hashmap->bytes += add;
+        hashmap->bytes -= sub;
+    }
+}
+
+/**
+ * @brief Accounts a tree again and passes the difference to its ancestors
+ *
+ * @param hashmap Pointer to the hashmap
+ */
+static void hm_account_refresh(hashmap_t* hashmap)
+{
+    size_t before = hashmap->accounting ? hashmap->bytes : 0;
+
+    hm_account_build(hashmap, true);
+    hm_account_add(hashmap->parent, hashmap->bytes, before);
+}
+
+/**
+ * @brief Returns the bytes held by a node of an accounted hashmap, 0 otherwise.
+ *
+ * Taken before a node is modified, then given to hm_account_touch.
+ *
+ * @param hashmap Hashmap that holds the node
+ * @param node Pointer to the node
+ * @return size_t Number of bytes
+ */
+static size_t hm_account_bytes(hashmap_t* hashmap, node_t* node)
+{
+    return hashmap->accounting ? hm_node_bytes(hashmap, node) : 0;
+}
+
+/**
+ * @brief Accounts a node that was inserted or modified.
+ *
+ * @param hashmap Hashmap that holds the node
+ * @param node Pointer to the node
+ * @param before Bytes held by the node before, from hm_account_bytes
+ */
+static void hm_account_touch(hashmap_t* hashmap, node_t* node, size_t before)
+{
+    if (hashmap->accounting) {
+        hm_account_add(hashmap, hm_node_bytes(hashmap, node), before);
+    }
+}
+
+/**
+ * @brief Stores a value given to hm_insert inside a node.
+ *
+ * Strings and blobs follow the value ownership policy of the hashmap: they are
+ * duplicated (HM_OWN_COPY), referenced (HM_OWN_BORROW) or taken as they are
+ * (HM_OWN_TAKE). Scalars are copied from the pointed value and maps and lists
+ * are always taken. A NULL value stores an empty string, a zero scalar, an
+ * empty blob or a new empty map or list.
+ *
+ * The node is only modified on success, any previous value must have been
+ * released or saved by the caller.
+ *
+ * @param hashmap Hashmap that holds the node
+ * @param node Pointer to the node
+ * @param value_type Value type
+ * @param value Value given by the caller
+ * @return int Status code (HM_SUCCESS or HM_ERROR)
+ */
+static int hm_node_set_value(hashmap_t* hashmap, node_t* node, node_value_t value_type, void* value)
+{
+    void* aux = NULL;
+    hm_own_t policy = hashmap->value_policy;
+    bool borrowed = false;
+
+    switch (value_type) {
+    case HM_VALUE_STR:
+        if (value != NULL && policy != HM_OWN_COPY) {
+            aux = value;
+            borrowed = (policy == HM_OWN_BORROW);
+        } else if ((aux = strdup(value ? value : "")) == NULL) {
+            return HM_ERROR;
+        }
+        node->value = aux;
+        break;
+    case HM_VALUE_MAP:
+        if ((aux = value) == NULL) {
+            // Maps created on behalf of the caller inherit the ownership policies
+            if ((aux = hm_create_default()) == NULL) {
+                return HM_ERROR;
+            }
+            ((hashmap_t*)aux)->key_policy = hashmap->key_policy;
+            ((hashmap_t*)aux)->value_policy = hashmap->value_policy;
+            ((hashmap_t*)aux)->digest_enabled = hashmap->digest_enabled;
+            ((hashmap_t*)aux)->parent = hashmap;
+            ((hashmap_t*)aux)->parent_node = node;
+        }
+        node->value = aux;
+        break;
+    case HM_VALUE_LIST:
+        if ((aux = value ? value : hm_list_create_default()) == NULL) {
+            return HM_ERROR;
+        }
+        node->value = aux;
+        break;
+    case HM_VALUE_INT64:
+        node->blob = (hm_blob_t) { 0 };
+        node->i64 = value ? *(int64_t*)value : 0;
+        break;
+    case HM_VALUE_DOUBLE:
+        node->blob = (hm_blob_t) { 0 };
+        node->f64 = value ? *(double*)value : 0.0;
+        break;
+    case HM_VALUE_BOOL:
+        node->blob = (hm_blob_t) { 0 };
+        node->boolean = value ? *(bool*)value : false;
+        break;
+    case HM_VALUE_BLOB: {
+        hm_blob_t* blob = value;
+        size_t len = blob ? blob->len : 0;
+
+        if (blob != NULL && policy != HM_OWN_COPY) {
+            aux = blob->data;
+            borrowed = (policy == HM_OWN_BORROW);
+        } else if (len > 0) {
+            if ((aux = malloc(len)) == NULL) {
+                return HM_ERROR;
+            }
+            memcpy(aux, blob->data, len);
+        }
+        node->blob.data = aux;
+        node->blob.len = len;
+        break;
+    }
+    }
+
+    node->value_type = value_type;
+
+    if (borrowed) {
+        node->flags |= HM_NODE_VALUE_BORROWED;
+    } else {
+        node->flags &= ~HM_NODE_VALUE_BORROWED;
+    }
+
+    return HM_SUCCESS;
+}
+
+/**
+ * @brief Walks a path of keys, creating the missing levels.
+ *
+ * Every missing intermediate key is created as an empty hashmap. If the last
+ * key is missing, it is created with the given value. If it already exists,
+ * it is returned untouched.
+ *
+ * @param hashmap Pointer to the root hashmap
+ * @param keys Array of keys
+ * @param depth Number of keys
+ * @param value_type Value type of the leaf, if created
+ * @param value Value of the leaf, if created
+ * @param created Set to true if the leaf was created (optional)
+ * @param owner Receives the hashmap that holds the returned node (optional)
+ * @return node_t* Node at the end of the path or NULL on error
+ */
+static node_t* hm_upsert_path(hashmap_t* hashmap, const hm_key_t* keys, size_t depth, node_value_t value_type, void* value, bool* created, hashmap_t** owner)
+{
+    hashmap_t* current_hm = hashmap;
+    node_t* node = NULL;
+    uint64_t hash = 0;
+
+    if (created) {
+        *created = false;
+    }
+
+    for (size_t i = 0; i < depth; i++) {
+        bool last = (i + 1 == depth);
+
+        hash = hm_key_hash(keys[i].data, keys[i].len);
+        node = hm_bucket_find(current_hm, &keys[i], hash);
+
+        // Expired entries are replaced as if they were missing
+        if (node != NULL && hm_node_expired(node)) {
+            hm_account_add(current_hm, 0, hm_account_bytes(current_hm, node));
+            hm_digest_drop(current_hm, node);
+            hm_unlink_node(current_hm, node);
+            hm_node_free((void**)&node);
+        }
+
+        if (node == NULL) {
+            if (hm_get_load_factor(current_hm) >= HM_LOAD_FACTOR_THRESHOLD) {
+                HM_LOG(LOG_LEVEL_DEBUG, "Load factor threshold reached. Resizing hashmap");
+                if (hm_resize(current_hm, HM_RESIZE_FACTOR) == HM_ERROR) {
+                    return NULL;
+                }
+            }
+
+            if ((node = hm_node_new()) == NULL) {
+                return NULL;
+            }
+
+            if (current_hm->key_policy == HM_OWN_BORROW) {
+                // Borrowed keys point to the caller's buffer and are not NUL terminated
+                node->key = (char*)keys[i].data;
+                node->flags |= HM_NODE_KEY_BORROWED;
+            } else if ((node->key = malloc(keys[i].len + 1)) != NULL) {
+                // Keys are stored NUL terminated for convenience, but may contain NULs
+                memcpy(node->key, keys[i].data, keys[i].len);
+                node->key[keys[i].len] = '\0';
+            }
+
+            if (node->key == NULL
+                || hm_node_set_value(current_hm, node, last ? value_type : HM_VALUE_MAP, last ? value : NULL) == HM_ERROR) {
+                if (!(node->flags & HM_NODE_KEY_BORROWED)) {
+                    free(node->key);
+                }
+                free(node);
+                return NULL;
+            }
+
+            node->key_len = keys[i].len;
+            node->hash = hash;
+
+            node->next = current_hm->list[hash % current_hm->capacity];
+            current_hm->list[hash % current_hm->capacity] = node;
+            current_hm->size++;
+            HM_COUNT(current_hm, inserts);
+            hm_digest_touch(current_hm, node);
+            hm_account_touch(current_hm, node, 0);
+
+            if (last && created) {
+                *created = true;
+            }
+        }
+
+        if (!last) {
+            if (node->value_type != HM_VALUE_MAP) {
+                HM_LOG(LOG_LEVEL_WARNING, "Key [%.*s] is not a hashmap", (int)keys[i].len, keys[i].data);
+                return NULL;
+            }
+            current_hm = node->value;
+        }
+    }
+
+    if (owner) {
+        *owner = current_hm;
+    }
+
+    return node;
+}
+
+/**
+ * @brief Unlinks a node from the bucket chain of its hashmap.
+ *
+ * @param hashmap Pointer to the hashmap holding the node
+ * @param node Pointer to the node
+ */
+static void hm_unlink_node(hashmap_t* hashmap, node_t* node)
+{
+    hm_generation_bump(hashmap);
+
+    for (node_t** link = &hashmap->list[node->hash % hashmap->capacity]; *link != NULL; link = &(*link)->next) {
+        if (*link == node) {
+            *link = node->next;
+            node->next = NULL;
+            hashmap->size--;
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Picks the next entry to evict with the CLOCK algorithm.
+ *
+ * Every hashmap keeps its own hand over its buckets. Referenced entries lose
+ * their bit and are passed over, nested maps are descended into, so victims
+ * are leaves or empty maps. The hand of a hashmap stays on a nested map until
+ * the nested hand completes its turn, so the tree is swept as a single clock
+ * in depth first order and small maps are not visited more often than large
+ * ones.
+ *
+ * @param hashmap Hashmap being swept
+ * @param keep Node that must not be picked (optional)
+ * @param path Receives the keys of the victim
+ * @param depth Depth of the hashmap
+ * @param path_depth Receives the number of keys of the victim
+ * @param owner Receives the hashmap that holds the victim
+ * @return node_t* Victim or NULL if there is none
+ */
+static node_t* hm_clock_pick(hashmap_t* hashmap, const node_t* keep, hm_key_t* path, size_t depth, size_t* path_depth, hashmap_t** owner)
+{
+    if (depth >= HM_MAX_PATH_DEPTH) {
+        return NULL;
+    }
+
+    // Nested maps stop when their hand wraps around. At the top, the first turn
+    // clears every reference bit except in maps resumed halfway, the third one
+    // always finds a victim if there is any
+    size_t steps = depth == 0 ? 3 * hashmap->capacity + 1 : hashmap->capacity - hashmap->hand;
+
+    for (size_t step = 0; step < steps; step++) {
+        for (node_t* node = hashmap->list[hashmap->hand]; node != NULL; node = node->next) {
+            hashmap_t* map = node->value_type == HM_VALUE_MAP ? node->value : NULL;
+
+            if (node == keep) {
+                continue;
+            }
+
+            if (node->referenced) {
+                node->referenced = 0;
+                continue;
+            }
+
+            path[depth] = (hm_key_t) { node->key, node->key_len };
+
+            if (map != NULL && map->size > 0) {
+                node_t* victim = hm_clock_pick(map, keep, path, depth + 1, path_depth, owner);
+                if (victim != NULL) {
+                    return victim;
+                }
+                continue;
+            }
+
+            *path_depth = depth + 1;
+            *owner = hashmap;
+            return node;
+        }
+
+        hashmap->hand = (hashmap->hand + 1) % hashmap->capacity;
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Evicts entries until the tree holding a hashmap fits its budget.
+ *
+ * The budget is the one of the nearest accounted ancestor that has one.
+ * Evictions are logged as removals when that hashmap is durable.
+ *
+ * @param hashmap Hashmap that was modified
+ * @param keep Node that must not be evicted, usually the one just written
+ * @return int Status code (HM_SUCCESS or HM_ERROR)
+ */
+static int hm_budget_enforce(hashmap_t* hashmap, const node_t* keep)
+{
+    hm_key_t path[HM_MAX_PATH_DEPTH];
+    hashmap_t* root = hashmap;
+    int status = HM_SUCCESS;
+
+    while (root != NULL && root->accounting && root->budget == 0) {
+        root = root->parent;
+    }
+
+    if (root == NULL || !root->accounting) {
+        return HM_SUCCESS;
+    }
+
+    while (root->bytes > root->budget) {
+        hashmap_t* owner = NULL;
+        size_t depth = 0;
+        node_t* victim = hm_clock_pick(root, keep, path, 0, &depth, &owner);
+
+        if (victim == NULL) {
+            HM_LOG(LOG_LEVEL_WARNING, "Nothing left to evict, %zu bytes over budget", root->bytes - root->budget);
+            break;
+        }
+
+        hm_account_add(owner, 0, hm_node_bytes(owner, victim));
+        hm_digest_drop(owner, victim);
+        hm_unlink_node(owner, victim);
+
+        // The last key of the path belongs to the victim, logs it first
+        if (hm_wal_log_remove(root, path, depth) == HM_ERROR) {
+            status = HM_ERROR;
+        }
+
+        hm_node_free((void**)&victim);
+        hm_shrink_if_sparse(owner);
+    }
+
+    return status;
+}
+
+/**
+ * @brief Searches for a value inside the hashmap.
+ *
+ * Same as hm_search, but the path is given as an array of length delimited
+ * keys, which may contain any byte, including NULs.
+ *
+ * @param hashmap Pointer to the hashmap
+ * @param value Reference to the pointer where the value will be stored
+ * @param keys Array of keys
+ * @param depth Number of keys
+ * @return int Status code (HM_SUCCESS, HM_NOT_FOUND or HM_ERROR)
+ */
+int hm_searchn(hashmap_t* hashmap, void** value, const hm_key_t* keys, size_t depth)
+{
+    node_t* node = NULL;
+
+    if (hashmap == NULL || hashmap->list == NULL || (keys == NULL && depth > 0)) {
+        return HM_ERROR;
+    }
+
+    if ((node = hm_walk(hashmap, keys, depth, NULL)) == NULL) {
+        return HM_NOT_FOUND;
+    }
+
+    *value = hm_node_value_ref(node);
+    return HM_SUCCESS;
+}
+
+/**
+ * @brief Searches for a value inside the hashmap.
  *
  * The function receives a variable number of keys as arguments. It will search
  * for the hierarchy of keys inside the hashmap, returning the following
  * possible return codes:
  *
- *  - HM_SUCCESS: The value was found and the pointer to it was stored in the
- * value argument.
+ *  - HM_SUCCESS: The value was found and the pointer to it was stored in the
+ * value argument. Scalars and blobs are returned as a pointer to the storage
+ * inside the node (int64_t*, double*, bool* or hm_blob_t*).
+ *
+ *  - HM_NOT_FOUND: The value was not found.
+ *
+ *  - HM_ERROR: An error ocurred.
+ *
+ * @param hashmap Pointer to the hashmap
+ * @param value Reference to the pointer where the value will be stored
+ * @param ... Variable number of keys terminated by a NULL value
+ * @return int Status code (HM_SUCCESS, HM_NOT_FOUND or HM_ERROR)
+ */
+int hm_search(hashmap_t* hashmap, void** value, ...)
+{
+    va_list args;
+    hm_key_t keys[HM_MAX_PATH_DEPTH];
+    int depth = 0;
+
+    va_start(args, value);
+    depth = hm_collect_keys(args, keys);
+    va_end(args);
+
+    if (depth == HM_ERROR) {
+        return HM_ERROR;
+    }
+
+    return hm_searchn(hashmap, value, keys, depth);
+}
+
+typedef struct {
+    uint64_t hash;
+    uint64_t generation;
+    // Earliest expiration of the hashmaps along the path
+    uint64_t expires_at;
+    node_t* node;
+    uint32_t len;
+    char delim;
+    char path[HM_PATH_CACHE_KEY_MAX];
+} hm_path_entry_t;
+
+struct hm_path_cache {
+    size_t mask;
+    hm_path_entry_t entries[];
+};
+
+/**
+ * @brief Splits a delimited path into keys pointing inside it
+ *
+ * Delimiters are found with memchr, which scans whole words or vectors at a
+ * time, and nothing is copied or allocated. Empty segments are empty keys.
+ *
+ * @param path Path to be split
+ * @param len Length of the path
+ * @param delim Delimiter between keys
+ * @param keys Array that receives the keys
+ * @return int Number of keys or HM_ERROR
+ */
+static int hm_split_path(const char* path, size_t len, char delim, hm_key_t* keys)
+{
+    const char* end = path + len;
+    int depth = 0;
+
+    if (len == 0) {
+        return HM_ERROR;
+    }
+
+    for (;;) {
+        const char* next = memchr(path, delim, end - path);
+
+        if (depth == HM_MAX_PATH_DEPTH) {
+            HM_LOG(LOG_LEVEL_ERROR, "Key path deeper than %d levels", HM_MAX_PATH_DEPTH);
+            return HM_ERROR;
+        }
+
+        keys[depth].data = path;
+        keys[depth].len = (next ? next : end) - path;
+        depth++;
+
+        if (next == NULL) {
+            return depth;
+        }
+        path = next + 1;
+    }
+}
+
+/**
+ * @brief Prepares a path to be cached. The hashmaps along it get their parent
+ * pointers set, so removals beneath any of them reach the cache, and the
+ * earliest of their expirations is returned.
+ *
+ * @param hashmap Pointer to the hashmap holding the cache
+ * @param keys Array of keys of an existing path
+ * @param depth Number of keys
+ * @return uint64_t Earliest expiration time or UINT64_MAX if none expires
+ */
+static uint64_t hm_path_adopt(hashmap_t* hashmap, const hm_key_t* keys, size_t depth)
+{
+    uint64_t expires_at = UINT64_MAX;
+
+    for (size_t i = 0; i + 1 < depth && hashmap != NULL; i++) {
+        node_t* node = hm_bucket_find(hashmap, &keys[i], hm_key_hash(keys[i].data, keys[i].len));
+
+        if (node == NULL || node->value_type != HM_VALUE_MAP || node->value == NULL) {
+            break;
+        }
+        if (node->timer != NULL && node->timer->expires_at < expires_at) {
+            expires_at = node->timer->expires_at;
+        }
+        ((hashmap_t*)node->value)->parent = hashmap;
+        ((hashmap_t*)node->value)->parent_node = node;
+        hashmap = node->value;
+    }
+
+    return expires_at;
+}
+
+/**
+ * @brief Keeps a small cache of the leaves resolved by hm_search_str.
+ *
+ * The cache maps whole path strings, up to HM_PATH_CACHE_KEY_MAX bytes, to
+ * their nodes, so a repeated path costs one cheap hash of the string instead
+ * of hashing and probing every level. It is direct mapped: each path has a
+ * single slot and newer paths replace older ones.
+ *
+ * Entries are dropped as soon as any node of the tree beneath the hashmap
+ * may have been freed, so removals lower its hit rate but never return stale
+ * nodes. Other trees, and the hashmaps above this one, do not affect it.
+ * Values replaced in place are always read from the node. Paths through a
+ * hashmap inserted with a TTL are walked again once it is due to expire. Searches through
+ * a hashmap with a path cache write to it, so concurrent readers of that
+ * hashmap need to be serialized.
+ *
+ * @param hashmap Pointer to the hashmap
+ * @param entries Number of slots, rounded up to a power of two, 0 disables
+ * @return int Status code (HM_SUCCESS or HM_ERROR)
+ */
+int hm_enable_path_cache(hashmap_t* hashmap, size_t entries)
+{
+    hm_path_cache_t* cache = NULL;
+    size_t slots = 1;
+
+    if (hashmap == NULL || hashmap->list == NULL) {
+        return HM_ERROR;
+    }
+
+    free(hashmap->path_cache);
+    hashmap->path_cache = NULL;
+
+    if (entries == 0) {
+        return HM_SUCCESS;
+    }
+
+    while (slots < entries) {
+        slots <<= 1;
+    }
+
+    if ((cache = calloc(1, sizeof(hm_path_cache_t) + slots * sizeof(hm_path_entry_t))) == NULL) {
+        return HM_ERROR;
+    }
+
+    cache->mask = slots - 1;
+    hashmap->path_cache = cache;
+
+    return HM_SUCCESS;
+}
+
+/**
+ * @brief Searches for a value given its path as a delimited string.
+ *
+ * Same as hm_search, but the keys are given as a single string, such as
+ * "POSPAGO/ANUAL/VSA" with '/' as the delimiter. Repeated paths are served
+ * by the path cache when one was enabled with hm_enable_path_cache.
+ *
+ * @param hashmap Pointer to the hashmap
+ * @param value Reference to the pointer where the value will be stored
+ * @param path Delimited path
+ * @param delim Delimiter between keys
+ * @return int Status code (HM_SUCCESS, HM_NOT_FOUND or HM_ERROR)
+ */
+int hm_search_str(hashmap_t* hashmap, void** value, const char* path, char delim)
+{
+    hm_key_t keys[HM_MAX_PATH_DEPTH];
+    hm_path_cache_t* cache = NULL;
+    hm_path_entry_t* entry = NULL;
+    node_t* node = NULL;
+    uint64_t generation = 0;
+    uint64_t hash = 0;
+    size_t len = 0;
+    int depth = 0;
+
+    if (hashmap == NULL || hashmap->list == NULL || value == NULL || path == NULL) {
+        return HM_ERROR;
+    }
+
+    len = strlen(path);
+
+    if ((cache = hashmap->path_cache) != NULL && len <= HM_PATH_CACHE_KEY_MAX) {
+        generation = hashmap->generation;
+        hash = hm_digest_bytes(path, len, (unsigned char)delim);
+        entry = &cache->entries[hash & cache->mask];
+
+        if (entry->node != NULL && entry->generation == generation && entry->hash == hash && entry->len == len
+            && entry->delim == delim && !memcmp(entry->path, path, len)
+            && (entry->expires_at == UINT64_MAX || entry->expires_at > hm_clock_ms())) {
+            node = entry->node;
+
+            if (hm_node_expired(node)) {
+                return HM_NOT_FOUND;
+            }
+
+            HM_COUNT(hashmap, searches);
+            HM_COUNT(hashmap, hits);
+            if (hashmap->accounting && !node->referenced) {
+                node->referenced = 1;
+            }
+
+            *value = hm_node_value_ref(node);
+            return HM_SUCCESS;
+        }
+    }
+
+    if ((depth = hm_split_path(path, len, delim, keys)) <= 0) {
+        return HM_ERROR;
+    }
+
+    if ((node = hm_walk(hashmap, keys, depth, NULL)) == NULL) {
+        return HM_NOT_FOUND;
+    }
+
+    if (entry != NULL) {
+        entry->hash = hash;
+        entry->generation = generation;
+        entry->expires_at = hm_path_adopt(hashmap, keys, depth);
+        entry->node = node;
+        entry->len = (uint32_t)len;
+        entry->delim = delim;
+        memcpy(entry->path, path, len);
+    }
+
+    *value = hm_node_value_ref(node);
+    return HM_SUCCESS;
+}
+
+/**
+ * @brief Checks whether a borrowed or taken value is the one a node holds
+ *
+ * @param node Pointer to the node
+ * @param policy Value ownership policy of its hashmap
+ * @param value_type Value type given by the caller
+ * @param value Value given by the caller
+ * @return bool Whether the node already holds the same pointer
+ */
+static bool hm_node_holds(node_t* node, hm_own_t policy, node_value_t value_type, void* value)
+{
+    if (policy == HM_OWN_COPY || value == NULL || node->value_type != value_type) {
+        return false;
+    }
+
+    if (value_type == HM_VALUE_STR) {
+        return value == node->value;
+    }
+
+    return value_type == HM_VALUE_BLOB && ((hm_blob_t*)value)->data != NULL && ((hm_blob_t*)value)->data == node->blob.data;
+}
+
+/**
+ * @brief Inserts or replaces the value at the end of a path
+ *
+ * @param hashmap Pointer to the root hashmap
+ * @param value_type Value type
+ * @param value Pointer to the value
+ * @param keys Array of keys
+ * @param depth Number of keys
+ * @param owner Receives the hashmap that holds the node
+ * @return node_t* Node holding the value or NULL on error
+ */
+static node_t* hm_insert_path(hashmap_t* hashmap, node_value_t value_type, void* value, const hm_key_t* keys, size_t depth, hashmap_t** owner)
+{
+    node_t* node = NULL;
+    node_t old = { 0 };
+    bool created = false;
+    size_t before = 0;
+
+    if ((node = hm_upsert_path(hashmap, keys, depth, value_type, value, &created, owner)) == NULL || created) {
+        return node;
+    }
+
+    before = hm_account_bytes(*owner, node);
+
+    // Key found as the last one, replaces its value
+    if (value_type == HM_VALUE_STR && node->value_type == HM_VALUE_STR && (*owner)->value_policy == HM_OWN_COPY) {
+        if (hm_node_update_str(node, value ? value : "") == HM_ERROR) {
+            return NULL;
+        }
+        hm_digest_touch(*owner, node);
+        hm_account_touch(*owner, node, before);
+        return node;
+    }
+
+    if (value_type == HM_VALUE_MAP || value_type == HM_VALUE_LIST) {
+        if (node->value_type == value_type && (value == NULL || value == node->value)) {
+            return node;
+        }
+    }
+
+    // The pointer already held is kept, freeing the old value would free it too
+    if (hm_node_holds(node, (*owner)->value_policy, value_type, value)) {
+        if ((*owner)->value_policy == HM_OWN_BORROW) {
+            node->flags |= HM_NODE_VALUE_BORROWED;
+        } else {
+            node->flags &= ~HM_NODE_VALUE_BORROWED;
+        }
+        if (value_type == HM_VALUE_BLOB) {
+            node->blob.len = ((hm_blob_t*)value)->len;
+        }
+        hm_digest_touch(*owner, node);
+        hm_account_touch(*owner, node, before);
+        return node;
+    }
+
+    old = *node;
+    if (hm_node_set_value(*owner, node, value_type, value) == HM_ERROR) {
+        return NULL;
+    }
+
+    hm_node_value_free(&old);
+    hm_digest_touch(*owner, node);
+    hm_account_touch(*owner, node, before);
+
+    return node;
+}
+
+/**
+ * @brief Inserts a value into the hashmap.
+ *
+ * Same as hm_insert, but the path is given as an array of length delimited
+ * keys, which may contain any byte, including NULs.
+ *
+ * @param hashmap Pointer to the hashmap
+ * @param value_type Value type
+ * @param value Pointer to the value
+ * @param keys Array of keys
+ * @param depth Number of keys
+ */
+void hm_insertn(hashmap_t* hashmap, node_value_t value_type, void* value, const hm_key_t* keys, size_t depth)
+{
+    hashmap_t* owner = NULL;
+    node_t* node = NULL;
+
+    if (hashmap == NULL || hashmap->list == NULL || keys == NULL || depth == 0) {
+        return;
+    }
+
+    if ((node = hm_insert_path(hashmap, value_type, value, keys, depth, &owner)) == NULL) {
+        return;
+    }
+
+    // A plain insert makes the entry permanent again
+    hm_node_timer_free(node);
+    hm_wal_log_set(hashmap, keys, depth, node);
+    hm_budget_enforce(hashmap, node);
+}
+
+/**
+ * @brief Inserts a value into the hashmap.
+ *
+ * The function receives a variable number of keys as arguments.
+ * If the key is not found inside the hashmap and it's not the last one, a new
+ * hashmap will be created and inserted. If the key is not found inside the
+ * hashmap and it's the last one, the value will be inserted.
+ *
+ * If the last key already exists its value is replaced. Strings are updated in
+ * place whenever possible. Inserting a NULL map or list over an existing value
+ * of the same type keeps the existing one.
+ *
+ * @param hashmap Pointer to the hashmap
+ * @param value_type Value type
+ * @param value Pointer to the value
+ * @param ... Variable number of keys terminated by a NULL value
+ */
+void hm_insert(hashmap_t* hashmap, node_value_t value_type, void* value, ...)
+{
+    va_list args;
+    hm_key_t keys[HM_MAX_PATH_DEPTH];
+    int depth = 0;
+
+    va_start(args, value);
+    depth = hm_collect_keys(args, keys);
+    va_end(args);
+
+    if (depth <= 0) {
+        return;
+    }
+
+    hm_insertn(hashmap, value_type, value, keys, depth);
+}
+
+/**
+ * @brief Inserts a value given its path as a delimited string.
+ *
+ * Same as hm_insert, but the keys are given as a single string, such as
+ * "POSPAGO/ANUAL/VSA" with '/' as the delimiter.
+ *
+ * @param hashmap Pointer to the hashmap
+ * @param value_type Value type
+ * @param value Pointer to the value
+ * @param path Delimited path
+ * @param delim Delimiter between keys
+ */
+void hm_insert_str(hashmap_t* hashmap, node_value_t value_type, void* value, const char* path, char delim)
+{
+    hm_key_t keys[HM_MAX_PATH_DEPTH];
+    int depth = 0;
+
+    if (path == NULL || (depth = hm_split_path(path, strlen(path), delim, keys)) <= 0) {
+        return;
+    }
+
+    hm_insertn(hashmap, value_type, value, keys, depth);
+}
+
+/**
+ * @brief Retrieves the node at the given path, inserting it if missing.
+ *
+ * Same as hm_upsert, but the path is given as an array of length delimited
+ * keys.
+ *
+ * @param hashmap Pointer to the hashmap
+ * @param value_type Value type used if the node is created
+ * @param value Value used if the node is created
+ * @param keys Array of keys
+ * @param depth Number of keys
+ * @return node_t* Node at the given path or NULL on error
+ */
+node_t* hm_upsertn(hashmap_t* hashmap, node_value_t value_type, void* value, const hm_key_t* keys, size_t depth)
+{
+    node_t* node = NULL;
+    bool created = false;
+
+    if (hashmap == NULL || hashmap->list == NULL || keys == NULL || depth == 0) {
+        return NULL;
+    }
+
+    if ((node = hm_upsert_path(hashmap, keys, depth, value_type, value, &created, NULL)) != NULL && created) {
+        hm_wal_log_set(hashmap, keys, depth, node);
+        hm_budget_enforce(hashmap, node);
+    }
+
+    return node;
+}
+
+/**
+ * @brief Retrieves the node at the given path, inserting it if missing.
+ *
+ * Follows the same rules as hm_insert for the missing levels. If the last key
+ * already exists, its node is returned untouched and the given value is not
+ * used, remaining owned by the caller. This allows read-modify-write cycles to
+ * be done with a single walk.
+ *
+ * On a durable root only the node as created is logged. Changes then made in
+ * place through the returned node must be committed with hm_upsert_commit,
+ * or they are lost on recovery.
+ *
+ * @param hashmap Pointer to the hashmap
+ * @param value_type Value type used if the node is created
+ * @param value Value used if the node is created
+ * @param ... Variable number of keys terminated by a NULL value
+ * @return node_t* Node at the given path or NULL on error
+ */
+node_t* hm_upsert(hashmap_t* hashmap, node_value_t value_type, void* value, ...)
+{
+    va_list args;
+    hm_key_t keys[HM_MAX_PATH_DEPTH];
+    int depth = 0;
+
+    va_start(args, value);
+    depth = hm_collect_keys(args, keys);
+    va_end(args);
+
+    if (depth <= 0) {
+        return NULL;
+    }
+
+    return hm_upsertn(hashmap, value_type, value, keys, depth);
+}
+
+/**
+ * @brief Logs the current value of a node changed in place.
+ *
+ * Same as hm_upsert_commit, but the path is given as an array of length
+ * delimited keys.
+ *
+ * @param hashmap Root hashmap
+ * @param keys Array of keys
+ * @param depth Number of keys
+ * @return int Status code (HM_SUCCESS, HM_NOT_FOUND or HM_ERROR)
+ */
+int hm_upsert_commitn(hashmap_t* hashmap, const hm_key_t* keys, size_t depth)
+{
+    node_t* node = NULL;
+
+    if (hashmap == NULL || hashmap->list == NULL || keys == NULL || depth == 0) {
+        return HM_ERROR;
+    }
+
+    if ((node = hm_walk(hashmap, keys, depth, NULL)) == NULL) {
+        return HM_NOT_FOUND;
+    }
+
+    return hm_wal_log_set(hashmap, keys, depth, node);
+}
+
+/**
+ * @brief Logs the current value of a node changed in place.
+ *
+ * Completes a read-modify-write cycle started by hm_upsert on a durable root,
+ * once the returned node holds its final value. Does nothing but the walk if
+ * the hashmap has no log.
+ *
+ * @param hashmap Root hashmap
+ * @param ... Variable number of keys terminated by a NULL value
+ * @return int Status code (HM_SUCCESS, HM_NOT_FOUND or HM_ERROR)
+ */
+int hm_upsert_commit(hashmap_t* hashmap, ...)
+{
+    va_list args;
+    hm_key_t keys[HM_MAX_PATH_DEPTH];
+    int depth = 0;
+
+    va_start(args, hashmap);
+    depth = hm_collect_keys(args, keys);
+    va_end(args);
+
+    if (depth <= 0) {
+        return HM_ERROR;
+    }
+
+    return hm_upsert_commitn(hashmap, keys, depth);
+}
+
+/**
+ * @brief Replaces the value of a string node, reusing its buffer when the
+ * new value fits.
+ *
+ * The new value is always copied. A borrowed value is never written to, the
+ * node gets its own buffer instead. The node does not know its hashmap, so
+ * digests are not refreshed, hm_update_str does.
+ *
+ * @param node Pointer to the node
+ * @param str New value
+ * @return int Status code (HM_SUCCESS or HM_ERROR)
+ */
+int hm_node_update_str(node_t* node, char* str)
+{
+    if (node == NULL || str == NULL || node->value_type != HM_VALUE_STR) {
+        return HM_ERROR;
+    }
+
+    size_t new_len = strlen(str);
+
+    if (node->flags & HM_NODE_VALUE_BORROWED) {
+        char* aux = strdup(str);
+        if (aux == NULL) {
+            return HM_ERROR;
+        }
+        node->value = aux;
+        node->flags &= ~HM_NODE_VALUE_BORROWED;
+        return HM_SUCCESS;
+    }
+
+    if (node->value != NULL && new_len <= strlen(node->value)) {
+        memmove(node->value, str, new_len + 1);
+        return HM_SUCCESS;
+    }
+
+    char* aux = realloc(node->value, new_len + 1);
+    if (aux == NULL) {
+        return HM_ERROR;
+    }
+
+    memcpy(aux, str, new_len + 1);
+    node->value = aux;
+
+    return HM_SUCCESS;
+}
+
+/**
+ * @brief Updates an existing string value, reusing its storage when the new
+ * value fits.
+ *
+ * @param hashmap Pointer to the hashmap
+ * @param str New value
+ * @param keys Array of keys
+ * @param depth Number of keys
+ * @return int Status code (HM_SUCCESS, HM_NOT_FOUND or HM_ERROR)
+ */
+int hm_update_strn(hashmap_t* hashmap, char* str, const hm_key_t* keys, size_t depth)
+{
+    hashmap_t* owner = NULL;
+    node_t* node = NULL;
+
+    if (hashmap == NULL || hashmap->list == NULL || str == NULL || keys == NULL || depth == 0) {
+        return HM_ERROR;
+    }
+
+    size_t before = 0;
+
+    if ((node = hm_walk(hashmap, keys, depth, &owner)) == NULL) {
+        return HM_NOT_FOUND;
+    }
+
+    before = hm_account_bytes(owner, node);
+
+    if (hm_node_update_str(node, str) == HM_ERROR) {
+        return HM_ERROR;
+    }
+
+    hm_digest_touch(owner, node);
+    hm_account_touch(owner, node, before);
+
+    hm_wal_log_set(hashmap, keys, depth, node);
+    hm_budget_enforce(hashmap, node);
+
+    return HM_SUCCESS;
+}
+
+/**
+ * @brief Updates an existing string value, reusing its storage when the new
+ * value fits.
+ *
+ * @param hashmap Pointer to the hashmap
+ * @param str New value
+ * @param ... Variable number of keys terminated by a NULL value
+ * @return int Status code (HM_SUCCESS, HM_NOT_FOUND or HM_ERROR)
+ */
+int hm_update_str(hashmap_t* hashmap, char* str, ...)
+{
+    va_list args;
+    hm_key_t keys[HM_MAX_PATH_DEPTH];
+    int depth = 0;
+
+    va_start(args, str);
+    depth = hm_collect_keys(args, keys);
+    va_end(args);
+
+    if (depth <= 0) {
+        return HM_ERROR;
+    }
+
+    return hm_update_strn(hashmap, str, keys, depth);
+}
+
+/**
+ * @brief Removes the value at the given path.
+ *
+ * Same as hm_remove, but the path is given as an array of length delimited
+ * keys.
+ *
+ * @param hashmap Pointer to the hashmap
+ * @param keys Array of keys
+ * @param depth Number of keys
+ * @return int Status code (HM_SUCCESS, HM_NOT_FOUND or HM_ERROR)
+ */
+int hm_removen(hashmap_t* hashmap, const hm_key_t* keys, size_t depth)
+{
+    hashmap_t* owner = NULL;
+    node_t* node = NULL;
+
+    if (hashmap == NULL || hashmap->list == NULL || keys == NULL || depth == 0) {
+        return HM_ERROR;
+    }
+
+    if ((node = hm_walk(hashmap, keys, depth, &owner)) == NULL) {
+        return HM_NOT_FOUND;
+    }
+
+    hm_account_add(owner, 0, hm_account_bytes(owner, node));
+    hm_digest_drop(owner, node);
+    hm_unlink_node(owner, node);
+    hm_node_free((void**)&node);
+    hm_shrink_if_sparse(owner);
+
+    // The removal is done, a failed append is reported by hm_wal_sync
+    hm_wal_log_remove(hashmap, keys, depth);
+
+    return HM_SUCCESS;
+}
+
+/**
+ * @brief Removes the value at the given path.
+ *
+ * The node is unlinked from its hashmap and freed along with everything
+ * beneath it.
+ *
+ * @param hashmap Pointer to the hashmap
+ * @param ... Variable number of keys terminated by a NULL value
+ * @return int Status code (HM_SUCCESS, HM_NOT_FOUND or HM_ERROR)
+ */
+int hm_remove(hashmap_t* hashmap, ...)
+{
+    va_list args;
+    hm_key_t keys[HM_MAX_PATH_DEPTH];
+    int depth = 0;
+
+    va_start(args, hashmap);
+    depth = hm_collect_keys(args, keys);
+    va_end(args);
+
+    if (depth <= 0) {
+        return HM_ERROR;
+    }
+
+    return hm_removen(hashmap, keys, depth);
+}
+
+/**
+ * @brief Atomically adds a delta to an integer value.
+ *
+ * Same as hm_incr, but the path is given as an array of length delimited
+ * keys.
+ *
+ * @param hashmap Pointer to the hashmap
+ * @param delta Value to be added
+ * @param result Receives the value after the addition (optional)
+ * @param keys Array of keys
+ * @param depth Number of keys
+ * @return int Status code (HM_SUCCESS or HM_ERROR)
+ */
+int hm_incrn(hashmap_t* hashmap, int64_t delta, int64_t* result, const hm_key_t* keys, size_t depth)
+{
+    hashmap_t* owner = NULL;
+    node_t* node = NULL;
+    bool created = false;
+    int64_t value = 0;
+
+    if (hashmap == NULL || hashmap->list == NULL || keys == NULL || depth == 0) {
+        return HM_ERROR;
+    }
+
+    if ((node = hm_upsert_path(hashmap, keys, depth, HM_VALUE_INT64, &delta, &created, &owner)) == NULL) {
+        return HM_ERROR;
+    }
+
+    if (node->value_type != HM_VALUE_INT64) {
+        HM_LOG(LOG_LEVEL_WARNING, "Key [%.*s] is not an integer", (int)node->key_len, node->key);
+        return HM_ERROR;
+    }
+
+    value = created ? node->i64 : __atomic_add_fetch(&node->i64, delta, __ATOMIC_RELAXED);
+
+    if (!created) {
+        hm_digest_touch(owner, node);
+    }
+
+    if (result) {
+        *result = value;
+    }
+
+    // Logs the result rather than the delta, so replaying a record twice is harmless
+    hm_wal_log_set(hashmap, keys, depth, node);
+
+    if (created) {
+        hm_budget_enforce(hashmap, node);
+    }
+
+    return HM_SUCCESS;
+}
+
+/**
+ * @brief Atomically adds a delta to an integer value.
+ *
+ * The value is created with the delta if it does not exist. Concurrent calls
+ * on an existing value are safe as long as the tree structure is not being
+ * modified at the same time and digests are not enabled.
+ *
+ * @param hashmap Pointer to the hashmap
+ * @param delta Value to be added
+ * @param result Receives the value after the addition (optional)
+ * @param ... Variable number of keys terminated by a NULL value
+ * @return int Status code (HM_SUCCESS or HM_ERROR)
+ */
+int hm_incr(hashmap_t* hashmap, int64_t delta, int64_t* result, ...)
+{
+    va_list args;
+    hm_key_t keys[HM_MAX_PATH_DEPTH];
+    int depth = 0;
+
+    va_start(args, result);
+    depth = hm_collect_keys(args, keys);
+    va_end(args);
+
+    if (depth <= 0) {
+        return HM_ERROR;
+    }
+
+    return hm_incrn(hashmap, delta, result, keys, depth);
+}
+
+/**
+ * @brief Arms the timer of a node, replacing any previous one
+ *
+ * @param wheel Wheel tracking the timer
+ * @param owner Hashmap that holds the node
+ * @param node Pointer to the node
+ * @param ttl_ms Time to live in milliseconds
+ * @return int Status code (HM_SUCCESS or HM_ERROR)
+ */
+static int hm_node_set_ttl(hm_wheel_t* wheel, hashmap_t* owner, node_t* node, uint64_t ttl_ms)
+{
+    hm_timer_t* timer = node->timer;
+
+    if (timer == NULL) {
+        if ((timer = calloc(1, sizeof(hm_timer_t))) == NULL) {
+            return HM_ERROR;
+        }
+        timer->node = node;
+        timer->level = -1;
+        node->timer = timer;
+    } else {
+        hm_timer_unlink(timer);
+    }
+
+    timer->owner = owner;
+    timer->expires_at = hm_clock_ms() + ttl_ms;
+    hm_wheel_add(wheel, timer);
+
+    // Cached paths through the hashmap only know its previous expiration
+    if (node->value_type == HM_VALUE_MAP) {
+        hm_generation_bump(owner);
+    }
+
+    return HM_SUCCESS;
+}
+
+/**
+ * @brief Inserts a value that expires after the given time.
  *
- *  - HM_NOT_FOUND: The value was not found.
+ * Same as hm_insert_ttl, but the path is given as an array of length
+ * delimited keys.
+ *
+ * @param hashmap Pointer to the hashmap
+ * @param ttl_ms Time to live in milliseconds, 0 for none
+ * @param value_type Value type
+ * @param value Pointer to the value
+ * @param keys Array of keys
+ * @param depth Number of keys
+ */
+void hm_insert_ttln(hashmap_t* hashmap, uint64_t ttl_ms, node_value_t value_type, void* value, const hm_key_t* keys, size_t depth)
+{
+    hashmap_t* owner = NULL;
+    node_t* node = NULL;
+
+    if (ttl_ms == 0) {
+        hm_insertn(hashmap, value_type, value, keys, depth);
+        return;
+    }
+
+    if (hashmap == NULL || hashmap->list == NULL || keys == NULL || depth == 0) {
+        return;
+    }
+
+    // The log has no record of timers, recovered entries would never expire
+    if (hashmap->wal != NULL) {
+        HM_LOG(LOG_LEVEL_ERROR, "TTLs are not supported on a durable hashmap");
+        return;
+    }
+
+    if (hashmap->wheel == NULL) {
+        if ((hashmap->wheel = calloc(1, sizeof(hm_wheel_t))) == NULL) {
+            return;
+        }
+        hashmap->wheel->now = hm_clock_ms();
+    }
+
+    if ((node = hm_insert_path(hashmap, value_type, value, keys, depth, &owner)) == NULL) {
+        return;
+    }
+
+    if (hm_node_set_ttl(hashmap->wheel, owner, node, ttl_ms) == HM_ERROR) {
+        HM_LOG(LOG_LEVEL_ERROR, "Failed to set the TTL of [%.*s]", (int)node->key_len, node->key);
+    }
+
+    hm_budget_enforce(hashmap, node);
+}
+
+/**
+ * @brief Inserts a value that expires after the given time.
+ *
+ * Works as hm_insert, replacing any previous TTL of the entry. Once expired,
+ * the entry is no longer found by searches, updates and removals, and
+ * inserting over it starts a new entry. Its memory is reclaimed by
+ * hm_expire_tick, called on the same hashmap. Until then it still counts in
+ * the size of its hashmap and is seen by whole tree operations such as
+ * hm_serialize or hm_clone. Copies made by hm_clone do not expire.
+ *
+ * A later hm_insert on the same key makes the entry permanent again, hm_incr
+ * keeps the TTL. The write ahead log does not record TTLs, so nothing is
+ * inserted through a durable root.
+ *
+ * @param hashmap Pointer to the hashmap
+ * @param ttl_ms Time to live in milliseconds, 0 for none
+ * @param value_type Value type
+ * @param value Pointer to the value
+ * @param ... Variable number of keys terminated by a NULL value
+ */
+void hm_insert_ttl(hashmap_t* hashmap, uint64_t ttl_ms, node_value_t value_type, void* value, ...)
+{
+    va_list args;
+    hm_key_t keys[HM_MAX_PATH_DEPTH];
+    int depth = 0;
+
+    va_start(args, value);
+    depth = hm_collect_keys(args, keys);
+    va_end(args);
+
+    if (depth <= 0) {
+        return;
+    }
+
+    hm_insert_ttln(hashmap, ttl_ms, value_type, value, keys, depth);
+}
+
+/**
+ * @brief Reclaims entries whose TTL ran out.
+ *
+ * Advances the timer wheel of the hashmap to the given time and frees up to
+ * budget expired entries, so the pause stays bounded no matter how many
+ * entries expire at once. The remaining ones are reclaimed by later calls.
+ * Entries are found through their timers, the tree is never scanned.
+ *
+ * @param hashmap Hashmap the entries were inserted through
+ * @param now Current time, from hm_clock_ms
+ * @param budget Maximum number of entries to reclaim
+ * @return int Number of entries reclaimed or HM_ERROR
+ */
+int hm_expire_tick(hashmap_t* hashmap, uint64_t now, int budget)
+{
+    hm_wheel_t* wheel = NULL;
+    int reclaimed = 0;
+
+    if (hashmap == NULL || budget < 0) {
+        return HM_ERROR;
+    }
+
+    if ((wheel = hashmap->wheel) == NULL) {
+        return 0;
+    }
+
+    hm_wheel_advance(wheel, now);
+
+    while (reclaimed < budget && wheel->expired != NULL) {
+        node_t* node = wheel->expired->node;
+        hashmap_t* owner = wheel->expired->owner;
+
+        // Freeing the node also takes its timer off the expired list
+        hm_account_add(owner, 0, hm_account_bytes(owner, node));
+        hm_digest_drop(owner, node);
+        hm_unlink_node(owner, node);
+        hm_node_free((void**)&node);
+        hm_shrink_if_sparse(owner);
+        reclaimed++;
+    }
+
+    return reclaimed;
+}
+
+/**
+ * @brief Limits the memory held by a tree, evicting entries beyond it.
+ *
+ * Enables the accounting of the bytes held by every hashmap of the tree:
+ * nodes, keys, values, lists and bucket arrays, as reported by hm_stats.
+ * Modifications done through the hashmap API refresh the totals along the
+ * modified path only. Whenever the total goes over the budget, entries are
+ * evicted with the CLOCK algorithm until it fits again: searches set a
+ * reference bit on the entries they find, and the eviction hand clears it
+ * once before evicting an entry, so recently used entries get a second
+ * chance. New entries start unreferenced, which keeps one time scans from
+ * flushing the tree. Nested maps are swept as well, only leaves and empty
+ * maps are evicted, and the entry just written never is.
+ *
+ * Values changed in place, through pointers returned by hm_search and
+ * hm_upsert, hm_node_update_str or hm_list_append, are not tracked. Calling
+ * this function again accounts the whole tree again. Evicting makes any
+ * pointer to the evicted entry invalid. Searches write the reference bit, so
+ * concurrent readers of an accounted tree may race on it, which is harmless.
+ *
+ * @param hashmap Pointer to the root hashmap
+ * @param bytes Budget in bytes, 0 to only keep the accounting
+ * @return int Status code (HM_SUCCESS or HM_ERROR)
+ */
+int hm_set_budget(hashmap_t* hashmap, size_t bytes)
+{
+    if (hashmap == NULL || hashmap->list == NULL) {
+        return HM_ERROR;
+    }
+
+    hm_account_refresh(hashmap);
+    hashmap->budget = bytes;
+
+    return hm_budget_enforce(hashmap, NULL);
+}
+
+/**
+ * @brief Returns the bytes held by a tree, see hm_set_budget.
+ *
+ * @param hashmap Pointer to the hashmap
+ * @return size_t Number of bytes, 0 unless the accounting was enabled
+ */
+size_t hm_get_memory_usage(hashmap_t* hashmap)
+{
+    if (hashmap == NULL || !hashmap->accounting) {
+        return 0;
+    }
+
+    return hashmap->bytes;
+}
+
+static hashmap_t* hm_clone_map(hashmap_t* hashmap);
+
+/**
+ * @brief Deep copies a node, keeping its cached hash and key length
+ *
+ * Borrowed keys and values are shared with the original node, everything
+ * else is duplicated.
+ *
+ * @param node Pointer to the node
+ * @return node_t* Heap allocated copy or NULL on error
+ */
+static node_t* hm_node_clone(node_t* node)
+{
+    node_t* clone = hm_node_new();
+    bool failed = false;
+
+    if (clone == NULL) {
+        return NULL;
+    }
+
+    clone->key_len = node->key_len;
+    clone->hash = node->hash;
+    clone->flags = node->flags;
+    clone->value_type = node->value_type;
+
+    if (node->key == NULL || (node->flags & HM_NODE_KEY_BORROWED)) {
+        clone->key = node->key;
+    } else if ((clone->key = malloc(node->key_len + 1)) != NULL) {
+        memcpy(clone->key, node->key, node->key_len + 1);
+    } else {
+        failed = true;
+    }
+
+    if (node->flags & HM_NODE_VALUE_BORROWED) {
+        clone->blob = node->blob;
+    } else {
+        switch (node->value_type) {
+        case HM_VALUE_STR:
+            failed |= node->value && (clone->value = strdup(node->value)) == NULL;
+            break;
+        case HM_VALUE_MAP:
+            failed |= node->value && (clone->value = hm_clone_map(node->value)) == NULL;
+            break;
+        case HM_VALUE_LIST:
+            failed |= node->value && (clone->value = hm_list_clone(node->value)) == NULL;
+            break;
+        case HM_VALUE_BLOB:
+            clone->blob.len = node->blob.len;
+            failed |= node->blob.len > 0 && (clone->blob.data = malloc(node->blob.len)) == NULL;
+            if (clone->blob.data) {
+                memcpy(clone->blob.data, node->blob.data, node->blob.len);
+            }
+            break;
+        case HM_VALUE_INT64:
+        case HM_VALUE_DOUBLE:
+        case HM_VALUE_BOOL:
+            clone->blob = node->blob;
+            break;
+        }
+    }
+
+    if (failed) {
+        hm_node_free((void**)&clone);
+        return NULL;
+    }
+
+    return clone;
+}
+
+/**
+ * @brief Swaps the values of two nodes, keys are left in place.
+ *
+ * Used to install a value built elsewhere without copying it, the other node
+ * then carries the old value away to be freed.
+ *
+ * @param a Pointer to the first node
+ * @param b Pointer to the second node
+ */
+void hm_node_swap_value(node_t* a, node_t* b)
+{
+    node_t aux = *a;
+
+    a->blob = b->blob;
+    a->value_type = b->value_type;
+    a->flags = (a->flags & ~HM_NODE_VALUE_BORROWED) | (b->flags & HM_NODE_VALUE_BORROWED);
+    b->blob = aux.blob;
+    b->value_type = aux.value_type;
+    b->flags = (b->flags & ~HM_NODE_VALUE_BORROWED) | (aux.flags & HM_NODE_VALUE_BORROWED);
+}
+
+/**
+ * @brief Deep copies a list with the same capacity
+ *
+ * @param list Pointer to the list
+ * @return list_t* Heap allocated copy or NULL on error
+ */
+list_t* hm_list_clone(list_t* list)
+{
+    list_t* clone = NULL;
+
+    if (list == NULL || (clone = hm_list_create(list->capacity)) == NULL) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < list->size; i++) {
+        if ((clone->items[i] = hm_node_clone(list->items[i])) == NULL) {
+            hm_list_free((void**)&clone);
+            return NULL;
+        }
+        clone->size++;
+    }
+
+    return clone;
+}
+
+/**
+ * @brief Deep copies a hashmap keeping its capacity and bucket layout
+ *
+ * @param hashmap Pointer to the hashmap
+ * @return hashmap_t* Heap allocated copy or NULL on error
+ */
+static hashmap_t* hm_clone_map(hashmap_t* hashmap)
+{
+    hashmap_t* clone = NULL;
+    size_t seen = 0;
+
+    if ((clone = hm_create(hashmap->capacity)) == NULL || clone->list == NULL) {
+        hm_free((void**)&clone);
+        return NULL;
+    }
+
+    clone->key_policy = hashmap->key_policy;
+    clone->value_policy = hashmap->value_policy;
+
+    for (size_t i = 0; i < hashmap->capacity && seen < hashmap->size; i++) {
+        node_t** tail = &clone->list[i];
+
+        // Appends to keep the chain order of the original bucket
+        for (node_t* node = hashmap->list[i]; node != NULL; node = node->next, seen++) {
+            if ((*tail = hm_node_clone(node)) == NULL) {
+                hm_free((void**)&clone);
+                return NULL;
+            }
+            tail = &(*tail)->next;
+            clone->size++;
+        }
+    }
+
+    return clone;
+}
+
+/**
+ * @brief Deep copies a hashmap.
+ *
+ * Every level keeps the capacity and bucket layout of the original, so no key
+ * is hashed again and no table is resized. Borrowed keys and values are
+ * shared with the original, everything else is duplicated. The copy of a
+ * digest enabled hashmap has digests enabled as well.
+ *
+ * @param hashmap Pointer to the hashmap
+ * @return hashmap_t* Heap allocated copy or NULL on error
+ */
+hashmap_t* hm_clone(hashmap_t* hashmap)
+{
+    hashmap_t* clone = NULL;
+
+    if (hashmap == NULL || hashmap->list == NULL) {
+        return NULL;
+    }
+
+    if ((clone = hm_clone_map(hashmap)) != NULL && hashmap->digest_enabled) {
+        hm_digest_build(clone);
+    }
+
+    return clone;
+}
+
+/**
+ * @brief Merges one level of src into dst
+ *
+ * @param dst Destination hashmap
+ * @param src Source hashmap
+ * @param policy Conflict policy
+ * @return int Status code (HM_SUCCESS or HM_ERROR)
+ */
+static int hm_merge_map(hashmap_t* dst, hashmap_t* src, hm_merge_t policy)
+{
+    size_t missing = 0;
+    size_t seen = 0;
+
+    // Counts the new keys first, so dst is resized at most once
+    for (size_t i = 0; i < src->capacity && seen < src->size; i++) {
+        for (node_t* node = src->list[i]; node != NULL; node = node->next, seen++) {
+            hm_key_t key = { node->key, node->key_len };
+            if (hm_bucket_find(dst, &key, node->hash) == NULL) {
+                missing++;
+            }
+        }
+    }
+
+    if (hm_reserve(dst, dst->size + missing) == HM_ERROR) {
+        return HM_ERROR;
+    }
+
+    seen = 0;
+    for (size_t i = 0; i < src->capacity && seen < src->size; i++) {
+        for (node_t* node = src->list[i]; node != NULL; node = node->next, seen++) {
+            hm_key_t key = { node->key, node->key_len };
+            node_t* target = hm_bucket_find(dst, &key, node->hash);
+            node_t* clone = NULL;
+
+            if (target != NULL) {
+                if (target->value_type == HM_VALUE_MAP && node->value_type == HM_VALUE_MAP) {
+                    if (hm_merge_map(target->value, node->value, policy) == HM_ERROR) {
+                        return HM_ERROR;
+                    }
+                    continue;
+                }
+
+                if (policy == HM_MERGE_KEEP) {
+                    continue;
+                }
+
+                if ((clone = hm_node_clone(node)) == NULL) {
+                    return HM_ERROR;
+                }
+
+                // The clone carries the old value away
+                size_t before = hm_account_bytes(dst, target);
+                hm_node_swap_value(target, clone);
+                hm_node_free((void**)&clone);
+                hm_digest_touch(dst, target);
+                hm_account_touch(dst, target, before);
+                continue;
+            }
+
+            if ((clone = hm_node_clone(node)) == NULL) {
+                return HM_ERROR;
+            }
+
+            clone->next = dst->list[clone->hash % dst->capacity];
+            dst->list[clone->hash % dst->capacity] = clone;
+            dst->size++;
+            hm_digest_touch(dst, clone);
+            hm_account_touch(dst, clone, 0);
+        }
+    }
+
+    return HM_SUCCESS;
+}
+
+/**
+ * @brief Overlays src on top of dst, level by level.
+ *
+ * Keys missing in dst are deep copied from src without being hashed again.
+ * When both sides hold a map, they are merged recursively. Any other conflict
+ * is solved by the policy:
+ *
+ *  - HM_MERGE_KEEP: dst keeps its value.
+ *
+ *  - HM_MERGE_OVERWRITE: dst receives a copy of the value in src.
+ *
+ * Each level of dst is resized at most once before receiving the new keys.
+ * On error dst may be partially merged.
+ *
+ * @param dst Destination hashmap
+ * @param src Source hashmap, left untouched
+ * @param policy Conflict policy
+ * @return int Status code (HM_SUCCESS or HM_ERROR)
+ */
+int hm_merge(hashmap_t* dst, hashmap_t* src, hm_merge_t policy)
+{
+    if (dst == NULL || dst->list == NULL || src == NULL || src->list == NULL || dst == src) {
+        return HM_ERROR;
+    }
+
+    if (hm_merge_map(dst, src, policy) == HM_ERROR) {
+        return HM_ERROR;
+    }
+
+    hm_budget_enforce(dst, NULL);
+
+    // Merges are not logged key by key, a durable root is checkpointed instead
+    return dst->wal != NULL ? hm_checkpoint(dst) : HM_SUCCESS;
+}
+
+/**
+ * @brief Enables the subtree digests of a hashmap, or recomputes them.
+ *
+ * Every hashmap of the tree keeps an order independent digest of its keys and
+ * values. Insertions, updates and removals done through the hashmap API
+ * refresh the digests along the modified path only, which lets hm_equal and
+ * hm_diff skip identical subtrees without visiting them.
+ *
+ * Values changed in place, through pointers returned by hm_search and
+ * hm_upsert, hm_node_update_str or hm_list_append, are not tracked. Calling
+ * this function again recomputes the whole tree.
+ *
+ * @param hashmap Pointer to the root hashmap
+ * @return int Status code (HM_SUCCESS or HM_ERROR)
+ */
+int hm_enable_digest(hashmap_t* hashmap)
+{
+    if (hashmap == NULL || hashmap->list == NULL) {
+        return HM_ERROR;
+    }
+
+    hm_digest_build(hashmap);
+    hm_digest_propagate(hashmap);
+
+    return HM_SUCCESS;
+}
+
+/**
+ * @brief Compares two trees by their digests.
  *
- *  - HM_ERROR: An error ocurred.
+ * Digests are enabled on both trees if needed, after which the comparison is
+ * O(1). Equality is probabilistic, as with any 64 bit digest.
  *
- * @param hashmap Pointer to the hashmap
- * @param value Reference to the pointer where the value will be stored
- * @param ... Variable number of keys terminated by a NULL value
- * @return int Status code (HM_SUCCESS, HM_NOT_FOUND or HM_ERROR)
+ * @param a Pointer to the first hashmap
+ * @param b Pointer to the second hashmap
+ * @return bool Whether both trees hold the same keys and values
  */
-int hm_search(hashmap_t* hashmap, void** value, ...)
+bool hm_equal(hashmap_t* a, hashmap_t* b)
 {
-    va_list args;
-    char* key = NULL;
+    if (a == b) {
+        return true;
+    }
 
-    int bucket = 0;
+    if (a == NULL || b == NULL || a->list == NULL || b->list == NULL) {
+        return false;
+    }
 
-    hashmap_t* current_hm = hashmap;
-    node_t* node = NULL;
+    if (!a->digest_enabled) {
+        hm_digest_build(a);
+    }
+    if (!b->digest_enabled) {
+        hm_digest_build(b);
+    }
 
-    if (hashmap == NULL || hashmap->list == NULL) {
+    return a->size == b->size && a->digest == b->digest;
+}
+
+/**
+ * @brief Reports the differences between two levels, descending only into
+ * the maps whose digests differ
+ *
+ * @param a Old hashmap
+ * @param b New hashmap
+ * @param path Path of the current level, filled up to depth
+ * @param depth Depth of the current level
+ * @param callback Receives the differences
+ * @param ctx Passed through to the callback
+ * @return int Status code (HM_SUCCESS, HM_ERROR or the callback status)
+ */
+static int hm_diff_map(hashmap_t* a, hashmap_t* b, hm_key_t* path, size_t depth, hm_diff_cb_t callback, void* ctx)
+{
+    int status = HM_SUCCESS;
+    size_t seen = 0;
+
+    if (a->size == b->size && a->digest == b->digest) {
+        return HM_SUCCESS;
+    }
+
+    if (depth == HM_MAX_PATH_DEPTH) {
         return HM_ERROR;
     }
 
-    va_start(args, value);
+    for (size_t i = 0; i < a->capacity && seen < a->size; i++) {
+        for (node_t* node = a->list[i]; node != NULL; node = node->next, seen++) {
+            path[depth] = (hm_key_t) { node->key, node->key_len };
+            node_t* other = hm_bucket_find(b, &path[depth], node->hash);
+
+            if (other == NULL) {
+                status = callback(HM_DIFF_REMOVED, path, depth + 1, node, NULL, ctx);
+            } else if (other->digest == node->digest) {
+                continue;
+            } else if (node->value_type == HM_VALUE_MAP && other->value_type == HM_VALUE_MAP
+                && node->value != NULL && other->value != NULL) {
+                status = hm_diff_map(node->value, other->value, path, depth + 1, callback, ctx);
+            } else {
+                status = callback(HM_DIFF_CHANGED, path, depth + 1, node, other, ctx);
+            }
 
-    while (1) {
-        // Retrieves the current key
-        key = va_arg(args, char*);
+            if (status != HM_SUCCESS) {
+                return status;
+            }
+        }
+    }
 
-        if (key == NULL) {
-            break;
+    seen = 0;
+    for (size_t i = 0; i < b->capacity && seen < b->size; i++) {
+        for (node_t* node = b->list[i]; node != NULL; node = node->next, seen++) {
+            path[depth] = (hm_key_t) { node->key, node->key_len };
+
+            if (hm_bucket_find(a, &path[depth], node->hash) != NULL) {
+                continue;
+            }
+
+            if ((status = callback(HM_DIFF_ADDED, path, depth + 1, NULL, node, ctx)) != HM_SUCCESS) {
+                return status;
+            }
         }
+    }
+
+    return HM_SUCCESS;
+}
+
+/**
+ * @brief Walks the differences needed to turn tree a into tree b.
+ *
+ * Subtrees with the same digest are skipped, so the cost follows the size of
+ * the changes rather than the size of the trees. The callback receives:
+ *
+ *  - HM_DIFF_ADDED: The key only exists in b, old_node is NULL.
+ *
+ *  - HM_DIFF_REMOVED: The key only exists in a, new_node is NULL.
+ *
+ *  - HM_DIFF_CHANGED: The values differ and are not both maps.
+ *
+ * Digests are enabled on both trees if needed.
+ *
+ * @param a Old hashmap
+ * @param b New hashmap
+ * @param callback Receives each difference along with its path
+ * @param ctx Passed through to the callback
+ * @return int Status code (HM_SUCCESS, HM_ERROR or the status that stopped the walk)
+ */
+int hm_diff(hashmap_t* a, hashmap_t* b, hm_diff_cb_t callback, void* ctx)
+{
+    hm_key_t path[HM_MAX_PATH_DEPTH];
+
+    if (a == NULL || b == NULL || a->list == NULL || b->list == NULL || callback == NULL) {
+        return HM_ERROR;
+    }
+
+    if (!a->digest_enabled) {
+        hm_digest_build(a);
+    }
+    if (!b->digest_enabled) {
+        hm_digest_build(b);
+    }
+
+    return hm_diff_map(a, b, path, 0, callback, ctx);
+}
+
+/**
+ * @brief Records a difference reported by hm_diff into a patch
+ *
+ * @return int Status code (HM_SUCCESS or HM_ERROR)
+ */
+static int hm_patch_record(hm_diff_op_t op, const hm_key_t* path, size_t depth, node_t* old_node, node_t* new_node, void* ctx)
+{
+    hm_patch_t* patch = ctx;
+    hm_patch_op_t* entry = NULL;
+    size_t bytes = depth * sizeof(hm_key_t);
+    char* data = NULL;
 
-        // Hashes the key
-        if ((bucket = hm_hash(current_hm, key)) == HM_ERROR) {
-            va_end(args);
+    (void)old_node;
+
+    if (patch->size == patch->capacity) {
+        size_t capacity = patch->capacity ? patch->capacity * 2 : 8;
+        hm_patch_op_t* ops = realloc(patch->ops, capacity * sizeof(hm_patch_op_t));
+        if (ops == NULL) {
             return HM_ERROR;
         }
+        patch->ops = ops;
+        patch->capacity = capacity;
+    }
 
-        if ((node = current_hm->list[bucket]) == NULL) {
-            va_end(args);
-            return HM_NOT_FOUND;
-        }
+    for (size_t i = 0; i < depth; i++) {
+        bytes += path[i].len;
+    }
 
-        do {
-            if (!strcmp(key, node->key)) {
-                break;
-            }
-            node = node->next;
-        } while (node != NULL);
+    // The path and its keys share a single allocation
+    entry = &patch->ops[patch->size];
+    if ((entry->path = malloc(bytes ? bytes : 1)) == NULL) {
+        return HM_ERROR;
+    }
 
-        if (node && node->value_type == HM_VALUE_MAP) {
-            current_hm = node->value;
-        }
+    data = (char*)(entry->path + depth);
+    for (size_t i = 0; i < depth; i++) {
+        memcpy(data, path[i].data, path[i].len);
+        entry->path[i] = (hm_key_t) { data, path[i].len };
+        data += path[i].len;
     }
 
-    va_end(args);
+    entry->op = op;
+    entry->depth = depth;
+    entry->node = NULL;
 
-    if (node == NULL) {
-        return HM_NOT_FOUND;
+    if (new_node != NULL && (entry->node = hm_node_clone(new_node)) == NULL) {
+        free(entry->path);
+        return HM_ERROR;
     }
 
-    *value = node->value;
+    patch->size++;
+
     return HM_SUCCESS;
 }
 
 /**
- * @brief Inserts a value into the hashmap.
+ * @brief Instantiates a patch that turns one tree into another.
  *
- * The function receives a variable number of keys as arguments.
- * If the key is not found inside the hashmap and it's not the last one, a new
- * hashmap will be created and inserted. If the key is not found inside the
- * hashmap and it's the last one, the value will be inserted.
+ * The patch holds the paths and copies of the new values of every difference
+ * reported by hm_diff, so it stays valid after both trees are freed. Borrowed
+ * keys and values are shared with the tree, as in hm_clone.
+ *
+ * @param from Old hashmap
+ * @param to New hashmap
+ * @return hm_patch_t* Heap allocated patch or NULL on error
+ */
+hm_patch_t* hm_patch_create(hashmap_t* from, hashmap_t* to)
+{
+    hm_patch_t* patch = calloc(1, sizeof(hm_patch_t));
+
+    if (patch == NULL) {
+        return NULL;
+    }
+
+    if (hm_diff(from, to, hm_patch_record, patch) != HM_SUCCESS) {
+        hm_patch_free((void**)&patch);
+        return NULL;
+    }
+
+    return patch;
+}
+
+/**
+ * @brief Applies a patch created by hm_patch_create.
+ *
+ * Missing levels are created as with hm_insert and removing a key that does
+ * not exist is not an error. Values are copied from the patch, which can be
+ * applied any number of times. Hashmaps that borrow their keys reference the
+ * keys held by the patch, which must then outlive them.
+ *
+ * On error the hashmap may be partially patched.
  *
  * @param hashmap Pointer to the hashmap
- * @param value_type Value type
- * @param value Pointer to the value
- * @param ... Variable number of keys terminated by a NULL value
+ * @param patch Pointer to the patch
+ * @return int Status code (HM_SUCCESS or HM_ERROR)
  */
-void hm_insert(hashmap_t* hashmap, node_value_t value_type, void* value, ...)
+int hm_patch(hashmap_t* hashmap, const hm_patch_t* patch)
 {
-    va_list args;
+    if (hashmap == NULL || hashmap->list == NULL || patch == NULL) {
+        return HM_ERROR;
+    }
 
-    int bucket = 0;
-    double current_load_factor = 0;
+    for (size_t i = 0; i < patch->size; i++) {
+        hm_patch_op_t* entry = &patch->ops[i];
+        hashmap_t* owner = NULL;
+        node_t* node = NULL;
+        node_t* clone = NULL;
 
-    node_t* node = NULL;
-    hashmap_t* current_hm = NULL;
+        if (entry->op == HM_DIFF_REMOVED) {
+            if (hm_removen(hashmap, entry->path, entry->depth) == HM_ERROR) {
+                return HM_ERROR;
+            }
+            continue;
+        }
 
-    char* key = NULL;
-    char* next_key = NULL;
+        if ((node = hm_upsert_path(hashmap, entry->path, entry->depth, HM_VALUE_BOOL, NULL, NULL, &owner)) == NULL
+            || (clone = hm_node_clone(entry->node)) == NULL) {
+            return HM_ERROR;
+        }
 
-    char* node_key = NULL;
-    void* node_val = NULL;
+        // The clone carries the old value away
+        size_t before = hm_account_bytes(owner, node);
+        hm_node_swap_value(node, clone);
+        hm_node_free((void**)&clone);
+        hm_digest_touch(owner, node);
+        hm_account_touch(owner, node, before);
 
-    if (hashmap == NULL || hashmap->list == NULL) {
+        if (hm_wal_log_set(hashmap, entry->path, entry->depth, node) == HM_ERROR) {
+            return HM_ERROR;
+        }
+    }
+
+    return hm_budget_enforce(hashmap, NULL);
+}
+
+/**
+ * @brief Deallocates the memory used by a patch
+ *
+ * @param patch_p Reference to the patch pointer
+ */
+void hm_patch_free(void** patch_p)
+{
+    if (patch_p == NULL || *patch_p == NULL) {
         return;
     }
 
-    current_hm = hashmap;
+    hm_patch_t* patch = *patch_p;
 
-    va_start(args, value);
-    key = va_arg(args, char*);
+    for (size_t i = 0; i < patch->size; i++) {
+        free(patch->ops[i].path);
+        hm_node_free((void**)&patch->ops[i].node);
+    }
+
+    free(patch->ops);
+    free(patch);
+    *patch_p = NULL;
+}
 
-    while (key != NULL) {
-        node_value_t node_type = HM_VALUE_MAP;
+/**
+ * @brief Growable buffer used by the serializer
+ */
+typedef struct {
+    char* data;
+    size_t len;
+    size_t capacity;
+} hm_buf_t;
 
-        next_key = va_arg(args, char*);
+/**
+ * @brief Appends bytes to the buffer, growing it geometrically when needed
+ *
+ * @param buf Pointer to the buffer
+ * @param data Bytes to be appended
+ * @param len Number of bytes
+ * @return int Status code (HM_SUCCESS or HM_ERROR)
+ */
+static int hm_buf_append(hm_buf_t* buf, const char* data, size_t len)
+{
+    if (buf->len + len + 1 > buf->capacity) {
+        size_t new_capacity = buf->capacity ? buf->capacity : 64;
+        while (buf->len + len + 1 > new_capacity) {
+            new_capacity *= 2;
+        }
 
-        if ((current_load_factor = hm_get_load_factor(current_hm)) == HM_ERROR) {
-            return;
+        char* new_data = realloc(buf->data, new_capacity);
+        if (new_data == NULL) {
+            return HM_ERROR;
         }
 
-        HM_LOG(LOG_LEVEL_DEBUG, "Current load factor: %.2f", current_load_factor);
+        buf->data = new_data;
+        buf->capacity = new_capacity;
+    }
 
-        if (current_load_factor >= HM_LOAD_FACTOR_THRESHOLD) {
-            HM_LOG(LOG_LEVEL_DEBUG, "Load factor threshold reached. Resizing hashmap");
-            if (hm_resize(current_hm, HM_RESIZE_FACTOR) == HM_ERROR) {
-                return;
-            }
-        }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    buf->data[buf->len] = '\0';
 
-        if ((bucket = hm_hash(current_hm, key)) == HM_ERROR) {
-            va_end(args);
-            return;
+    return HM_SUCCESS;
+}
+
+/**
+ * @brief Appends a quoted and escaped JSON string to the buffer
+ *
+ * @param buf Pointer to the buffer
+ * @param str String bytes
+ * @param len Number of bytes
+ * @return int Status code (HM_SUCCESS or HM_ERROR)
+ */
+static int hm_buf_append_json_str(hm_buf_t* buf, const char* str, size_t len)
+{
+    size_t start = 0;
+    char escaped[8];
+
+    if (hm_buf_append(buf, "\"", 1) == HM_ERROR) {
+        return HM_ERROR;
+    }
+
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = str[i];
+
+        if (c != '"' && c != '\\' && c >= 0x20) {
+            continue;
         }
 
-        node = current_hm->list[bucket];
+        if (c == '"' || c == '\\') {
+            snprintf(escaped, sizeof(escaped), "\\%c", c);
+        } else {
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+        }
 
-        while (node != NULL) {
-            if (!strcmp(key, node->key)) {
-                break;
-            }
-            node = node->next;
+        if (hm_buf_append(buf, str + start, i - start) == HM_ERROR
+            || hm_buf_append(buf, escaped, strlen(escaped)) == HM_ERROR) {
+            return HM_ERROR;
         }
+        start = i + 1;
+    }
 
-        if (node == NULL) {
-            // Key not found inside current hashmap
-            node_key = strdup(key);
+    if (hm_buf_append(buf, str + start, len - start) == HM_ERROR) {
+        return HM_ERROR;
+    }
 
-            // If it's not the last one, create a new hashmap
-            if (next_key != NULL && ((node_val = hm_create_default()) == NULL)) {
-                va_end(args);
-                free(node_key);
-                return;
-            }
-        } else {
-            // Key found inside current hashmap
-            // If it's not the last one, checks if its a map
-            if (next_key != NULL) {
-                if (node->value_type != HM_VALUE_MAP) {
-                    HM_LOG(LOG_LEVEL_WARNING, "Key [%s] is not a hashmap", key);
-                    va_end(args);
-                    return;
-                }
-            } else {
-                // If it's the last one, checks if it's a string
-                if (value_type == HM_VALUE_STR && node->value_type == HM_VALUE_STR) {
-                    free(node->value);
-                    node->value = strdup((char*)value);
-                    continue;
-                }
-            }
+    return hm_buf_append(buf, "\"", 1);
+}
+
+/**
+ * @brief Appends binary data to the buffer as a base64 JSON string
+ *
+ * @param buf Pointer to the buffer
+ * @param data Bytes to be encoded
+ * @param len Number of bytes
+ * @return int Status code (HM_SUCCESS or HM_ERROR)
+ */
+static int hm_buf_append_base64(hm_buf_t* buf, const unsigned char* data, size_t len)
+{
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    char chunk[4];
+
+    if (hm_buf_append(buf, "\"", 1) == HM_ERROR) {
+        return HM_ERROR;
+    }
+
+    for (size_t i = 0; i < len; i += 3) {
+        uint32_t triple = (uint32_t)data[i] << 16;
+        if (i + 1 < len) {
+            triple |= (uint32_t)data[i + 1] << 8;
+        }
+        if (i + 2 < len) {
+            triple |= data[i + 2];
         }
 
-        if (next_key == NULL) {
-            switch (value_type) {
-            case HM_VALUE_STR:
-                node_val = value ? strdup(value) : strdup("");
-                break;
-            case HM_VALUE_MAP:
-                node_val = value ? value : hm_create_default();
-                break;
-            case HM_VALUE_LIST:
-                node_val = value ? value : hm_list_create_default();
-                break;
-            }
+        chunk[0] = alphabet[(triple >> 18) & 0x3F];
+        chunk[1] = alphabet[(triple >> 12) & 0x3F];
+        chunk[2] = i + 1 < len ? alphabet[(triple >> 6) & 0x3F] : '=';
+        chunk[3] = i + 2 < len ? alphabet[triple & 0x3F] : '=';
 
-            node_type = value_type;
+        if (hm_buf_append(buf, chunk, sizeof(chunk)) == HM_ERROR) {
+            return HM_ERROR;
         }
+    }
+
+    return hm_buf_append(buf, "\"", 1);
+}
 
-        if (node_key && node_val) {
+static int hm_serialize_map_into(hm_buf_t* buf, hashmap_t* hashmap);
+static int hm_serialize_node_into(hm_buf_t* buf, node_t* node);
 
-            node = hm_node_create(node_key, node_type, node_val, current_hm->list[bucket]);
+/**
+ * @brief Appends the JSON representation of a node's value to the buffer
+ *
+ * @param buf Pointer to the buffer
+ * @param node Pointer to the node
+ * @return int Status code (HM_SUCCESS or HM_ERROR)
+ */
+static int hm_serialize_value_into(hm_buf_t* buf, node_t* node)
+{
+    char number[32];
 
-            current_hm->list[bucket] = node;
-            current_hm->size++;
+    switch (node->value_type) {
+    case HM_VALUE_STR:
+        if (node->value == NULL) {
+            return hm_buf_append(buf, "null", 4);
+        }
+        return hm_buf_append_json_str(buf, node->value, strlen(node->value));
+    case HM_VALUE_MAP:
+        if (node->value == NULL || ((hashmap_t*)node->value)->list == NULL) {
+            return hm_buf_append(buf, "null", 4);
+        }
+        return hm_serialize_map_into(buf, node->value);
+    case HM_VALUE_LIST: {
+        list_t* list = node->value;
+        if (list == NULL) {
+            return hm_buf_append(buf, "null", 4);
         }
 
-        if (node->value_type == HM_VALUE_MAP) {
-            current_hm = node->value;
+        if (hm_buf_append(buf, "[", 1) == HM_ERROR) {
+            return HM_ERROR;
+        }
+        for (size_t i = 0; i < list->size; i++) {
+            if ((i > 0 && hm_buf_append(buf, ",", 1) == HM_ERROR)
+                || hm_serialize_node_into(buf, list->items[i]) == HM_ERROR) {
+                return HM_ERROR;
+            }
+        }
+        return hm_buf_append(buf, "]", 1);
+    }
+    case HM_VALUE_INT64:
+        snprintf(number, sizeof(number), "%" PRId64, node->i64);
+        return hm_buf_append(buf, number, strlen(number));
+    case HM_VALUE_DOUBLE:
+        // JSON has no representation for NaN and infinities
+        if (!isfinite(node->f64)) {
+            return hm_buf_append(buf, "null", 4);
         }
+        snprintf(number, sizeof(number), "%.17g", node->f64);
+        return hm_buf_append(buf, number, strlen(number));
+    case HM_VALUE_BOOL:
+        return node->boolean ? hm_buf_append(buf, "true", 4) : hm_buf_append(buf, "false", 5);
+    case HM_VALUE_BLOB:
+        return hm_buf_append_base64(buf, node->blob.data, node->blob.len);
+    }
+
+    return HM_ERROR;
+}
 
-        key = next_key;
-        node_key = NULL;
-        node_val = NULL;
+/**
+ * @brief Appends a node to the buffer as a JSON member, or as a bare value
+ * when the node has no key (list items).
+ *
+ * @param buf Pointer to the buffer
+ * @param node Pointer to the node
+ * @return int Status code (HM_SUCCESS or HM_ERROR)
+ */
+static int hm_serialize_node_into(hm_buf_t* buf, node_t* node)
+{
+    if (node->key != NULL) {
+        if (hm_buf_append_json_str(buf, node->key, node->key_len) == HM_ERROR
+            || hm_buf_append(buf, ":", 1) == HM_ERROR) {
+            return HM_ERROR;
+        }
     }
 
-    va_end(args);
+    return hm_serialize_value_into(buf, node);
+}
+
+/**
+ * @brief Appends a hashmap to the buffer as a JSON object
+ *
+ * @param buf Pointer to the buffer
+ * @param hashmap Pointer to the hashmap
+ * @return int Status code (HM_SUCCESS or HM_ERROR)
+ */
+static int hm_serialize_map_into(hm_buf_t* buf, hashmap_t* hashmap)
+{
+    size_t seen = 0;
+
+    if (hm_buf_append(buf, "{", 1) == HM_ERROR) {
+        return HM_ERROR;
+    }
+
+    for (size_t i = 0; i < hashmap->capacity && seen < hashmap->size; i++) {
+        for (node_t* current = hashmap->list[i]; current != NULL; current = current->next, seen++) {
+            if ((seen > 0 && hm_buf_append(buf, ",", 1) == HM_ERROR)
+                || hm_serialize_node_into(buf, current) == HM_ERROR) {
+                return HM_ERROR;
+            }
+        }
+    }
+
+    return hm_buf_append(buf, "}", 1);
 }
 
 /**
  * @brief Serializes a hashmap into a JSON string
  *
+ * Integers, doubles and booleans are written as JSON numbers and literals,
+ * blobs as base64 strings and lists as arrays.
+ *
  * @param hashmap Pointer to the hashmap
  * @return char* Heap allocated JSON string
  */
 char* hm_serialize(hashmap_t* hashmap)
 {
+    hm_buf_t buf = { 0 };
+
     if (hashmap == NULL || hashmap->list == NULL) {
         return NULL;
     }
 
-    size_t buffer_size = 2; // For opening and closing braces
-    size_t offset = 0;
-    char* serialized = malloc(buffer_size);
-    if (serialized == NULL) {
+    if (hm_serialize_map_into(&buf, hashmap) == HM_ERROR) {
+        free(buf.data);
         return NULL;
     }
 
-    serialized[offset++] = '{';
-
-    bool first_item = true;
-    for (int i = 0; i < hashmap->capacity; i++) {
-        for (node_t* current = hashmap->list[i]; current != NULL; current = current->next) {
-            if (!first_item) {
-                serialized[offset++] = ',';
-                buffer_size++;
-            }
-
-            char* node_serialized = hm_serialize_node(current);
-            if (node_serialized) {
-                size_t node_length = strlen(node_serialized);
-                if (offset + node_length >= buffer_size) {
-                    buffer_size += node_length;
-                    serialized = realloc(serialized, buffer_size);
-                    if (serialized == NULL) {
-                        free(node_serialized);
-                        return NULL;
-                    }
-                }
-                strcpy(serialized + offset, node_serialized);
-                offset += node_length;
-                first_item = false;
-                free(node_serialized);
-            }
-        }
-    }
-
-    serialized[offset++] = '}';
-    serialized[offset] = '\0'; // Null-terminate the string
-
-    return serialized;
+    return buf.data;
 }
 
 /**
@@ -784,41 +3906,16 @@ char* hm_serialize(hashmap_t* hashmap)
  */
 char* hm_serialize_node(node_t* node)
 {
+    hm_buf_t buf = { 0 };
+
     if (node == NULL) {
         return NULL;
     }
 
-    size_t key_len = strlen(node->key);
-    size_t buffer_size = key_len + 4; // Key, quotes, colon
-
-    char* value_serialized = NULL;
-    if (node->value_type == HM_VALUE_STR) {
-        value_serialized = (char*)node->value;
-        buffer_size += strlen(value_serialized) + 2; // Value and quotes
-    } else if (node->value_type == HM_VALUE_MAP) {
-        value_serialized = hm_serialize((hashmap_t*)node->value);
-        buffer_size += value_serialized ? strlen(value_serialized) : 4; // Value or "null"
-    }
-
-    char* serialized_node = malloc(buffer_size);
-    if (serialized_node == NULL) {
-        free(value_serialized);
+    if (hm_serialize_node_into(&buf, node) == HM_ERROR) {
+        free(buf.data);
         return NULL;
     }
 
-    sprintf(serialized_node, "\"%s\":", node->key);
-    if (node->value_type == HM_VALUE_STR) {
-        strcat(serialized_node, "\"");
-        strcat(serialized_node, value_serialized);
-        strcat(serialized_node, "\"");
-    } else if (node->value_type == HM_VALUE_MAP) {
-        if (value_serialized) {
-            strcat(serialized_node, value_serialized);
-            free(value_serialized);
-        } else {
-            strcat(serialized_node, "null");
-        }
-    }
-
-    return serialized_node;
+    return buf.data;
 }
@@ -0,0 +1,692 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cmap/log.h>
+#include <cmap/map.h>
+#include <cmap/shm.h>
+
+#define HM_SHM_MAGIC 0x33504d48534d43ULL // "CMSHMP3"
+#define HM_SHM_HEADER_SIZE 4096
+#define HM_SHM_ALIGN 8
+
+/*
+ * Region layout: a header followed by two slots of slot_size bytes. The
+ * writer fills the slot readers are not pointed at, then flips active. Every
+ * link inside a slot is an offset from the start of the slot, 0 meaning none.
+ */
+typedef struct {
+    // Odd while the slot is being written
+    uint64_t seq;
+    uint64_t used;
+    uint64_t root;
+} hm_shm_slot_t;
+
+typedef struct {
+    uint64_t magic;
+    uint64_t slot_size;
+    uint64_t generation;
+    uint32_t active;
+    // Set once hm_shm_create replaced the region with a new one under the same name
+    uint32_t retired;
+    hm_shm_slot_t slots[2];
+} hm_shm_header_t;
+
+typedef struct {
+    uint64_t buckets;
+    uint64_t capacity;
+    uint64_t size;
+} hm_shm_map_rec_t;
+
+typedef struct {
+    uint64_t key;
+    uint64_t key_len;
+    uint64_t next;
+    uint64_t hash;
+    uint32_t type;
+    // Strings, blobs, maps and lists are an offset and a length (entries for lists)
+    union {
+        struct {
+            uint64_t off;
+            uint64_t len;
+        } ref;
+        int64_t i64;
+        double f64;
+        uint64_t boolean;
+    };
+} hm_shm_node_t;
+
+struct hm_shm {
+    hm_shm_header_t* header;
+    size_t map_size;
+    bool writable;
+};
+
+typedef struct {
+    unsigned char* base;
+    uint64_t size;
+    uint64_t used;
+} hm_shm_arena_t;
+
+/**
+ * @brief Bump allocates zeroed bytes inside a slot
+ *
+ * @param arena Pointer to the arena
+ * @param len Number of bytes
+ * @return uint64_t Offset of the allocation or 0 if the slot is full
+ */
+static uint64_t hm_shm_alloc(hm_shm_arena_t* arena, uint64_t len)
+{
+    uint64_t off = (arena->used + HM_SHM_ALIGN - 1) & ~(uint64_t)(HM_SHM_ALIGN - 1);
+
+    if (off > arena->size || len > arena->size - off) {
+        return 0;
+    }
+
+    memset(arena->base + off, 0, len);
+    arena->used = off + len;
+
+    return off;
+}
+
+/**
+ * @brief Resolves an offset read from a slot, checking it stays inside it
+ *
+ * @return const void* Pointer into the slot or NULL if out of bounds
+ */
+static const void* hm_shm_ptr(const unsigned char* base, uint64_t size, uint64_t off, uint64_t len)
+{
+    if (off == 0 || off > size || len > size - off) {
+        return NULL;
+    }
+
+    return base + off;
+}
+
+static unsigned char* hm_shm_slot_base(hm_shm_header_t* header, uint32_t slot)
+{
+    return (unsigned char*)header + HM_SHM_HEADER_SIZE + slot * header->slot_size;
+}
+
+static uint64_t hm_shm_copy_map(hm_shm_arena_t* arena, hashmap_t* hashmap);
+
+/**
+ * @brief Copies a node and its value into the slot
+ *
+ * @param arena Pointer to the arena
+ * @param node Pointer to the node
+ * @return uint64_t Offset of the copy or 0 if the slot is full
+ */
+static uint64_t hm_shm_copy_node(hm_shm_arena_t* arena, node_t* node)
+{
+    uint64_t off = hm_shm_alloc(arena, sizeof(hm_shm_node_t));
+    uint64_t data = 0;
+
+    if (off == 0) {
+        return 0;
+    }
+
+    // The base never moves, so the record can be filled while allocating
+    hm_shm_node_t* rec = (hm_shm_node_t*)(arena->base + off);
+    rec->hash = node->hash;
+    rec->type = node->value_type;
+
+    if (node->key != NULL) {
+        if ((rec->key = hm_shm_alloc(arena, node->key_len + 1)) == 0) {
+            return 0;
+        }
+        memcpy(arena->base + rec->key, node->key, node->key_len);
+        rec->key_len = node->key_len;
+    }
+
+    switch (node->value_type) {
+    case HM_VALUE_STR:
+        rec->ref.len = node->value ? strlen(node->value) : 0;
+        if ((data = hm_shm_alloc(arena, rec->ref.len + 1)) == 0) {
+            return 0;
+        }
+        memcpy(arena->base + data, node->value ? node->value : "", rec->ref.len);
+        rec->ref.off = data;
+        break;
+    case HM_VALUE_BLOB:
+        if ((data = hm_shm_alloc(arena, node->blob.len + 1)) == 0) {
+            return 0;
+        }
+        memcpy(arena->base + data, node->blob.data, node->blob.len);
+        rec->ref.off = data;
+        rec->ref.len = node->blob.len;
+        break;
+    case HM_VALUE_MAP:
+        if (node->value != NULL && (rec->ref.off = hm_shm_copy_map(arena, node->value)) == 0) {
+            return 0;
+        }
+        break;
+    case HM_VALUE_LIST: {
+        list_t* list = node->value;
+        uint64_t size = list ? (uint64_t)list->size : 0;
+
+        if ((data = hm_shm_alloc(arena, size * sizeof(uint64_t) + 1)) == 0) {
+            return 0;
+        }
+        for (uint64_t i = 0; i < size; i++) {
+            uint64_t item = hm_shm_copy_node(arena, list->items[i]);
+            if (item == 0) {
+                return 0;
+            }
+            ((uint64_t*)(arena->base + data))[i] = item;
+        }
+        rec->ref.off = data;
+        rec->ref.len = size;
+        break;
+    }
+    case HM_VALUE_INT64:
+        rec->i64 = node->i64;
+        break;
+    case HM_VALUE_DOUBLE:
+        rec->f64 = node->f64;
+        break;
+    case HM_VALUE_BOOL:
+        rec->boolean = node->boolean;
+        break;
+    }
+
+    return off;
+}
+
+/**
+ * @brief Copies a hashmap into the slot, keeping its capacity and the hashes
+ * of its keys
+ *
+ * @param arena Pointer to the arena
+ * @param hashmap Pointer to the hashmap
+ * @return uint64_t Offset of the copy or 0 if the slot is full
+ */
+static uint64_t hm_shm_copy_map(hm_shm_arena_t* arena, hashmap_t* hashmap)
+{
+    uint64_t off = hm_shm_alloc(arena, sizeof(hm_shm_map_rec_t));
+    uint64_t buckets = 0;
+    size_t seen = 0;
+
+    if (off == 0 || (buckets = hm_shm_alloc(arena, (uint64_t)hashmap->capacity * sizeof(uint64_t))) == 0) {
+        return 0;
+    }
+
+    hm_shm_map_rec_t* rec = (hm_shm_map_rec_t*)(arena->base + off);
+    rec->buckets = buckets;
+    rec->capacity = hashmap->capacity;
+    rec->size = hashmap->size;
+
+    for (size_t i = 0; i < hashmap->capacity && seen < hashmap->size; i++) {
+        for (node_t* node = hashmap->list[i]; node != NULL; node = node->next, seen++) {
+            uint64_t* bucket = (uint64_t*)(arena->base + buckets) + i;
+            uint64_t node_off = hm_shm_copy_node(arena, node);
+
+            if (node_off == 0) {
+                return 0;
+            }
+
+            ((hm_shm_node_t*)(arena->base + node_off))->next = *bucket;
+            *bucket = node_off;
+        }
+    }
+
+    return off;
+}
+
+/**
+ * @brief Walks a path inside a slot. Every offset is bounds checked, since
+ * the slot may be overwritten while it is read, in which case the caller
+ * retries. Strings and blobs are copied out before the caller checks the
+ * slot, so a torn copy is never returned.
+ *
+ * @param base Start of the slot
+ * @param size Size of the slot
+ * @param root Offset of the root map
+ * @param keys Array of keys
+ * @param hashes Hashes of the keys
+ * @param depth Number of keys
+ * @param value Receives the value
+ * @return int Status code (HM_SUCCESS, HM_NOT_FOUND or HM_ERROR)
+ */
+static int hm_shm_walk(const unsigned char* base, uint64_t size, uint64_t root, const hm_key_t* keys, const uint64_t* hashes, size_t depth, hm_shm_value_t* value)
+{
+    const hm_shm_node_t* found = NULL;
+    uint64_t map_off = root;
+    const void* data = NULL;
+
+    for (size_t i = 0; i < depth; i++) {
+        const hm_shm_map_rec_t* map = hm_shm_ptr(base, size, map_off, sizeof(hm_shm_map_rec_t));
+        const uint64_t* buckets = NULL;
+
+        if (map == NULL || map->capacity == 0 || map->capacity > size / sizeof(uint64_t)
+            || (buckets = hm_shm_ptr(base, size, map->buckets, map->capacity * sizeof(uint64_t))) == NULL) {
+            return HM_ERROR;
+        }
+
+        found = NULL;
+        uint64_t node_off = buckets[hashes[i] % map->capacity];
+        for (uint64_t steps = 0; node_off != 0 && steps <= map->size; steps++) {
+            const hm_shm_node_t* node = hm_shm_ptr(base, size, node_off, sizeof(hm_shm_node_t));
+            const void* key = NULL;
+
+            if (node == NULL) {
+                return HM_ERROR;
+            }
+
+            if (node->hash == hashes[i] && node->key_len == keys[i].len
+                && (key = hm_shm_ptr(base, size, node->key, node->key_len + 1)) != NULL
+                && !memcmp(key, keys[i].data, keys[i].len)) {
+                found = node;
+                break;
+            }
+            node_off = node->next;
+        }
+
+        if (found == NULL) {
+            return HM_NOT_FOUND;
+        }
+
+        if (i + 1 < depth) {
+            if (found->type != HM_VALUE_MAP) {
+                return HM_NOT_FOUND;
+            }
+            map_off = found->ref.off;
+        }
+    }
+
+    value->type = found->type;
+
+    switch (found->type) {
+    case HM_VALUE_STR:
+        if ((data = hm_shm_ptr(base, size, found->ref.off, found->ref.len + 1)) == NULL
+            || value->buf == NULL || found->ref.len >= value->buf_len) {
+            return HM_ERROR;
+        }
+        memcpy(value->buf, data, found->ref.len);
+        ((char*)value->buf)[found->ref.len] = '\0';
+        value->str = value->buf;
+        break;
+    case HM_VALUE_BLOB:
+        if ((data = hm_shm_ptr(base, size, found->ref.off, found->ref.len + 1)) == NULL
+            || (found->ref.len > 0 && value->buf == NULL) || found->ref.len > value->buf_len) {
+            return HM_ERROR;
+        }
+        if (found->ref.len > 0) {
+            memcpy(value->buf, data, found->ref.len);
+        }
+        value->blob.data = value->buf;
+        value->blob.len = found->ref.len;
+        break;
+    case HM_VALUE_MAP: {
+        const hm_shm_map_rec_t* map = found->ref.off ? hm_shm_ptr(base, size, found->ref.off, sizeof(hm_shm_map_rec_t)) : NULL;
+        value->size = map ? map->size : 0;
+        break;
+    }
+    case HM_VALUE_LIST:
+        value->size = found->ref.len;
+        break;
+    case HM_VALUE_INT64:
+        value->i64 = found->i64;
+        break;
+    case HM_VALUE_DOUBLE:
+        value->f64 = found->f64;
+        break;
+    case HM_VALUE_BOOL:
+        value->boolean = found->boolean != 0;
+        break;
+    default:
+        return HM_ERROR;
+    }
+
+    return HM_SUCCESS;
+}
+
+/**
+ * @brief Maps a shared memory object
+ *
+ * @return hm_shm_t* Handle or NULL on error
+ */
+static hm_shm_t* hm_shm_map(int fd, size_t map_size, bool writable)
+{
+    hm_shm_t* shm = calloc(1, sizeof(hm_shm_t));
+    void* addr = NULL;
+
+    if (shm == NULL) {
+        return NULL;
+    }
+
+    addr = mmap(NULL, map_size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        free(shm);
+        return NULL;
+    }
+
+    shm->header = addr;
+    shm->map_size = map_size;
+    shm->writable = writable;
+
+    return shm;
+}
+
+/**
+ * @brief Flags an existing region as replaced, so its readers know to open
+ * the new one. Their mappings stay valid, the region is never resized.
+ *
+ * @param name Shared memory object name
+ */
+static void hm_shm_retire(const char* name)
+{
+    hm_shm_header_t* header = NULL;
+    struct stat st;
+    int fd = -1;
+
+    if ((fd = shm_open(name, O_RDWR, 0)) < 0) {
+        return;
+    }
+
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= HM_SHM_HEADER_SIZE) {
+        header = mmap(NULL, HM_SHM_HEADER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (header != MAP_FAILED) {
+            if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) == HM_SHM_MAGIC) {
+                __atomic_store_n(&header->retired, 1, __ATOMIC_RELEASE);
+            }
+            munmap(header, HM_SHM_HEADER_SIZE);
+        }
+    }
+
+    close(fd);
+}
+
+/**
+ * @brief Creates a shared memory region holding a read only copy of a tree.
+ *
+ * The region holds two slots of the given size, each able to hold a full copy
+ * of the tree. The creating process is the single writer, it publishes trees
+ * with hm_shm_publish. Any process on the host can then open the region with
+ * hm_shm_open and search it directly, so a single copy of the data serves
+ * every reader.
+ *
+ * An existing region with the same name is flagged as retired and unlinked,
+ * and a new one is created in its place. Readers still mapping the old one
+ * keep reading its last tree until they notice, see hm_shm_retired, and
+ * open the new one.
+ *
+ * @param name Shared memory object name, as in shm_open ("/name")
+ * @param size Bytes available to each published tree
+ * @return hm_shm_t* Handle or NULL on error
+ */
+hm_shm_t* hm_shm_create(const char* name, size_t size)
+{
+    hm_shm_t* shm = NULL;
+    size_t map_size = 0;
+    int fd = -1;
+
+    if (name == NULL || size == 0) {
+        return NULL;
+    }
+
+    size = (size + HM_SHM_ALIGN - 1) & ~(size_t)(HM_SHM_ALIGN - 1);
+    map_size = HM_SHM_HEADER_SIZE + 2 * size;
+
+    // Resizing the old object in place would fault every reader past its new end
+    hm_shm_retire(name);
+    if (shm_unlink(name) < 0 && errno != ENOENT) {
+        HM_LOG(LOG_LEVEL_ERROR, "Failed to replace [%s]: %s", name, strerror(errno));
+        return NULL;
+    }
+
+    if ((fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644)) < 0) {
+        HM_LOG(LOG_LEVEL_ERROR, "Failed to create [%s]: %s", name, strerror(errno));
+        return NULL;
+    }
+
+    if (ftruncate(fd, map_size) < 0 || (shm = hm_shm_map(fd, map_size, true)) == NULL) {
+        HM_LOG(LOG_LEVEL_ERROR, "Failed to map [%s]: %s", name, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    close(fd);
+
+    shm->header->slot_size = size;
+    shm->header->generation = 0;
+    shm->header->active = 0;
+    // Readers check the magic last
+    __atomic_store_n(&shm->header->magic, HM_SHM_MAGIC, __ATOMIC_RELEASE);
+
+    return shm;
+}
+
+/**
+ * @brief Opens a region created by hm_shm_create for reading.
+ *
+ * @param name Shared memory object name
+ * @return hm_shm_t* Handle or NULL on error
+ */
+hm_shm_t* hm_shm_open(const char* name)
+{
+    hm_shm_t* shm = NULL;
+    struct stat st;
+    int fd = -1;
+
+    if (name == NULL || (fd = shm_open(name, O_RDONLY, 0)) < 0) {
+        return NULL;
+    }
+
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < HM_SHM_HEADER_SIZE || (shm = hm_shm_map(fd, st.st_size, false)) == NULL) {
+        close(fd);
+        return NULL;
+    }
+
+    close(fd);
+
+    if (__atomic_load_n(&shm->header->magic, __ATOMIC_ACQUIRE) != HM_SHM_MAGIC
+        || shm->header->slot_size > (shm->map_size - HM_SHM_HEADER_SIZE) / 2) {
+        HM_LOG(LOG_LEVEL_ERROR, "Invalid shared memory region [%s]", name);
+        hm_shm_close((void**)&shm);
+        return NULL;
+    }
+
+    return shm;
+}
+
+/**
+ * @brief Publishes a copy of a tree to every reader.
+ *
+ * The tree is copied into the slot readers are not using, with offsets in
+ * place of pointers, then made current in a single step. Each slot is guarded
+ * by a sequence counter, so a reader that was still inside the overwritten
+ * slot notices it and retries. Readers never block the writer.
+ *
+ * Only one process may publish to a region.
+ *
+ * @param shm Handle returned by hm_shm_create
+ * @param hashmap Pointer to the hashmap
+ * @return int Status code (HM_SUCCESS or HM_ERROR if the tree does not fit)
+ */
+int hm_shm_publish(hm_shm_t* shm, hashmap_t* hashmap)
+{
+    hm_shm_header_t* header = NULL;
+    hm_shm_slot_t* slot = NULL;
+    uint32_t index = 0;
+    uint64_t seq = 0;
+    uint64_t root = 0;
+
+    if (shm == NULL || !shm->writable || hashmap == NULL || hashmap->list == NULL) {
+        return HM_ERROR;
+    }
+
+    header = shm->header;
+    index = 1 - header->active;
+    slot = &header->slots[index];
+    seq = slot->seq;
+
+    __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    hm_shm_arena_t arena = { hm_shm_slot_base(header, index), header->slot_size, HM_SHM_ALIGN };
+    root = hm_shm_copy_map(&arena, hashmap);
+
+    slot->root = root;
+    slot->used = arena.used;
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+
+    if (root == 0) {
+        HM_LOG(LOG_LEVEL_ERROR, "The tree does not fit in the shared memory region");
+        return HM_ERROR;
+    }
+
+    __atomic_store_n(&header->active, index, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&header->generation, 1, __ATOMIC_RELEASE);
+
+    return HM_SUCCESS;
+}
+
+/**
+ * @brief Searches the last published tree.
+ *
+ * Same as hm_shm_search, but the path is given as an array of length
+ * delimited keys.
+ *
+ * @param shm Region handle
+ * @param value Receives the value
+ * @param keys Array of keys
+ * @param depth Number of keys
+ * @return int Status code (HM_SUCCESS, HM_NOT_FOUND or HM_ERROR)
+ */
+int hm_shm_searchn(hm_shm_t* shm, hm_shm_value_t* value, const hm_key_t* keys, size_t depth)
+{
+    uint64_t hashes[HM_MAX_PATH_DEPTH];
+    hm_shm_header_t* header = NULL;
+
+    if (shm == NULL || value == NULL || keys == NULL || depth == 0 || depth > HM_MAX_PATH_DEPTH) {
+        return HM_ERROR;
+    }
+
+    header = shm->header;
+
+    // Hashed once, outside the retry loop
+    for (size_t i = 0; i < depth; i++) {
+        hashes[i] = hm_key_hash(keys[i].data, keys[i].len);
+    }
+
+    for (;;) {
+        uint32_t index = __atomic_load_n(&header->active, __ATOMIC_ACQUIRE) & 1;
+        hm_shm_slot_t* slot = &header->slots[index];
+        uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        int status = HM_NOT_FOUND;
+
+        // The writer is filling the slot, gives it the CPU instead of spinning
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+
+        uint64_t root = __atomic_load_n(&slot->root, __ATOMIC_RELAXED);
+        if (root != 0) {
+            status = hm_shm_walk(hm_shm_slot_base(header, index), header->slot_size, root, keys, hashes, depth, value);
+        }
+
+        // The slot must still be the current one, a failed publish leaves the other one unusable
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq
+            && (__atomic_load_n(&header->active, __ATOMIC_RELAXED) & 1) == index) {
+            return status;
+        }
+    }
+}
+
+/**
+ * @brief Searches the last published tree.
+ *
+ * The walk is retried if the writer reused the slot while it was being read.
+ * Scalars are copied into value. Strings and blobs are copied into the
+ * buffer the caller sets in value->buf and value->buf_len, within the same
+ * retry, so they never change afterwards. HM_ERROR is returned if they do
+ * not fit.
+ *
+ * @param shm Region handle
+ * @param value Receives the value
+ * @param ... Variable number of keys terminated by a NULL value
+ * @return int Status code (HM_SUCCESS, HM_NOT_FOUND or HM_ERROR)
+ */
+int hm_shm_search(hm_shm_t* shm, hm_shm_value_t* value, ...)
+{
+    va_list args;
+    hm_key_t keys[HM_MAX_PATH_DEPTH];
+    size_t depth = 0;
+    char* key = NULL;
+
+    va_start(args, value);
+    while ((key = va_arg(args, char*)) != NULL) {
+        if (depth == HM_MAX_PATH_DEPTH) {
+            va_end(args);
+            return HM_ERROR;
+        }
+        keys[depth++] = HM_KEY(key);
+    }
+    va_end(args);
+
+    return hm_shm_searchn(shm, value, keys, depth);
+}
+
+/**
+ * @brief Retrieves the number of trees published so far
+ *
+ * @param shm Region handle
+ * @return uint64_t Number of publications
+ */
+uint64_t hm_shm_generation(hm_shm_t* shm)
+{
+    return shm ? __atomic_load_n(&shm->header->generation, __ATOMIC_ACQUIRE) : 0;
+}
+
+/**
+ * @brief Tells whether a region was replaced by a later hm_shm_create. Its
+ * readers can keep searching it, but it is never published to again, so they
+ * should close it and open the new one.
+ *
+ * @param shm Region handle
+ * @return bool True if the region was replaced
+ */
+bool hm_shm_retired(hm_shm_t* shm)
+{
+    return shm ? __atomic_load_n(&shm->header->retired, __ATOMIC_ACQUIRE) != 0 : false;
+}
+
+/**
+ * @brief Unmaps a region. The region itself survives until hm_shm_unlink.
+ *
+ * @param shm_p Reference to the handle pointer
+ */
+void hm_shm_close(void** shm_p)
+{
+    if (shm_p == NULL || *shm_p == NULL) {
+        return;
+    }
+
+    hm_shm_t* shm = *shm_p;
+
+    munmap(shm->header, shm->map_size);
+    free(shm);
+    *shm_p = NULL;
+}
+
+/**
+ * @brief Removes a region. Processes that have it mapped keep their mapping.
+ *
+ * @param name Shared memory object name
+ * @return int Status code (HM_SUCCESS or HM_ERROR)
+ */
+int hm_shm_unlink(const char* name)
+{
+    return name != NULL && shm_unlink(name) == 0 ? HM_SUCCESS : HM_ERROR;
+}
@@ -0,0 +1,144 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cmap/map.h>
+
+static void hm_stats_map(hashmap_t* hashmap, hm_stats_t* stats, bool recursive);
+
+static void hm_stats_list(list_t* list, hm_stats_t* stats, bool recursive);
+
+/**
+ * @brief Accounts the memory held by a node's value
+ *
+ * @param node Pointer to the node
+ * @param stats Pointer to the stats being filled
+ * @param recursive Whether nested maps and lists are visited
+ */
+static void hm_stats_value(node_t* node, hm_stats_t* stats, bool recursive)
+{
+    bool owned = !(node->flags & HM_NODE_VALUE_BORROWED);
+
+    switch (node->value_type) {
+    case HM_VALUE_STR:
+        if (owned && node->value) {
+            stats->value_bytes += strlen(node->value) + 1;
+        }
+        break;
+    case HM_VALUE_BLOB:
+        if (owned) {
+            stats->value_bytes += node->blob.len;
+        }
+        break;
+    case HM_VALUE_MAP:
+        if (recursive && node->value) {
+            hm_stats_map(node->value, stats, true);
+        }
+        break;
+    case HM_VALUE_LIST:
+        if (recursive && node->value) {
+            hm_stats_list(node->value, stats, true);
+        }
+        break;
+    case HM_VALUE_INT64:
+    case HM_VALUE_DOUBLE:
+    case HM_VALUE_BOOL:
+        break;
+    }
+}
+
+/**
+ * @brief Accounts a list and, if recursive, the values of its items
+ *
+ * @param list Pointer to the list
+ * @param stats Pointer to the stats being filled
+ * @param recursive Whether nested values are visited
+ */
+static void hm_stats_list(list_t* list, hm_stats_t* stats, bool recursive)
+{
+    stats->lists++;
+    stats->list_items += list->size;
+    stats->struct_bytes += sizeof(list_t) + list->capacity * sizeof(node_t*);
+
+    for (size_t i = 0; i < list->size; i++) {
+        stats->struct_bytes += sizeof(node_t);
+        hm_stats_value(list->items[i], stats, recursive);
+    }
+}
+
+/**
+ * @brief Accounts a hashmap and, if recursive, every value beneath it
+ *
+ * @param hashmap Pointer to the hashmap
+ * @param stats Pointer to the stats being filled
+ * @param recursive Whether nested values are visited
+ */
+static void hm_stats_map(hashmap_t* hashmap, hm_stats_t* stats, bool recursive)
+{
+    stats->maps++;
+    stats->entries += hashmap->size;
+    stats->buckets += hashmap->capacity;
+    stats->resize_count += hashmap->resize_count;
+    stats->resize_ns += hashmap->resize_ns;
+    stats->struct_bytes += sizeof(hashmap_t) + hashmap->capacity * sizeof(node_t*);
+
+#ifdef HM_ENABLE_COUNTERS
+    stats->counters.inserts += hashmap->counters.inserts;
+    stats->counters.searches += hashmap->counters.searches;
+    stats->counters.hits += hashmap->counters.hits;
+    stats->counters.misses += hashmap->counters.misses;
+#endif
+
+    for (size_t i = 0; i < hashmap->capacity; i++) {
+        size_t chain = 0;
+
+        for (node_t* node = hashmap->list[i]; node != NULL; node = node->next) {
+            chain++;
+            stats->struct_bytes += sizeof(node_t);
+            if (!(node->flags & HM_NODE_KEY_BORROWED)) {
+                stats->key_bytes += node->key_len + 1;
+            }
+            hm_stats_value(node, stats, recursive);
+        }
+
+        if (chain > 0) {
+            stats->used_buckets++;
+            stats->collisions += chain - 1;
+        }
+        if (chain > stats->max_chain) {
+            stats->max_chain = chain;
+        }
+        stats->chain_histogram[chain < HM_STATS_HISTOGRAM_SIZE ? chain : HM_STATS_HISTOGRAM_SIZE - 1]++;
+    }
+}
+
+/**
+ * @brief Collects health statistics of the hashmap.
+ *
+ * Reports entry and bucket counts, chain lengths, resize totals and the bytes
+ * used by keys, values and structures. Borrowed keys and values are not
+ * accounted. When recursive, every nested map and list is included. The
+ * operation counters are only filled when the library is built with
+ * HM_ENABLE_COUNTERS.
+ *
+ * @param hashmap Pointer to the hashmap
+ * @param stats Pointer to the stats to be filled
+ * @param recursive Whether nested maps and lists are included
+ * @return int Status code (HM_SUCCESS or HM_ERROR)
+ */
+int hm_stats(hashmap_t* hashmap, hm_stats_t* stats, bool recursive)
+{
+    if (hashmap == NULL || hashmap->list == NULL || stats == NULL) {
+        return HM_ERROR;
+    }
+
+    memset(stats, 0, sizeof(hm_stats_t));
+
+    hm_stats_map(hashmap, stats, recursive);
+
+    if (stats->used_buckets > 0) {
+        stats->avg_chain = (double)stats->entries / stats->used_buckets;
+    }
+
+    return HM_SUCCESS;
+}
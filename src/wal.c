@@ -0,0 +1,1167 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cmap/log.h>
+#include <cmap/map.h>
+#include <cmap/wal.h>
+
+#define HM_WAL_FILE "cmap.wal"
+#define HM_WAL_SNAPSHOT_FILE "cmap.snapshot"
+#define HM_WAL_SNAPSHOT_TMP_FILE "cmap.snapshot.tmp"
+
+#define HM_WAL_MAGIC "CMAPWAL2"
+#define HM_WAL_SNAPSHOT_MAGIC "CMAPSNP2"
+#define HM_WAL_MAGIC_LEN 8
+// Magic and checkpoint epoch at the start of the log
+#define HM_WAL_HEADER_LEN 16
+
+// Length and CRC of the record body
+#define HM_WAL_RECORD_HEADER 8
+// Payload length and CRC at the end of a snapshot
+#define HM_WAL_SNAPSHOT_TRAILER 12
+// Snapshots are written in chunks of this size
+#define HM_WAL_WRITE_CHUNK (1 << 20)
+
+#define HM_WAL_OP_SET 1
+#define HM_WAL_OP_REMOVE 2
+
+/**
+ * @brief Growable encoding buffer. When bound to a file descriptor, it is
+ * written out in chunks and only the CRC and size of the output are kept.
+ */
+typedef struct {
+    unsigned char* data;
+    size_t len;
+    size_t capacity;
+    int fd;
+    uint32_t crc;
+    size_t written;
+} hm_wal_buf_t;
+
+typedef struct {
+    const unsigned char* data;
+    size_t len;
+    size_t pos;
+} hm_wal_reader_t;
+
+struct hm_wal {
+    hashmap_t* root;
+    int dir_fd;
+    int log_fd;
+    size_t log_bytes;
+    size_t unsynced_bytes;
+    uint64_t unsynced_since_ns;
+    bool failed;
+    bool checkpointing;
+    // Number of the last snapshot, the log only holds records made after it
+    uint64_t epoch;
+    hm_wal_buf_t buf;
+    // Guards the log file and its counters, shared with the sync thread
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t syncer;
+    bool syncer_running;
+    bool stopping;
+};
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void hm_wal_crc_init(void)
+{
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320u : crc >> 1;
+        }
+        crc_table[i] = crc;
+    }
+}
+
+/**
+ * @brief Updates a CRC-32 (IEEE) with the given bytes
+ *
+ * @param crc CRC of the previous bytes, 0 to start
+ * @param data Bytes
+ * @param len Number of bytes
+ * @return uint32_t Updated CRC
+ */
+static uint32_t hm_wal_crc(uint32_t crc, const void* data, size_t len)
+{
+    const unsigned char* bytes = data;
+
+    pthread_once(&crc_once, hm_wal_crc_init);
+
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) {
+        crc = crc_table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+    }
+
+    return ~crc;
+}
+
+static uint64_t hm_wal_now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+/**
+ * @brief Writes the whole buffer, retrying short writes
+ *
+ * @return int Status code (HM_SUCCESS or HM_ERROR)
+ */
+static int hm_wal_write_all(int fd, const void* data, size_t len)
+{
+    const unsigned char* bytes = data;
+
+    while (len > 0) {
+        ssize_t written = write(fd, bytes, len);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return HM_ERROR;
+        }
+        bytes += written;
+        len -= written;
+    }
+
+    return HM_SUCCESS;
+}
+
+/**
+ * @brief Reads a whole file into a heap allocated buffer
+ *
+ * @param dir_fd Directory holding the file
+ * @param name File name
+ * @param len Receives the file size
+ * @return unsigned char* File contents, NULL on error or if it does not exist (errno ENOENT)
+ */
+static unsigned char* hm_wal_read_file(int dir_fd, const char* name, size_t* len)
+{
+    struct stat st;
+    unsigned char* data = NULL;
+    size_t pos = 0;
+    int fd = openat(dir_fd, name, O_RDONLY);
+
+    if (fd < 0) {
+        return NULL;
+    }
+
+    if (fstat(fd, &st) < 0 || (data = malloc(st.st_size ? st.st_size : 1)) == NULL) {
+        close(fd);
+        return NULL;
+    }
+
+    while (pos < (size_t)st.st_size) {
+        ssize_t count = read(fd, data + pos, st.st_size - pos);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            free(data);
+            close(fd);
+            errno = EIO;
+            return NULL;
+        }
+        pos += count;
+    }
+
+    close(fd);
+    *len = pos;
+
+    return data;
+}
+
+/**
+ * @brief Writes out the buffer of a file bound buffer
+ *
+ * @return int Status code (HM_SUCCESS or HM_ERROR)
+ */
+static int hm_wal_buf_flush(hm_wal_buf_t* buf)
+{
+    if (hm_wal_write_all(buf->fd, buf->data, buf->len) == HM_ERROR) {
+        return HM_ERROR;
+    }
+
+    buf->crc = hm_wal_crc(buf->crc, buf->data, buf->len);
+    buf->written += buf->len;
+    buf->len = 0;
+
+    return HM_SUCCESS;
+}
+
+/**
+ * @brief Appends bytes to the buffer, growing it geometrically when needed
+ *
+ * @return int Status code (HM_SUCCESS or HM_ERROR)
+ */
+static int hm_wal_put(hm_wal_buf_t* buf, const void* data, size_t len)
+{
+    if (buf->fd >= 0 && buf->len + len > HM_WAL_WRITE_CHUNK && buf->len > 0) {
+        if (hm_wal_buf_flush(buf) == HM_ERROR) {
+            return HM_ERROR;
+        }
+    }
+
+    if (buf->len + len > buf->capacity) {
+        size_t capacity = buf->capacity ? buf->capacity : 256;
+        while (capacity < buf->len + len) {
+            capacity *= 2;
+        }
+
+        unsigned char* data_aux = realloc(buf->data, capacity);
+        if (data_aux == NULL) {
+            return HM_ERROR;
+        }
+
+        buf->data = data_aux;
+        buf->capacity = capacity;
+    }
+
+    if (len > 0) {
+        memcpy(buf->data + buf->len, data, len);
+        buf->len += len;
+    }
+
+    return HM_SUCCESS;
+}
+
+static int hm_wal_put_u8(hm_wal_buf_t* buf, uint8_t value)
+{
+    return hm_wal_put(buf, &value, 1);
+}
+
+// Integers are stored little endian
+static int hm_wal_put_u32(hm_wal_buf_t* buf, uint32_t value)
+{
+    unsigned char bytes[4];
+
+    for (int i = 0; i < 4; i++) {
+        bytes[i] = (unsigned char)(value >> (8 * i));
+    }
+
+    return hm_wal_put(buf, bytes, sizeof(bytes));
+}
+
+static int hm_wal_put_u64(hm_wal_buf_t* buf, uint64_t value)
+{
+    unsigned char bytes[8];
+
+    for (int i = 0; i < 8; i++) {
+        bytes[i] = (unsigned char)(value >> (8 * i));
+    }
+
+    return hm_wal_put(buf, bytes, sizeof(bytes));
+}
+
+static int hm_wal_put_bytes(hm_wal_buf_t* buf, const void* data, size_t len)
+{
+    if (len > UINT32_MAX || hm_wal_put_u32(buf, (uint32_t)len) == HM_ERROR) {
+        return HM_ERROR;
+    }
+
+    return hm_wal_put(buf, data, len);
+}
+
+/**
+ * @brief Encodes the value of a node, nested maps and lists included
+ *
+ * @param buf Pointer to the buffer
+ * @param node Pointer to the node
+ * @return int Status code (HM_SUCCESS or HM_ERROR)
+ */
+static int hm_wal_put_value(hm_wal_buf_t* buf, node_t* node)
+{
+    uint64_t bits = 0;
+
+    if (hm_wal_put_u8(buf, (uint8_t)node->value_type) == HM_ERROR) {
+        return HM_ERROR;
+    }
+
+    switch (node->value_type) {
+    case HM_VALUE_STR:
+        return hm_wal_put_bytes(buf, node->value, node->value ? strlen(node->value) : 0);
+    case HM_VALUE_MAP: {
+        hashmap_t* map = node->value;
+        size_t size = map ? map->size : 0;
+        size_t seen = 0;
+
+        // Counts are stored in 32 bits
+        if (size > UINT32_MAX || hm_wal_put_u32(buf, (uint32_t)size) == HM_ERROR) {
+            return HM_ERROR;
+        }
+
+        for (size_t i = 0; map != NULL && i < map->capacity && seen < size; i++) {
+            for (node_t* child = map->list[i]; child != NULL; child = child->next, seen++) {
+                if (hm_wal_put_bytes(buf, child->key, child->key_len) == HM_ERROR
+                    || hm_wal_put_value(buf, child) == HM_ERROR) {
+                    return HM_ERROR;
+                }
+            }
+        }
+        return HM_SUCCESS;
+    }
+    case HM_VALUE_LIST: {
+        list_t* list = node->value;
+        size_t size = list ? list->size : 0;
+
+        if (size > UINT32_MAX || hm_wal_put_u32(buf, (uint32_t)size) == HM_ERROR) {
+            return HM_ERROR;
+        }
+
+        for (size_t i = 0; i < size; i++) {
+            if (hm_wal_put_value(buf, list->items[i]) == HM_ERROR) {
+                return HM_ERROR;
+            }
+        }
+        return HM_SUCCESS;
+    }
+    case HM_VALUE_INT64:
+        return hm_wal_put_u64(buf, (uint64_t)node->i64);
+    case HM_VALUE_DOUBLE:
+        memcpy(&bits, &node->f64, sizeof(bits));
+        return hm_wal_put_u64(buf, bits);
+    case HM_VALUE_BOOL:
+        return hm_wal_put_u8(buf, node->boolean ? 1 : 0);
+    case HM_VALUE_BLOB:
+        if (hm_wal_put_u64(buf, node->blob.len) == HM_ERROR) {
+            return HM_ERROR;
+        }
+        return hm_wal_put(buf, node->blob.data, node->blob.len);
+    }
+
+    return HM_ERROR;
+}
+
+static const unsigned char* hm_wal_get(hm_wal_reader_t* reader, size_t len)
+{
+    const unsigned char* data = reader->data + reader->pos;
+
+    if (len > reader->len - reader->pos) {
+        return NULL;
+    }
+
+    reader->pos += len;
+
+    return data;
+}
+
+static bool hm_wal_get_u8(hm_wal_reader_t* reader, uint8_t* value)
+{
+    const unsigned char* bytes = hm_wal_get(reader, 1);
+
+    if (bytes == NULL) {
+        return false;
+    }
+
+    *value = bytes[0];
+
+    return true;
+}
+
+static bool hm_wal_get_u32(hm_wal_reader_t* reader, uint32_t* value)
+{
+    const unsigned char* bytes = hm_wal_get(reader, 4);
+
+    if (bytes == NULL) {
+        return false;
+    }
+
+    *value = 0;
+    for (int i = 0; i < 4; i++) {
+        *value |= (uint32_t)bytes[i] << (8 * i);
+    }
+
+    return true;
+}
+
+static bool hm_wal_get_u64(hm_wal_reader_t* reader, uint64_t* value)
+{
+    const unsigned char* bytes = hm_wal_get(reader, 8);
+
+    if (bytes == NULL) {
+        return false;
+    }
+
+    *value = 0;
+    for (int i = 0; i < 8; i++) {
+        *value |= (uint64_t)bytes[i] << (8 * i);
+    }
+
+    return true;
+}
+
+/**
+ * @brief Decodes a value into a new node without key
+ *
+ * Maps are rebuilt directly with their final capacity, using the key hashes
+ * computed on the way.
+ *
+ * @param reader Pointer to the reader
+ * @return node_t* Heap allocated node or NULL if the data is malformed
+ */
+static node_t* hm_wal_get_value(hm_wal_reader_t* reader)
+{
+    node_t* node = NULL;
+    uint8_t type = 0;
+    uint32_t count = 0;
+    uint64_t bits = 0;
+    const unsigned char* data = NULL;
+
+    if (!hm_wal_get_u8(reader, &type) || type > HM_VALUE_BLOB || (node = hm_node_new()) == NULL) {
+        return NULL;
+    }
+
+    node->value_type = type;
+
+    switch (node->value_type) {
+    case HM_VALUE_STR:
+        if (!hm_wal_get_u32(reader, &count) || (data = hm_wal_get(reader, count)) == NULL
+            || (node->value = malloc(count + 1)) == NULL) {
+            break;
+        }
+        memcpy(node->value, data, count);
+        ((char*)node->value)[count] = '\0';
+        return node;
+    case HM_VALUE_MAP: {
+        hashmap_t* map = NULL;
+
+        if (!hm_wal_get_u32(reader, &count) || (node->value = map = hm_create_default()) == NULL
+            || map->list == NULL || hm_reserve(map, count) == HM_ERROR) {
+            break;
+        }
+
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t key_len = 0;
+            node_t* child = NULL;
+
+            if (!hm_wal_get_u32(reader, &key_len) || (data = hm_wal_get(reader, key_len)) == NULL
+                || (child = hm_wal_get_value(reader)) == NULL) {
+                hm_node_free((void**)&node);
+                return NULL;
+            }
+
+            if ((child->key = malloc(key_len + 1)) == NULL) {
+                hm_node_free((void**)&child);
+                hm_node_free((void**)&node);
+                return NULL;
+            }
+
+            memcpy(child->key, data, key_len);
+            child->key[key_len] = '\0';
+            child->key_len = key_len;
+            child->hash = hm_key_hash(child->key, key_len);
+            child->next = map->list[child->hash % map->capacity];
+            map->list[child->hash % map->capacity] = child;
+            map->size++;
+        }
+        return node;
+    }
+    case HM_VALUE_LIST: {
+        list_t* list = NULL;
+
+        if (!hm_wal_get_u32(reader, &count)
+            || (node->value = list = hm_list_create(count > HM_LIST_INITIAL_CAPACITY ? count : HM_LIST_INITIAL_CAPACITY)) == NULL
+            || list->items == NULL) {
+            break;
+        }
+
+        for (uint32_t i = 0; i < count; i++) {
+            node_t* item = hm_wal_get_value(reader);
+            if (item == NULL) {
+                hm_node_free((void**)&node);
+                return NULL;
+            }
+            hm_list_append(list, item);
+        }
+        return node;
+    }
+    case HM_VALUE_INT64:
+        if (!hm_wal_get_u64(reader, &bits)) {
+            break;
+        }
+        node->i64 = (int64_t)bits;
+        return node;
+    case HM_VALUE_DOUBLE:
+        if (!hm_wal_get_u64(reader, &bits)) {
+            break;
+        }
+        memcpy(&node->f64, &bits, sizeof(bits));
+        return node;
+    case HM_VALUE_BOOL:
+        if ((data = hm_wal_get(reader, 1)) == NULL) {
+            break;
+        }
+        node->boolean = data[0] != 0;
+        return node;
+    case HM_VALUE_BLOB:
+        if (!hm_wal_get_u64(reader, &bits) || (data = hm_wal_get(reader, bits)) == NULL) {
+            break;
+        }
+        if (bits > 0 && (node->blob.data = malloc(bits)) == NULL) {
+            break;
+        }
+        memcpy(node->blob.data, data, bits);
+        node->blob.len = bits;
+        return node;
+    }
+
+    hm_node_free((void**)&node);
+    return NULL;
+}
+
+/**
+ * @brief Syncs the records written since the last sync. Must be called with
+ * the lock held once the sync thread runs.
+ *
+ * @param wal Pointer to the log
+ * @return int Status code (HM_SUCCESS or HM_ERROR)
+ */
+static int hm_wal_flush(hm_wal_t* wal)
+{
+    if (wal->unsynced_bytes == 0) {
+        return HM_SUCCESS;
+    }
+
+    if (fdatasync(wal->log_fd) < 0) {
+        HM_LOG(LOG_LEVEL_ERROR, "Failed to sync the log: %s", strerror(errno));
+        wal->failed = true;
+        return HM_ERROR;
+    }
+
+    wal->unsynced_bytes = 0;
+
+    return HM_SUCCESS;
+}
+
+/**
+ * @brief Appends a record to the log.
+ *
+ * Each record is written as soon as it is appended, so it survives a crash of
+ * the process. Syncing, which makes it survive a crash of the machine, is
+ * done for a whole group of records at once, by the appending thread once
+ * the group is full and by the sync thread once it is old enough.
+ *
+ * @param wal Pointer to the log
+ * @param op Operation (HM_WAL_OP_SET or HM_WAL_OP_REMOVE)
+ * @param keys Array of keys
+ * @param depth Number of keys
+ * @param node Node holding the new value, NULL for removals
+ * @return int Status code (HM_SUCCESS or HM_ERROR)
+ */
+static int hm_wal_append(hm_wal_t* wal, uint8_t op, const hm_key_t* keys, size_t depth, node_t* node)
+{
+    hm_wal_buf_t* buf = &wal->buf;
+    uint64_t now = 0;
+    bool checkpoint = false;
+    int status = HM_SUCCESS;
+
+    // Leaves room for the header, filled once the body is known. The buffer
+    // is only used by the writing thread, so it is filled outside the lock
+    buf->len = 0;
+    if (hm_wal_put_u64(buf, 0) == HM_ERROR || hm_wal_put_u8(buf, op) == HM_ERROR || hm_wal_put_u8(buf, (uint8_t)depth) == HM_ERROR) {
+        goto fail;
+    }
+
+    for (size_t i = 0; i < depth; i++) {
+        if (hm_wal_put_bytes(buf, keys[i].data, keys[i].len) == HM_ERROR) {
+            goto fail;
+        }
+    }
+
+    if (node != NULL && hm_wal_put_value(buf, node) == HM_ERROR) {
+        goto fail;
+    }
+
+    // Lengths are stored in 32 bits, a larger record would be cut short on replay
+    if (buf->len - HM_WAL_RECORD_HEADER > UINT32_MAX) {
+        goto fail;
+    }
+
+    uint32_t body_len = (uint32_t)(buf->len - HM_WAL_RECORD_HEADER);
+    uint32_t crc = hm_wal_crc(0, buf->data + HM_WAL_RECORD_HEADER, body_len);
+    for (int i = 0; i < 4; i++) {
+        buf->data[i] = (unsigned char)(body_len >> (8 * i));
+        buf->data[4 + i] = (unsigned char)(crc >> (8 * i));
+    }
+
+    pthread_mutex_lock(&wal->lock);
+
+    if (wal->failed) {
+        status = HM_ERROR;
+    } else if (hm_wal_write_all(wal->log_fd, buf->data, buf->len) == HM_ERROR) {
+        HM_LOG(LOG_LEVEL_ERROR, "Failed to append to the log: %s", strerror(errno));
+        wal->failed = true;
+        status = HM_ERROR;
+    } else {
+        now = hm_wal_now_ns();
+        if (wal->unsynced_bytes == 0) {
+            // Starts a new group, the sync thread waits for it to get old enough
+            wal->unsynced_since_ns = now;
+            pthread_cond_signal(&wal->wake);
+        }
+        wal->unsynced_bytes += buf->len;
+        wal->log_bytes += buf->len;
+
+        if (wal->unsynced_bytes >= HM_WAL_GROUP_BYTES || now - wal->unsynced_since_ns >= HM_WAL_GROUP_MS * 1000000ull) {
+            status = hm_wal_flush(wal);
+        }
+
+        checkpoint = status == HM_SUCCESS && wal->log_bytes >= HM_WAL_CHECKPOINT_BYTES && !wal->checkpointing;
+    }
+
+    pthread_mutex_unlock(&wal->lock);
+
+    // A failed checkpoint leaves the log in place, it is retried on the next append
+    if (checkpoint) {
+        hm_checkpoint(wal->root);
+    }
+
+    return status;
+
+fail:
+    // A change missing from the log cannot be recovered, the log is not used any more
+    HM_LOG(LOG_LEVEL_ERROR, "Failed to encode a log record");
+    pthread_mutex_lock(&wal->lock);
+    wal->failed = true;
+    pthread_mutex_unlock(&wal->lock);
+    return HM_ERROR;
+}
+
+/**
+ * @brief Syncs each group of records once the oldest one is HM_WAL_GROUP_MS
+ * old, so an idle durable root does not keep them unsynced until the next
+ * append.
+ *
+ * @param arg Pointer to the log
+ */
+static void* hm_wal_syncer(void* arg)
+{
+    hm_wal_t* wal = arg;
+
+    pthread_mutex_lock(&wal->lock);
+
+    while (!wal->stopping) {
+        if (wal->unsynced_bytes == 0 || wal->failed) {
+            pthread_cond_wait(&wal->wake, &wal->lock);
+            continue;
+        }
+
+        uint64_t deadline = wal->unsynced_since_ns + HM_WAL_GROUP_MS * 1000000ull;
+        if (hm_wal_now_ns() >= deadline) {
+            hm_wal_flush(wal);
+            continue;
+        }
+
+        struct timespec until = { (time_t)(deadline / 1000000000ull), (long)(deadline % 1000000000ull) };
+        pthread_cond_timedwait(&wal->wake, &wal->lock, &until);
+    }
+
+    pthread_mutex_unlock(&wal->lock);
+
+    return NULL;
+}
+
+/**
+ * @brief Records the new value of a key in the log of a durable root.
+ *
+ * Called by the hashmap API for every change made through the root, does
+ * nothing if the hashmap has no log. Changes made in place through the node
+ * returned by hm_upsert are recorded by hm_upsert_commit.
+ *
+ * @param hashmap Root hashmap
+ * @param keys Array of keys
+ * @param depth Number of keys
+ * @param node Node at the given path
+ * @return int Status code (HM_SUCCESS or HM_ERROR)
+ */
+int hm_wal_log_set(hashmap_t* hashmap, const hm_key_t* keys, size_t depth, node_t* node)
+{
+    if (hashmap == NULL || hashmap->wal == NULL) {
+        return HM_SUCCESS;
+    }
+
+    if (node == NULL || depth == 0 || depth > HM_MAX_PATH_DEPTH) {
+        return HM_ERROR;
+    }
+
+    return hm_wal_append(hashmap->wal, HM_WAL_OP_SET, keys, depth, node);
+}
+
+/**
+ * @brief Records the removal of a key in the log of a durable root.
+ *
+ * Does nothing if the hashmap has no log.
+ *
+ * @param hashmap Root hashmap
+ * @param keys Array of keys
+ * @param depth Number of keys
+ * @return int Status code (HM_SUCCESS or HM_ERROR)
+ */
+int hm_wal_log_remove(hashmap_t* hashmap, const hm_key_t* keys, size_t depth)
+{
+    if (hashmap == NULL || hashmap->wal == NULL) {
+        return HM_SUCCESS;
+    }
+
+    if (depth == 0 || depth > HM_MAX_PATH_DEPTH) {
+        return HM_ERROR;
+    }
+
+    return hm_wal_append(hashmap->wal, HM_WAL_OP_REMOVE, keys, depth, NULL);
+}
+
+/**
+ * @brief Empties the log and writes its header for the current epoch
+ *
+ * @param wal Pointer to the log
+ * @return int Status code (HM_SUCCESS or HM_ERROR)
+ */
+static int hm_wal_reset(hm_wal_t* wal)
+{
+    unsigned char header[HM_WAL_HEADER_LEN];
+
+    memcpy(header, HM_WAL_MAGIC, HM_WAL_MAGIC_LEN);
+    for (int i = 0; i < 8; i++) {
+        header[HM_WAL_MAGIC_LEN + i] = (unsigned char)(wal->epoch >> (8 * i));
+    }
+
+    if (ftruncate(wal->log_fd, 0) < 0 || lseek(wal->log_fd, 0, SEEK_SET) < 0
+        || hm_wal_write_all(wal->log_fd, header, HM_WAL_HEADER_LEN) == HM_ERROR || fdatasync(wal->log_fd) < 0) {
+        return HM_ERROR;
+    }
+
+    wal->log_bytes = HM_WAL_HEADER_LEN;
+    wal->unsynced_bytes = 0;
+
+    return HM_SUCCESS;
+}
+
+/**
+ * @brief Syncs every record appended so far, without waiting for the group
+ * to fill up.
+ *
+ * @param hashmap Root hashmap
+ * @return int Status code (HM_SUCCESS or HM_ERROR if the log failed at any point)
+ */
+int hm_wal_sync(hashmap_t* hashmap)
+{
+    hm_wal_t* wal = NULL;
+    int status = HM_SUCCESS;
+
+    if (hashmap == NULL || (wal = hashmap->wal) == NULL) {
+        return HM_ERROR;
+    }
+
+    pthread_mutex_lock(&wal->lock);
+    if (hm_wal_flush(wal) == HM_ERROR || wal->failed) {
+        status = HM_ERROR;
+    }
+    pthread_mutex_unlock(&wal->lock);
+
+    return status;
+}
+
+/**
+ * @brief Compacts the log into a snapshot of the whole tree.
+ *
+ * The snapshot is written to a temporary file and renamed over the previous
+ * one before the log is truncated. Both carry the number of the checkpoint,
+ * so after a crash in between the old log is recognized and discarded
+ * instead of being replayed on top of a tree that already holds its records.
+ *
+ * @param hashmap Root hashmap
+ * @return int Status code (HM_SUCCESS or HM_ERROR)
+ */
+int hm_checkpoint(hashmap_t* hashmap)
+{
+    hm_wal_t* wal = NULL;
+    hm_wal_buf_t buf = { .fd = -1 };
+    node_t root = { 0 };
+    uint32_t crc = 0;
+    int status = HM_ERROR;
+
+    if (hashmap == NULL || (wal = hashmap->wal) == NULL) {
+        return HM_ERROR;
+    }
+
+    pthread_mutex_lock(&wal->lock);
+    bool failed = wal->failed;
+    pthread_mutex_unlock(&wal->lock);
+
+    if (failed) {
+        return HM_ERROR;
+    }
+
+    wal->checkpointing = true;
+
+    root.value_type = HM_VALUE_MAP;
+    root.value = hashmap;
+
+    if ((buf.fd = openat(wal->dir_fd, HM_WAL_SNAPSHOT_TMP_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        goto end;
+    }
+
+    if (hm_wal_write_all(buf.fd, HM_WAL_SNAPSHOT_MAGIC, HM_WAL_MAGIC_LEN) == HM_ERROR
+        || hm_wal_put_u64(&buf, wal->epoch + 1) == HM_ERROR
+        || hm_wal_put_value(&buf, &root) == HM_ERROR
+        || hm_wal_buf_flush(&buf) == HM_ERROR) {
+        goto end;
+    }
+
+    // The trailer is not part of the CRC
+    crc = buf.crc;
+    if (hm_wal_put_u64(&buf, buf.written) == HM_ERROR || hm_wal_put_u32(&buf, crc) == HM_ERROR
+        || hm_wal_write_all(buf.fd, buf.data, buf.len) == HM_ERROR || fsync(buf.fd) < 0) {
+        goto end;
+    }
+
+    if (renameat(wal->dir_fd, HM_WAL_SNAPSHOT_TMP_FILE, wal->dir_fd, HM_WAL_SNAPSHOT_FILE) < 0) {
+        goto end;
+    }
+
+    pthread_mutex_lock(&wal->lock);
+
+    // The new snapshot may be in place, the records appended from now on would be discarded with the old log
+    if (fsync(wal->dir_fd) < 0) {
+        wal->failed = true;
+    } else {
+        wal->epoch++;
+        if (hm_wal_reset(wal) == HM_ERROR) {
+            // The snapshot is in place, but the log can no longer be trusted
+            wal->failed = true;
+        } else {
+            status = HM_SUCCESS;
+        }
+    }
+
+    pthread_mutex_unlock(&wal->lock);
+
+end:
+    if (status == HM_ERROR) {
+        HM_LOG(LOG_LEVEL_ERROR, "Failed to write a snapshot: %s", strerror(errno));
+    }
+    if (buf.fd >= 0) {
+        close(buf.fd);
+    }
+    free(buf.data);
+    wal->checkpointing = false;
+
+    return status;
+}
+
+/**
+ * @brief Loads the last snapshot and its epoch, or creates an empty tree if
+ * there is none
+ *
+ * @param wal Pointer to the log
+ * @return hashmap_t* Root hashmap or NULL on error
+ */
+static hashmap_t* hm_wal_load_snapshot(hm_wal_t* wal)
+{
+    hm_wal_reader_t reader = { 0 };
+    hashmap_t* root = NULL;
+    node_t* node = NULL;
+    uint64_t payload_len = 0;
+    uint32_t crc = 0;
+    size_t len = 0;
+    unsigned char* data = hm_wal_read_file(wal->dir_fd, HM_WAL_SNAPSHOT_FILE, &len);
+
+    if (data == NULL) {
+        return errno == ENOENT ? hm_create_default() : NULL;
+    }
+
+    if (len < HM_WAL_MAGIC_LEN + HM_WAL_SNAPSHOT_TRAILER || memcmp(data, HM_WAL_SNAPSHOT_MAGIC, HM_WAL_MAGIC_LEN)) {
+        HM_LOG(LOG_LEVEL_ERROR, "Invalid snapshot");
+        free(data);
+        return NULL;
+    }
+
+    reader = (hm_wal_reader_t) { data + len - HM_WAL_SNAPSHOT_TRAILER, HM_WAL_SNAPSHOT_TRAILER, 0 };
+    hm_wal_get_u64(&reader, &payload_len);
+    hm_wal_get_u32(&reader, &crc);
+
+    reader = (hm_wal_reader_t) { data + HM_WAL_MAGIC_LEN, len - HM_WAL_MAGIC_LEN - HM_WAL_SNAPSHOT_TRAILER, 0 };
+    if (payload_len != reader.len || hm_wal_crc(0, reader.data, reader.len) != crc) {
+        HM_LOG(LOG_LEVEL_ERROR, "Corrupted snapshot");
+        free(data);
+        return NULL;
+    }
+
+    if (hm_wal_get_u64(&reader, &wal->epoch) && (node = hm_wal_get_value(&reader)) != NULL && node->value_type == HM_VALUE_MAP) {
+        root = node->value;
+        node->value = NULL;
+    }
+
+    hm_node_free((void**)&node);
+    free(data);
+
+    return root;
+}
+
+/**
+ * @brief Applies a log record to the tree
+ *
+ * @param root Root hashmap
+ * @param reader Reader over the record body
+ * @return int Status code (HM_SUCCESS or HM_ERROR)
+ */
+static int hm_wal_apply(hashmap_t* root, hm_wal_reader_t* reader)
+{
+    hm_key_t keys[HM_MAX_PATH_DEPTH];
+    uint8_t op = 0;
+    uint8_t depth = 0;
+
+    if (!hm_wal_get_u8(reader, &op) || !hm_wal_get_u8(reader, &depth) || depth == 0 || depth > HM_MAX_PATH_DEPTH) {
+        return HM_ERROR;
+    }
+
+    for (uint8_t i = 0; i < depth; i++) {
+        uint32_t len = 0;
+        if (!hm_wal_get_u32(reader, &len) || (keys[i].data = (const char*)hm_wal_get(reader, len)) == NULL) {
+            return HM_ERROR;
+        }
+        keys[i].len = len;
+    }
+
+    if (op == HM_WAL_OP_REMOVE) {
+        return hm_removen(root, keys, depth) == HM_ERROR ? HM_ERROR : HM_SUCCESS;
+    }
+
+    node_t* value = NULL;
+    node_t* target = NULL;
+
+    if (op != HM_WAL_OP_SET || (value = hm_wal_get_value(reader)) == NULL) {
+        return HM_ERROR;
+    }
+
+    if ((target = hm_upsertn(root, HM_VALUE_BOOL, NULL, keys, depth)) == NULL) {
+        hm_node_free((void**)&value);
+        return HM_ERROR;
+    }
+
+    // The decoded node carries the old value away
+    hm_node_swap_value(target, value);
+    hm_node_free((void**)&value);
+
+    return HM_SUCCESS;
+}
+
+/**
+ * @brief Replays the log on top of the snapshot.
+ *
+ * Replay stops at the first incomplete or corrupted record, the tail left by
+ * a crash in the middle of a write, and the log is truncated there. A log
+ * older than the snapshot, left by a crash during a checkpoint, is emptied.
+ *
+ * @param wal Pointer to the log
+ * @param root Root hashmap
+ * @return int Status code (HM_SUCCESS or HM_ERROR)
+ */
+static int hm_wal_replay(hm_wal_t* wal, hashmap_t* root)
+{
+    hm_wal_reader_t header = { 0 };
+    uint64_t epoch = 0;
+    size_t len = 0;
+    size_t pos = HM_WAL_HEADER_LEN;
+    unsigned char* data = hm_wal_read_file(wal->dir_fd, HM_WAL_FILE, &len);
+
+    if (data == NULL) {
+        return HM_ERROR;
+    }
+
+    if (len < HM_WAL_HEADER_LEN) {
+        // New or torn before its header was complete
+        free(data);
+        return hm_wal_reset(wal);
+    }
+
+    if (memcmp(data, HM_WAL_MAGIC, HM_WAL_MAGIC_LEN)) {
+        HM_LOG(LOG_LEVEL_ERROR, "Invalid log");
+        free(data);
+        return HM_ERROR;
+    }
+
+    header = (hm_wal_reader_t) { data + HM_WAL_MAGIC_LEN, HM_WAL_HEADER_LEN - HM_WAL_MAGIC_LEN, 0 };
+    hm_wal_get_u64(&header, &epoch);
+
+    if (epoch != wal->epoch) {
+        free(data);
+        if (epoch > wal->epoch) {
+            HM_LOG(LOG_LEVEL_ERROR, "The log is newer than the snapshot");
+            return HM_ERROR;
+        }
+        HM_LOG(LOG_LEVEL_WARNING, "Discarding a log already in the snapshot");
+        return hm_wal_reset(wal);
+    }
+
+    while (len - pos >= HM_WAL_RECORD_HEADER) {
+        hm_wal_reader_t reader = { data + pos, HM_WAL_RECORD_HEADER, 0 };
+        uint32_t body_len = 0;
+        uint32_t crc = 0;
+
+        hm_wal_get_u32(&reader, &body_len);
+        hm_wal_get_u32(&reader, &crc);
+
+        if (body_len > len - pos - HM_WAL_RECORD_HEADER) {
+            break;
+        }
+
+        reader = (hm_wal_reader_t) { data + pos + HM_WAL_RECORD_HEADER, body_len, 0 };
+        if (hm_wal_crc(0, reader.data, reader.len) != crc) {
+            break;
+        }
+
+        if (hm_wal_apply(root, &reader) == HM_ERROR) {
+            HM_LOG(LOG_LEVEL_ERROR, "Failed to replay a log record");
+            free(data);
+            return HM_ERROR;
+        }
+
+        pos += HM_WAL_RECORD_HEADER + body_len;
+    }
+
+    free(data);
+
+    if (pos < len) {
+        HM_LOG(LOG_LEVEL_WARNING, "Discarding %zu bytes of incomplete log records", len - pos);
+        if (ftruncate(wal->log_fd, pos) < 0 || fdatasync(wal->log_fd) < 0) {
+            return HM_ERROR;
+        }
+    }
+
+    wal->log_bytes = pos;
+
+    return HM_SUCCESS;
+}
+
+/**
+ * @brief Opens a durable tree stored in the given directory.
+ *
+ * The tree is rebuilt from the last snapshot plus the log of the changes
+ * made after it, both in a compact binary format. The directory is created if
+ * it does not exist.
+ *
+ * From then on, every change made through the returned root (hm_insert,
+ * hm_update_str, hm_incr, hm_remove, hm_upsert when it creates the key,
+ * hm_upsert_commit and hm_patch) is appended to the log. hm_insert_ttl is refused, since the
+ * log does not record TTLs. Records are synced in groups, see
+ * HM_WAL_GROUP_BYTES and HM_WAL_GROUP_MS, or on hm_wal_sync. A thread of the
+ * root syncs a group once it is HM_WAL_GROUP_MS old, even if nothing is
+ * appended after it. The log is
+ * compacted into a new snapshot by hm_checkpoint, which is called once it
+ * grows past HM_WAL_CHECKPOINT_BYTES and at the end of hm_merge.
+ *
+ * Changes made through nested hashmaps, nodes or lists obtained from the
+ * tree are not logged. A change is made in memory even if its record cannot
+ * be appended, the failure is reported by hm_wal_sync and hm_wal_close from
+ * then on. hm_free syncs and closes the log.
+ *
+ * @param dir Directory holding the snapshot and the log
+ * @return hashmap_t* Root hashmap or NULL on error
+ */
+hashmap_t* hm_open_durable(const char* dir)
+{
+    hm_wal_t* wal = NULL;
+    hashmap_t* root = NULL;
+
+    if (dir == NULL || (wal = calloc(1, sizeof(hm_wal_t))) == NULL) {
+        return NULL;
+    }
+
+    wal->buf.fd = -1;
+    wal->log_fd = -1;
+
+    if ((mkdir(dir, 0755) < 0 && errno != EEXIST) || (wal->dir_fd = open(dir, O_RDONLY | O_DIRECTORY)) < 0) {
+        HM_LOG(LOG_LEVEL_ERROR, "Failed to open [%s]: %s", dir, strerror(errno));
+        free(wal);
+        return NULL;
+    }
+
+    if ((wal->log_fd = openat(wal->dir_fd, HM_WAL_FILE, O_RDWR | O_CREAT, 0644)) < 0
+        || (root = hm_wal_load_snapshot(wal)) == NULL
+        || hm_wal_replay(wal, root) == HM_ERROR
+        || lseek(wal->log_fd, 0, SEEK_END) < 0) {
+        HM_LOG(LOG_LEVEL_ERROR, "Failed to recover [%s]", dir);
+        hm_free((void**)&root);
+        if (wal->log_fd >= 0) {
+            close(wal->log_fd);
+        }
+        close(wal->dir_fd);
+        free(wal);
+        return NULL;
+    }
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&wal->lock, NULL);
+    pthread_cond_init(&wal->wake, &attr);
+    pthread_condattr_destroy(&attr);
+
+    // Without it groups are still synced once full or old enough on the next append
+    if (pthread_create(&wal->syncer, NULL, hm_wal_syncer, wal) == 0) {
+        wal->syncer_running = true;
+    } else {
+        HM_LOG(LOG_LEVEL_WARNING, "Failed to start the log sync thread");
+    }
+
+    wal->root = root;
+    root->wal = wal;
+
+    return root;
+}
+
+/**
+ * @brief Syncs and closes the log of a durable root. The tree stays in memory
+ * as a regular hashmap.
+ *
+ * @param hashmap Root hashmap
+ * @return int Status code (HM_SUCCESS or HM_ERROR if the log failed at any point)
+ */
+int hm_wal_close(hashmap_t* hashmap)
+{
+    hm_wal_t* wal = NULL;
+    int status = HM_SUCCESS;
+
+    if (hashmap == NULL || (wal = hashmap->wal) == NULL) {
+        return HM_ERROR;
+    }
+
+    pthread_mutex_lock(&wal->lock);
+    wal->stopping = true;
+    pthread_cond_signal(&wal->wake);
+    pthread_mutex_unlock(&wal->lock);
+
+    if (wal->syncer_running) {
+        pthread_join(wal->syncer, NULL);
+    }
+
+    if (hm_wal_flush(wal) == HM_ERROR || wal->failed) {
+        status = HM_ERROR;
+    }
+
+    pthread_mutex_destroy(&wal->lock);
+    pthread_cond_destroy(&wal->wake);
+    close(wal->log_fd);
+    close(wal->dir_fd);
+    free(wal->buf.data);
+    free(wal);
+    hashmap->wal = NULL;
+
+    return status;
+}
@@ -1,9 +1,26 @@
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include <cmap/log.h>
 #include <cmap/map.h>
+#include <cmap/shm.h>
+#include <cmap/typed.h>
+#include <cmap/wal.h>
+
+typedef struct {
+    uint32_t region;
+    uint32_t id;
+} subscriber_t;
+
+#define SUBSCRIBER_HASH(key) cmap_hash_bytes(&(key), sizeof(subscriber_t))
+#define SUBSCRIBER_EQ(a, b) ((a).region == (b).region && (a).id == (b).id)
+
+CMAP_DEFINE(plan_map, uint64_t, int, cmap_hash_u64, CMAP_EQ)
+CMAP_DEFINE(subscriber_map, subscriber_t, double, SUBSCRIBER_HASH, SUBSCRIBER_EQ)
 
 void fill_test_map_struct(hashmap_t* hm)
 {
@@ -74,17 +91,1019 @@ void fill_test_map_struct(hashmap_t* hm)
     assert(((list_t*)val)->size == 4);
 }
 
+void test_remove_update_upsert(void)
+{
+    hashmap_t* hm = hm_create_default();
+    void* val = NULL;
+    node_t* node = NULL;
+
+    HM_LOG(LOG_LEVEL_INFO, "Testing HM update, upsert and remove");
+
+    hm_insert(hm, HM_VALUE_STR, "long value", "A", "B", NULL);
+    assert(hm_search(hm, &val, "A", "B", NULL) == HM_SUCCESS);
+    char* buffer = val;
+
+    // Smaller values reuse the existing buffer
+    assert(hm_update_str(hm, "short", "A", "B", NULL) == HM_SUCCESS);
+    assert(hm_search(hm, &val, "A", "B", NULL) == HM_SUCCESS);
+    assert(val == buffer && !strcmp(val, "short"));
+
+    assert(hm_update_str(hm, "a much longer value", "A", "B", NULL) == HM_SUCCESS);
+    assert(hm_search(hm, &val, "A", "B", NULL) == HM_SUCCESS);
+    assert(!strcmp(val, "a much longer value"));
+    assert(hm_update_str(hm, "x", "A", "C", NULL) == HM_NOT_FOUND);
+
+    hm_insert(hm, HM_VALUE_STR, "again", "A", "B", NULL);
+    assert(hm_search(hm, &val, "A", "B", NULL) == HM_SUCCESS);
+    assert(!strcmp(val, "again"));
+
+    // Upsert returns the existing slot or creates it
+    node = hm_upsert(hm, HM_VALUE_STR, "new", "A", "D", NULL);
+    assert(node != NULL && !strcmp(node->value, "new"));
+    assert(hm_upsert(hm, HM_VALUE_STR, "other", "A", "D", NULL) == node);
+    assert(!strcmp(node->value, "new"));
+
+    assert(hm_search(hm, &val, "A", "B", "C", NULL) == HM_NOT_FOUND);
+    assert(hm_remove(hm, "A", "B", NULL) == HM_SUCCESS);
+    assert(hm_remove(hm, "A", "B", NULL) == HM_NOT_FOUND);
+    assert(hm_search(hm, &val, "A", "B", NULL) == HM_NOT_FOUND);
+    assert(hm_search(hm, &val, "A", "D", NULL) == HM_SUCCESS);
+
+    for (int i = 0; i < 100; i++) {
+        char key[16];
+        snprintf(key, sizeof(key), "K%d", i);
+        hm_insert(hm, HM_VALUE_STR, key, "A", key, NULL);
+    }
+    for (int i = 0; i < 100; i++) {
+        char key[16];
+        snprintf(key, sizeof(key), "K%d", i);
+        assert(hm_remove(hm, "A", key, NULL) == HM_SUCCESS);
+    }
+    assert(hm_search(hm, &val, "A", NULL) == HM_SUCCESS);
+    assert(((hashmap_t*)val)->size == 1);
+
+    assert(hm_remove(hm, "A", NULL) == HM_SUCCESS);
+    assert(hm->size == 0);
+
+    hm_free((void**)&hm);
+}
+
+void test_shrink_compact(void)
+{
+    hashmap_t* hm = hm_create_default();
+    void* val = NULL;
+    char key[16];
+
+    HM_LOG(LOG_LEVEL_INFO, "Testing HM shrink and compact");
+
+    for (int i = 0; i < 1000; i++) {
+        snprintf(key, sizeof(key), "K%d", i);
+        hm_insert(hm, HM_VALUE_STR, key, "A", key, NULL);
+        hm_insert(hm, HM_VALUE_STR, key, "B", key, NULL);
+    }
+
+    assert(hm_search(hm, &val, "A", NULL) == HM_SUCCESS);
+    hashmap_t* a = val;
+    size_t peak_capacity = a->capacity;
+
+    // Removals shrink the table automatically
+    for (int i = 0; i < 990; i++) {
+        snprintf(key, sizeof(key), "K%d", i);
+        assert(hm_remove(hm, "A", key, NULL) == HM_SUCCESS);
+    }
+    assert(a->size == 10);
+    assert(a->capacity < peak_capacity);
+    assert(hm_get_load_factor(a) < HM_LOAD_FACTOR_THRESHOLD);
+
+    for (int i = 990; i < 1000; i++) {
+        snprintf(key, sizeof(key), "K%d", i);
+        assert(hm_search(hm, &val, "A", key, NULL) == HM_SUCCESS);
+        assert(!strcmp(val, key));
+    }
+
+    assert(hm_resize(a, 0.01) == HM_ERROR);
+
+    // Compaction rebuilds the whole tree densely
+    hm_insert(hm, HM_VALUE_MAP, hm_create(4096), "C", NULL);
+    assert(hm_compact(hm) == HM_SUCCESS);
+    assert(hm_search(hm, &val, "C", NULL) == HM_SUCCESS);
+    assert(((hashmap_t*)val)->capacity == HM_INITIAL_CAPACITY);
+    assert(hm_search(hm, &val, "B", NULL) == HM_SUCCESS);
+    assert(hm_get_load_factor(val) < HM_LOAD_FACTOR_THRESHOLD);
+    assert(((hashmap_t*)val)->size == 1000);
+    assert(hm_search(hm, &val, "B", "K500", NULL) == HM_SUCCESS);
+
+    hm_free((void**)&hm);
+}
+
+void test_typed_values(void)
+{
+    hashmap_t* hm = hm_create_default();
+    void* val = NULL;
+    int64_t counter = 41;
+    double ratio = 0.5;
+    bool flag = true;
+    hm_blob_t blob = { .data = "\x00\x01\xff", .len = 3 };
+    int64_t result = 0;
+
+    HM_LOG(LOG_LEVEL_INFO, "Testing HM typed values");
+
+    hm_insert(hm, HM_VALUE_INT64, &counter, "STATS", "HITS", NULL);
+    hm_insert(hm, HM_VALUE_DOUBLE, &ratio, "STATS", "RATIO", NULL);
+    hm_insert(hm, HM_VALUE_BOOL, &flag, "STATS", "ENABLED", NULL);
+    hm_insert(hm, HM_VALUE_BLOB, &blob, "STATS", "ID", NULL);
+
+    assert(hm_search(hm, &val, "STATS", "HITS", NULL) == HM_SUCCESS);
+    assert(*(int64_t*)val == 41);
+    assert(hm_search(hm, &val, "STATS", "RATIO", NULL) == HM_SUCCESS);
+    assert(*(double*)val == 0.5);
+    assert(hm_search(hm, &val, "STATS", "ENABLED", NULL) == HM_SUCCESS);
+    assert(*(bool*)val == true);
+    assert(hm_search(hm, &val, "STATS", "ID", NULL) == HM_SUCCESS);
+    assert(((hm_blob_t*)val)->len == 3 && !memcmp(((hm_blob_t*)val)->data, "\x00\x01\xff", 3));
+    assert(((hm_blob_t*)val)->data != blob.data);
+
+    assert(hm_incr(hm, 1, &result, "STATS", "HITS", NULL) == HM_SUCCESS);
+    assert(result == 42);
+    assert(hm_incr(hm, 5, &result, "STATS", "MISSES", NULL) == HM_SUCCESS);
+    assert(result == 5);
+    assert(hm_incr(hm, 1, &result, "STATS", "RATIO", NULL) == HM_ERROR);
+
+    // Replacing a value with another type frees the old one
+    hm_insert(hm, HM_VALUE_STR, "text", "STATS", "ID", NULL);
+    hm_insert(hm, HM_VALUE_INT64, &counter, "STATS", "ID", NULL);
+
+    hashmap_t* small = hm_create_default();
+    hm_insert(small, HM_VALUE_INT64, &counter, "N", NULL);
+    hm_insert(small, HM_VALUE_BOOL, &flag, "B", NULL);
+    hm_insert(small, HM_VALUE_BLOB, &blob, "D", NULL);
+    hm_insert(small, HM_VALUE_STR, "a\"b", "S", NULL);
+    list_t* list = hm_list_create_default();
+    hm_list_append_str(list, "x");
+    hm_insert(small, HM_VALUE_LIST, list, "L", NULL);
+
+    char* json = hm_serialize(small);
+    assert(json != NULL);
+    assert(strstr(json, "\"N\":41") != NULL);
+    assert(strstr(json, "\"B\":true") != NULL);
+    assert(strstr(json, "\"D\":\"AAH/\"") != NULL);
+    assert(strstr(json, "\"S\":\"a\\\"b\"") != NULL);
+    assert(strstr(json, "\"L\":[\"x\"]") != NULL);
+    free(json);
+
+    hm_free((void**)&small);
+    hm_free((void**)&hm);
+}
+
+void test_binary_keys(void)
+{
+    hashmap_t* hm = hm_create_default();
+    void* val = NULL;
+    int64_t plan = 7;
+
+    HM_LOG(LOG_LEVEL_INFO, "Testing HM length delimited keys");
+
+    // Keys differing only after an embedded NUL are distinct
+    char id_a[] = { 'I', 'D', '\0', 0x01 };
+    char id_b[] = { 'I', 'D', '\0', 0x02 };
+    hm_key_t path_a[] = { HM_KEY("SUBSCRIBERS"), HM_KEYN(id_a, sizeof(id_a)) };
+    hm_key_t path_b[] = { HM_KEY("SUBSCRIBERS"), HM_KEYN(id_b, sizeof(id_b)) };
+    hm_key_t path_c[] = { HM_KEY("SUBSCRIBERS"), HM_KEYN(id_a, 2) };
+
+    hm_insertn(hm, HM_VALUE_INT64, &plan, path_a, 2);
+    assert(hm_searchn(hm, &val, path_a, 2) == HM_SUCCESS);
+    assert(*(int64_t*)val == 7);
+    assert(hm_searchn(hm, &val, path_b, 2) == HM_NOT_FOUND);
+    assert(hm_searchn(hm, &val, path_c, 2) == HM_NOT_FOUND);
+
+    assert(hm_incrn(hm, 1, NULL, path_b, 2) == HM_SUCCESS);
+    assert(hm_searchn(hm, &val, path_b, 2) == HM_SUCCESS);
+    assert(*(int64_t*)val == 1);
+
+    // Keys taken from a larger buffer without a NUL terminated copy
+    const char* request = "SUBSCRIBERS/ID";
+    hm_key_t prefix[] = { HM_KEYN(request, 11) };
+    assert(hm_searchn(hm, &val, prefix, 1) == HM_SUCCESS);
+    assert(((hashmap_t*)val)->size == 2);
+    assert(hm_search(hm, &val, "SUBSCRIBERS", NULL) == HM_SUCCESS);
+
+    for (int i = 0; i < 200; i++) {
+        char key[16];
+        snprintf(key, sizeof(key), "K%d", i);
+        hm_insert(hm, HM_VALUE_STR, key, "SUBSCRIBERS", key, NULL);
+    }
+    assert(hm_searchn(hm, &val, path_a, 2) == HM_SUCCESS);
+
+    assert(hm_removen(hm, path_a, 2) == HM_SUCCESS);
+    assert(hm_searchn(hm, &val, path_a, 2) == HM_NOT_FOUND);
+    assert(hm_searchn(hm, &val, path_b, 2) == HM_SUCCESS);
+
+    hm_free((void**)&hm);
+}
+
+void test_ownership(void)
+{
+    hashmap_t* hm = hm_create_default();
+    void* val = NULL;
+
+    HM_LOG(LOG_LEVEL_INFO, "Testing HM borrowed and taken values");
+
+    // Borrowed keys and values point to the caller's buffers
+    char buffer[] = "PLANSVSA";
+    assert(hm_set_ownership(hm, HM_OWN_BORROW, HM_OWN_BORROW) == HM_SUCCESS);
+    hm_key_t path[] = { HM_KEYN(buffer, 5), HM_KEYN(buffer + 5, 3) };
+    hm_insertn(hm, HM_VALUE_STR, buffer, path, 2);
+
+    assert(hm_search(hm, &val, "PLANS", "VSA", NULL) == HM_SUCCESS);
+    assert(val == buffer);
+    assert(hm_search(hm, &val, "PLANS", NULL) == HM_SUCCESS);
+    assert(((hashmap_t*)val)->key_policy == HM_OWN_BORROW);
+
+    // Updating a borrowed value never writes to the caller's buffer
+    assert(hm_update_str(hm, "X", "PLANS", "VSA", NULL) == HM_SUCCESS);
+    assert(!strcmp(buffer, "PLANSVSA"));
+    assert(hm_search(hm, &val, "PLANS", "VSA", NULL) == HM_SUCCESS);
+    assert(val != buffer && !strcmp(val, "X"));
+
+    // Taken values are stored without a copy and freed with the entry
+    hashmap_t* taken = hm_create_default();
+    assert(hm_set_ownership(taken, HM_OWN_COPY, HM_OWN_TAKE) == HM_SUCCESS);
+    char* owned = strdup("owned");
+    hm_insert(taken, HM_VALUE_STR, owned, "A", NULL);
+    assert(hm_search(taken, &val, "A", NULL) == HM_SUCCESS);
+    assert(val == owned);
+    hm_insert(taken, HM_VALUE_STR, strdup("replaced"), "A", NULL);
+    hm_blob_t blob = { .data = malloc(4), .len = 4 };
+    memcpy(blob.data, "blob", 4);
+    hm_insert(taken, HM_VALUE_BLOB, &blob, "B", NULL);
+    assert(hm_search(taken, &val, "B", NULL) == HM_SUCCESS);
+    assert(((hm_blob_t*)val)->data == blob.data);
+
+    // Inserting the pointer already held keeps it alive
+    char* again = strdup("again");
+    hm_insert(taken, HM_VALUE_STR, again, "A", NULL);
+    hm_insert(taken, HM_VALUE_STR, again, "A", NULL);
+    assert(hm_search(taken, &val, "A", NULL) == HM_SUCCESS);
+    assert(val == again && !strcmp(val, "again"));
+    blob.len = 3;
+    hm_insert(taken, HM_VALUE_BLOB, &blob, "B", NULL);
+    assert(hm_search(taken, &val, "B", NULL) == HM_SUCCESS);
+    assert(((hm_blob_t*)val)->data == blob.data && ((hm_blob_t*)val)->len == 3);
+
+    assert(hm_set_ownership(taken, HM_OWN_TAKE, HM_OWN_TAKE) == HM_ERROR);
+
+    hm_free((void**)&taken);
+    hm_free((void**)&hm);
+}
+
+void test_stats(void)
+{
+    hashmap_t* hm = hm_create_default();
+    hm_stats_t stats;
+    void* val = NULL;
+    char key[16];
+
+    HM_LOG(LOG_LEVEL_INFO, "Testing HM stats");
+
+    for (int i = 0; i < 100; i++) {
+        snprintf(key, sizeof(key), "K%d", i);
+        hm_insert(hm, HM_VALUE_STR, "abc", "A", key, NULL);
+    }
+    hm_list_append_str(hm_upsert(hm, HM_VALUE_LIST, NULL, "L", NULL)->value, "x");
+    hm_search(hm, &val, "A", "K1", NULL);
+    hm_search(hm, &val, "A", "MISSING", NULL);
+
+    assert(hm_stats(hm, &stats, false) == HM_SUCCESS);
+    assert(stats.maps == 1 && stats.entries == 2 && stats.lists == 0);
+    assert(stats.buckets == (size_t)hm->capacity);
+
+    assert(hm_stats(hm, &stats, true) == HM_SUCCESS);
+    assert(stats.maps == 2 && stats.lists == 1);
+    assert(stats.entries == 102 && stats.list_items == 1);
+    assert(stats.value_bytes == 100 * 4 + 2);
+    assert(stats.resize_count > 0);
+    assert(stats.used_buckets + stats.collisions == stats.entries);
+    assert(stats.max_chain >= 1 && stats.avg_chain >= 1.0);
+
+    size_t histogram_total = 0;
+    for (int i = 0; i < HM_STATS_HISTOGRAM_SIZE; i++) {
+        histogram_total += stats.chain_histogram[i];
+    }
+    assert(histogram_total == stats.buckets);
+
+#ifdef HM_ENABLE_COUNTERS
+    assert(stats.counters.hits >= 3 && stats.counters.misses >= 1);
+    assert(stats.counters.inserts == 102);
+#endif
+
+    hm_free((void**)&hm);
+}
+
+static int sink_calls = 0;
+
+void counting_sink(log_lv_t lv, const char* file, const char* function, int line, const char* message, size_t len, void* ctx)
+{
+    (void)lv, (void)file, (void)function, (void)line, (void)message;
+    assert(len < HM_LOG_MESSAGE_MAX);
+    assert(ctx == &sink_calls);
+    sink_calls++;
+}
+
+void test_log_sink(void)
+{
+    log_lv_t previous_level = global_log_level;
+
+    HM_LOG(LOG_LEVEL_INFO, "Testing HM log sinks");
+    hm_log_flush();
+
+    global_log_level = LOG_LEVEL_DEBUG;
+    hm_log_set_sink(counting_sink, &sink_calls);
+
+    HM_LOG(LOG_LEVEL_INFO, "%s", "counted");
+    HM_LOG(LOG_LEVEL_ERROR, "%0512d", 0);
+    assert(sink_calls == 2);
+
+    // Levels above HM_LOG_COMPILE_LEVEL are removed along with their arguments
+    HM_LOG(LOG_LEVEL_DEBUG, "%d", sink_calls++);
+    assert(sink_calls == (LOG_LEVEL_DEBUG <= HM_LOG_COMPILE_LEVEL ? 4 : 2));
+
+    hm_log_set_sink(NULL, NULL);
+
+    // A forked child gets its own writer, its rings are drained as they fill up
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        unsigned long dropped = hm_log_dropped();
+        assert(freopen("/dev/null", "w", stdout) != NULL);
+        for (int round = 0; round < 4; round++) {
+            for (int i = 0; i < HM_LOG_RING_SLOTS; i++) {
+                HM_LOG(LOG_LEVEL_INFO, "child %d", i);
+            }
+            usleep(50000);
+        }
+        exit(hm_log_dropped() == dropped ? 0 : 1);
+    }
+    int status = 0;
+    assert(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    global_log_level = previous_level;
+}
+
+void test_typed_maps(void)
+{
+    plan_map_t plans;
+    subscriber_map_t subscribers;
+    bool created = false;
+
+    HM_LOG(LOG_LEVEL_INFO, "Testing typed maps");
+
+    assert(plan_map_init(&plans, 0) == HM_SUCCESS);
+    for (uint64_t id = 0; id < 10000; id++) {
+        assert(plan_map_put(&plans, id * 7919, (int)(id % 5)) == HM_SUCCESS);
+    }
+    assert(plans.size == 10000);
+    assert((double)plans.size / plans.capacity < HM_LOAD_FACTOR_THRESHOLD);
+
+    for (uint64_t id = 0; id < 10000; id++) {
+        int* plan = plan_map_get(&plans, id * 7919);
+        assert(plan != NULL && *plan == (int)(id % 5));
+    }
+    assert(plan_map_get(&plans, 1) == NULL);
+
+    *plan_map_upsert(&plans, 7919, &created) += 10;
+    assert(!created && *plan_map_get(&plans, 7919) == 11);
+    *plan_map_upsert(&plans, 1, &created) += 10;
+    assert(created && *plan_map_get(&plans, 1) == 10);
+    assert(plan_map_remove(&plans, 1) == HM_SUCCESS);
+
+    size_t peak_capacity = plans.capacity;
+    for (uint64_t id = 0; id < 9990; id++) {
+        assert(plan_map_remove(&plans, id * 7919) == HM_SUCCESS);
+    }
+    assert(plan_map_remove(&plans, 0) == HM_NOT_FOUND);
+    assert(plans.size == 10 && plans.capacity < peak_capacity);
+    for (uint64_t id = 9990; id < 10000; id++) {
+        assert(*plan_map_get(&plans, id * 7919) == (int)(id % 5));
+    }
+
+    // Slots left behind by removals do not leak their old values into new keys
+    for (uint64_t id = 0; id < 100; id++) {
+        *plan_map_upsert(&plans, id * 7919, &created) += 1;
+        assert(created && *plan_map_get(&plans, id * 7919) == 1);
+    }
+    plan_map_destroy(&plans);
+
+    assert(subscriber_map_init(&subscribers, 16) == HM_SUCCESS);
+    subscriber_t alice = { .region = 11, .id = 42 };
+    subscriber_t bob = { .region = 21, .id = 42 };
+    assert(subscriber_map_put(&subscribers, alice, 9.5) == HM_SUCCESS);
+    assert(*subscriber_map_get(&subscribers, alice) == 9.5);
+    assert(subscriber_map_get(&subscribers, bob) == NULL);
+    subscriber_map_destroy(&subscribers);
+}
+
+void test_clone_merge(void)
+{
+    hashmap_t* base = hm_create_default();
+    hashmap_t* tenant = hm_create_default();
+    void* val = NULL;
+    int64_t limit = 10;
+    char key[16];
+
+    HM_LOG(LOG_LEVEL_INFO, "Testing HM clone and merge");
+
+    for (int i = 0; i < 50; i++) {
+        snprintf(key, sizeof(key), "K%d", i);
+        hm_insert(base, HM_VALUE_STR, key, "PLANS", key, NULL);
+    }
+    hm_insert(base, HM_VALUE_INT64, &limit, "LIMITS", "DAILY", NULL);
+    list_t* list = hm_list_create_default();
+    hm_list_append_str(list, "CRD");
+    hm_insert(base, HM_VALUE_LIST, list, "CARDS", NULL);
+
+    hashmap_t* clone = hm_clone(base);
+    assert(clone != NULL && clone->capacity == base->capacity);
+    assert(hm_search(clone, &val, "PLANS", NULL) == HM_SUCCESS);
+    assert(((hashmap_t*)val)->size == 50);
+    assert(hm_search(base, &val, "PLANS", NULL) == HM_SUCCESS);
+    size_t plans_capacity = ((hashmap_t*)val)->capacity;
+    assert(hm_search(clone, &val, "PLANS", NULL) == HM_SUCCESS);
+    assert(((hashmap_t*)val)->capacity == plans_capacity);
+    assert(((hashmap_t*)val)->resize_count == 0);
+
+    char* base_json = hm_serialize(base);
+    char* clone_json = hm_serialize(clone);
+    assert(!strcmp(base_json, clone_json));
+    free(base_json);
+    free(clone_json);
+
+    // The clone is independent from the original
+    assert(hm_update_str(clone, "changed", "PLANS", "K1", NULL) == HM_SUCCESS);
+    assert(hm_search(base, &val, "PLANS", "K1", NULL) == HM_SUCCESS);
+    assert(!strcmp(val, "K1"));
+
+    // Merge overlays the tenant on top of a copy of the base
+    int64_t tenant_limit = 99;
+    hm_insert(tenant, HM_VALUE_INT64, &tenant_limit, "LIMITS", "DAILY", NULL);
+    hm_insert(tenant, HM_VALUE_INT64, &tenant_limit, "LIMITS", "MONTHLY", NULL);
+    hm_insert(tenant, HM_VALUE_STR, "tenant", "PLANS", "K2", NULL);
+    hm_insert(tenant, HM_VALUE_STR, "only", "TENANT", "NAME", NULL);
+
+    hashmap_t* kept = hm_clone(base);
+    assert(hm_merge(kept, tenant, HM_MERGE_KEEP) == HM_SUCCESS);
+    assert(hm_search(kept, &val, "LIMITS", "DAILY", NULL) == HM_SUCCESS);
+    assert(*(int64_t*)val == 10);
+    assert(hm_search(kept, &val, "LIMITS", "MONTHLY", NULL) == HM_SUCCESS);
+    assert(*(int64_t*)val == 99);
+    assert(hm_search(kept, &val, "TENANT", "NAME", NULL) == HM_SUCCESS);
+
+    assert(hm_merge(clone, tenant, HM_MERGE_OVERWRITE) == HM_SUCCESS);
+    assert(hm_search(clone, &val, "LIMITS", "DAILY", NULL) == HM_SUCCESS);
+    assert(*(int64_t*)val == 99);
+    assert(hm_search(clone, &val, "PLANS", "K2", NULL) == HM_SUCCESS);
+    assert(!strcmp(val, "tenant"));
+    assert(hm_search(clone, &val, "PLANS", "K3", NULL) == HM_SUCCESS);
+    assert(hm_search(clone, &val, "CARDS", NULL) == HM_SUCCESS);
+    assert(hm_list_contains(val, "CRD") == HM_SUCCESS);
+
+    hm_free((void**)&kept);
+    hm_free((void**)&clone);
+    hm_free((void**)&tenant);
+    hm_free((void**)&base);
+}
+
+static int count_diff(hm_diff_op_t op, const hm_key_t* path, size_t depth, node_t* old_node, node_t* new_node, void* ctx)
+{
+    int* counts = ctx;
+
+    (void)path;
+    (void)old_node;
+    (void)new_node;
+    assert(depth > 0);
+    counts[op]++;
+
+    return HM_SUCCESS;
+}
+
+void test_digest_diff(void)
+{
+    hashmap_t* base = hm_create_default();
+    int64_t limit = 10;
+    int counts[3] = { 0 };
+    char key[16];
+
+    HM_LOG(LOG_LEVEL_INFO, "Testing HM digests, diff and patch");
+
+    for (int i = 0; i < 100; i++) {
+        snprintf(key, sizeof(key), "K%d", i);
+        hm_insert(base, HM_VALUE_STR, key, "PLANS", key, NULL);
+    }
+    hm_insert(base, HM_VALUE_INT64, &limit, "LIMITS", "DAILY", NULL);
+    hm_insert(base, HM_VALUE_STR, "gone", "LIMITS", "OLD", NULL);
+    assert(hm_enable_digest(base) == HM_SUCCESS);
+
+    hashmap_t* changed = hm_clone(base);
+    assert(changed->digest_enabled && hm_equal(base, changed));
+
+    // Inserting and removing a key restores the digest
+    uint64_t digest = changed->digest;
+    hm_insert(changed, HM_VALUE_STR, "tmp", "PLANS", "TMP", "DEEP", NULL);
+    assert(changed->digest != digest && !hm_equal(base, changed));
+    assert(hm_remove(changed, "PLANS", "TMP", NULL) == HM_SUCCESS);
+    assert(changed->digest == digest && hm_equal(base, changed));
+
+    assert(hm_update_str(changed, "new", "PLANS", "K7", NULL) == HM_SUCCESS);
+    assert(hm_incr(changed, 5, NULL, "LIMITS", "DAILY", NULL) == HM_SUCCESS);
+    assert(hm_remove(changed, "LIMITS", "OLD", NULL) == HM_SUCCESS);
+    hm_insert(changed, HM_VALUE_STR, "tenant", "TENANT", "NAME", NULL);
+
+    // Incremental digests match a full recomputation
+    digest = changed->digest;
+    assert(hm_enable_digest(changed) == HM_SUCCESS);
+    assert(changed->digest == digest);
+
+    assert(hm_diff(base, changed, count_diff, counts) == HM_SUCCESS);
+    assert(counts[HM_DIFF_CHANGED] == 2);
+    assert(counts[HM_DIFF_REMOVED] == 1);
+    assert(counts[HM_DIFF_ADDED] == 1);
+
+    hm_patch_t* patch = hm_patch_create(base, changed);
+    assert(patch != NULL && patch->size == 4);
+    assert(hm_patch(base, patch) == HM_SUCCESS);
+    hm_patch_free((void**)&patch);
+    assert(patch == NULL);
+
+    assert(hm_equal(base, changed));
+    void* val = NULL;
+    assert(hm_search(base, &val, "PLANS", "K7", NULL) == HM_SUCCESS && !strcmp(val, "new"));
+    assert(hm_search(base, &val, "LIMITS", "DAILY", NULL) == HM_SUCCESS && *(int64_t*)val == 15);
+    assert(hm_search(base, &val, "LIMITS", "OLD", NULL) == HM_NOT_FOUND);
+    assert(hm_search(base, &val, "TENANT", "NAME", NULL) == HM_SUCCESS && !strcmp(val, "tenant"));
+
+    hm_free((void**)&changed);
+    hm_free((void**)&base);
+}
+
+void test_durable(void)
+{
+    char dir[] = "/tmp/cmap_test_XXXXXX";
+    char path[64];
+    void* val = NULL;
+    int64_t limit = 10;
+    double ratio = 0.5;
+    bool enabled = true;
+    hm_blob_t blob = { "\x00\x01\x02", 3 };
+
+    HM_LOG(LOG_LEVEL_INFO, "Testing HM write ahead log");
+
+    assert(mkdtemp(dir) != NULL);
+
+    hashmap_t* hm = hm_open_durable(dir);
+    assert(hm != NULL && hm->size == 0);
+
+    hm_insert(hm, HM_VALUE_STR, "Gold", "PLANS", "P1", "NAME", NULL);
+    hm_insert(hm, HM_VALUE_STR, "Silver", "PLANS", "P2", "NAME", NULL);
+    hm_insert(hm, HM_VALUE_INT64, &limit, "LIMITS", "DAILY", NULL);
+    hm_insert(hm, HM_VALUE_DOUBLE, &ratio, "LIMITS", "RATIO", NULL);
+    hm_insert(hm, HM_VALUE_BOOL, &enabled, "LIMITS", "ENABLED", NULL);
+    hm_insert(hm, HM_VALUE_BLOB, &blob, "RAW", NULL);
+    hm_insert(hm, HM_VALUE_LIST, NULL, "CARDS", NULL);
+    hm_insert_ttl(hm, 1000, HM_VALUE_STR, "temp", "SESSION", NULL);
+    assert(hm_search(hm, &val, "SESSION", NULL) == HM_NOT_FOUND);
+    assert(hm_incr(hm, 5, NULL, "LIMITS", "DAILY", NULL) == HM_SUCCESS);
+    assert(hm_update_str(hm, "Platinum", "PLANS", "P1", "NAME", NULL) == HM_SUCCESS);
+    assert(hm_remove(hm, "PLANS", "P2", NULL) == HM_SUCCESS);
+    node_t* node = hm_upsert(hm, HM_VALUE_INT64, NULL, "LIMITS", "MONTHLY", NULL);
+    assert(node != NULL);
+    node->i64 = 300;
+    assert(hm_upsert_commit(hm, "LIMITS", "MONTHLY", NULL) == HM_SUCCESS);
+    assert(hm_upsert_commit(hm, "LIMITS", "YEARLY", NULL) == HM_NOT_FOUND);
+    assert(hm_wal_sync(hm) == HM_SUCCESS);
+    hm_free((void**)&hm);
+
+    // Recovery from the log alone
+    assert((hm = hm_open_durable(dir)) != NULL);
+    assert(hm_search(hm, &val, "PLANS", "P1", "NAME", NULL) == HM_SUCCESS && !strcmp(val, "Platinum"));
+    assert(hm_search(hm, &val, "PLANS", "P2", NULL) == HM_NOT_FOUND);
+    assert(hm_search(hm, &val, "LIMITS", "DAILY", NULL) == HM_SUCCESS && *(int64_t*)val == 15);
+    assert(hm_search(hm, &val, "LIMITS", "MONTHLY", NULL) == HM_SUCCESS && *(int64_t*)val == 300);
+    assert(hm_search(hm, &val, "LIMITS", "RATIO", NULL) == HM_SUCCESS && *(double*)val == 0.5);
+    assert(hm_search(hm, &val, "LIMITS", "ENABLED", NULL) == HM_SUCCESS && *(bool*)val);
+    assert(hm_search(hm, &val, "RAW", NULL) == HM_SUCCESS);
+    assert(((hm_blob_t*)val)->len == 3 && !memcmp(((hm_blob_t*)val)->data, blob.data, 3));
+    assert(hm_search(hm, &val, "CARDS", NULL) == HM_SUCCESS && ((list_t*)val)->size == 0);
+
+    // Recovery from a snapshot plus the records appended after it
+    assert(hm_checkpoint(hm) == HM_SUCCESS);
+    hm_insert(hm, HM_VALUE_STR, "Bronze", "PLANS", "P3", "NAME", NULL);
+    hm_free((void**)&hm);
+
+    // A torn record at the end of the log is discarded
+    snprintf(path, sizeof(path), "%s/cmap.wal", dir);
+    FILE* log = fopen(path, "ab");
+    assert(log != NULL);
+    fwrite("\x40\x00\x00\x00\x01", 1, 5, log);
+    fclose(log);
+
+    assert((hm = hm_open_durable(dir)) != NULL);
+    assert(hm_search(hm, &val, "PLANS", "P1", "NAME", NULL) == HM_SUCCESS && !strcmp(val, "Platinum"));
+    assert(hm_search(hm, &val, "PLANS", "P3", "NAME", NULL) == HM_SUCCESS && !strcmp(val, "Bronze"));
+    assert(hm_search(hm, &val, "LIMITS", "DAILY", NULL) == HM_SUCCESS && *(int64_t*)val == 15);
+
+    // A crash between the snapshot and the truncate leaves a log already in the snapshot
+    hm_insert(hm, HM_VALUE_STR, "Gold", "TIERS", "T1", NULL);
+    hm_insert(hm, HM_VALUE_STR, "Flat", "TIERS", NULL);
+    assert(hm_wal_sync(hm) == HM_SUCCESS);
+    char saved[4096];
+    log = fopen(path, "rb");
+    assert(log != NULL);
+    size_t saved_len = fread(saved, 1, sizeof(saved), log);
+    fclose(log);
+    assert(saved_len > 0 && saved_len < sizeof(saved));
+    assert(hm_checkpoint(hm) == HM_SUCCESS);
+    hm_free((void**)&hm);
+    log = fopen(path, "wb");
+    assert(log != NULL && fwrite(saved, 1, saved_len, log) == saved_len);
+    fclose(log);
+
+    assert((hm = hm_open_durable(dir)) != NULL);
+    assert(hm_search(hm, &val, "TIERS", NULL) == HM_SUCCESS && !strcmp(val, "Flat"));
+    assert(hm_search(hm, &val, "PLANS", "P3", "NAME", NULL) == HM_SUCCESS && !strcmp(val, "Bronze"));
+    hm_insert(hm, HM_VALUE_STR, "Steel", "PLANS", "P4", NULL);
+    hm_free((void**)&hm);
+    assert((hm = hm_open_durable(dir)) != NULL);
+    assert(hm_search(hm, &val, "PLANS", "P4", NULL) == HM_SUCCESS && !strcmp(val, "Steel"));
+    hm_free((void**)&hm);
+
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/cmap.snapshot", dir);
+    unlink(path);
+    rmdir(dir);
+}
+
+void test_shared_memory(void)
+{
+    char name[64];
+    char buf[32];
+    hm_shm_value_t val = { .buf = buf, .buf_len = sizeof(buf) };
+    int64_t limit = 10;
+    hm_blob_t blob = { "\x00\x01", 2 };
+
+    HM_LOG(LOG_LEVEL_INFO, "Testing HM shared memory");
+
+    snprintf(name, sizeof(name), "/cmap_test_%d", (int)getpid());
+
+    hashmap_t* hm = hm_create_default();
+    for (int i = 0; i < 50; i++) {
+        char key[16];
+        snprintf(key, sizeof(key), "K%d", i);
+        hm_insert(hm, HM_VALUE_STR, key, "PLANS", key, NULL);
+    }
+    hm_insert(hm, HM_VALUE_INT64, &limit, "LIMITS", "DAILY", NULL);
+    hm_insert(hm, HM_VALUE_BLOB, &blob, "RAW", NULL);
+    list_t* list = hm_list_create_default();
+    hm_list_append_str(list, "CRD");
+    hm_insert(hm, HM_VALUE_LIST, list, "CARDS", NULL);
+
+    hm_shm_t* writer = hm_shm_create(name, 64 * 1024);
+    assert(writer != NULL);
+    hm_shm_t* reader = hm_shm_open(name);
+    assert(reader != NULL);
+
+    assert(hm_shm_search(reader, &val, "LIMITS", NULL) == HM_NOT_FOUND);
+    assert(hm_shm_publish(writer, hm) == HM_SUCCESS);
+    assert(hm_shm_generation(reader) == 1);
+
+    assert(hm_shm_search(reader, &val, "PLANS", "K7", NULL) == HM_SUCCESS);
+    assert(val.type == HM_VALUE_STR && !strcmp(val.str, "K7"));
+    assert(hm_shm_search(reader, &val, "PLANS", NULL) == HM_SUCCESS && val.type == HM_VALUE_MAP && val.size == 50);
+    assert(hm_shm_search(reader, &val, "LIMITS", "DAILY", NULL) == HM_SUCCESS && val.i64 == 10);
+    assert(hm_shm_search(reader, &val, "RAW", NULL) == HM_SUCCESS);
+    assert(val.blob.data == buf && val.blob.len == 2 && !memcmp(val.blob.data, blob.data, 2));
+    assert(hm_shm_search(reader, &val, "CARDS", NULL) == HM_SUCCESS && val.size == 1);
+    assert(hm_shm_search(reader, &val, "PLANS", "MISSING", NULL) == HM_NOT_FOUND);
+
+    // Strings are copied out, and must fit with their terminator
+    val.buf_len = 2;
+    assert(hm_shm_search(reader, &val, "PLANS", "K7", NULL) == HM_ERROR);
+    val.buf_len = 3;
+    assert(hm_shm_search(reader, &val, "PLANS", "K7", NULL) == HM_SUCCESS && val.str == buf && !strcmp(buf, "K7"));
+    val.buf_len = sizeof(buf);
+
+    // Another process reads the same copy
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        hm_shm_t* child = hm_shm_open(name);
+        int ok = child != NULL && hm_shm_search(child, &val, "PLANS", "K3", NULL) == HM_SUCCESS && !strcmp(val.str, "K3");
+        _exit(ok ? 0 : 1);
+    }
+    int status = 0;
+    assert(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    // Updates become visible once published
+    hm_update_str(hm, "updated", "PLANS", "K7", NULL);
+    assert(hm_shm_publish(writer, hm) == HM_SUCCESS);
+    assert(hm_shm_search(reader, &val, "PLANS", "K7", NULL) == HM_SUCCESS && !strcmp(val.str, "updated"));
+
+    // A tree that does not fit leaves the last one published
+    for (int i = 0; i < 2000; i++) {
+        char key[16];
+        snprintf(key, sizeof(key), "X%d", i);
+        hm_insert(hm, HM_VALUE_STR, key, "BIG", key, NULL);
+    }
+    assert(hm_shm_publish(writer, hm) == HM_ERROR);
+    assert(hm_shm_generation(reader) == 2);
+    assert(hm_shm_search(reader, &val, "PLANS", "K7", NULL) == HM_SUCCESS && !strcmp(val.str, "updated"));
+
+    // A restarted writer with a smaller region leaves the old one readable
+    assert(!hm_shm_retired(reader));
+    hm_shm_close((void**)&writer);
+    assert((writer = hm_shm_create(name, 4 * 1024)) != NULL);
+    assert(hm_shm_retired(reader));
+    assert(hm_shm_search(reader, &val, "PLANS", "K49", NULL) == HM_SUCCESS && !strcmp(val.str, "K49"));
+    assert(hm_shm_search(reader, &val, "PLANS", "K7", NULL) == HM_SUCCESS && !strcmp(val.str, "updated"));
+    hm_shm_close((void**)&reader);
+    assert((reader = hm_shm_open(name)) != NULL && !hm_shm_retired(reader));
+    assert(hm_shm_generation(reader) == 0);
+    assert(hm_shm_search(reader, &val, "PLANS", "K7", NULL) == HM_NOT_FOUND);
+
+    hm_shm_close((void**)&reader);
+    hm_shm_close((void**)&writer);
+    assert(writer == NULL);
+    assert(hm_shm_unlink(name) == HM_SUCCESS);
+    hm_free((void**)&hm);
+}
+
+void test_ttl(void)
+{
+    void* val = NULL;
+    int64_t hits = 1;
+
+    HM_LOG(LOG_LEVEL_INFO, "Testing HM TTL expiration");
+
+    hashmap_t* hm = hm_create_default();
+    assert(hm_expire_tick(hm, hm_clock_ms(), 10) == 0);
+
+    for (int i = 0; i < 100; i++) {
+        char key[16];
+        snprintf(key, sizeof(key), "S%d", i);
+        hm_insert_ttl(hm, 50, HM_VALUE_STR, key, "SESSIONS", key, NULL);
+    }
+    hm_insert_ttl(hm, 3600 * 1000, HM_VALUE_STR, "long", "SESSIONS", "KEEP", NULL);
+    hm_insert_ttl(hm, 50, HM_VALUE_STR, "short", "PINNED", NULL);
+    hm_insert(hm, HM_VALUE_STR, "pinned", "PINNED", NULL);
+    hm_insert_ttl(hm, 50, HM_VALUE_INT64, &hits, "RATE", NULL);
+    assert(hm_search(hm, &val, "SESSIONS", "S5", NULL) == HM_SUCCESS);
+
+    usleep(100 * 1000);
+
+    // Expired entries are no longer visible, but still held until reclaimed
+    assert(hm_search(hm, &val, "SESSIONS", "S5", NULL) == HM_NOT_FOUND);
+    assert(hm_search(hm, &val, "SESSIONS", "KEEP", NULL) == HM_SUCCESS);
+    assert(hm_search(hm, &val, "PINNED", NULL) == HM_SUCCESS && !strcmp(val, "pinned"));
+    assert(hm_search(hm, &val, "SESSIONS", NULL) == HM_SUCCESS && ((hashmap_t*)val)->size == 101);
+
+    // Inserting over an expired entry starts a new one
+    assert(hm_incr(hm, 5, &hits, "RATE", NULL) == HM_SUCCESS && hits == 5);
+
+    // Reclaiming is bounded by the budget
+    uint64_t now = hm_clock_ms();
+    assert(hm_expire_tick(hm, now, 30) == 30);
+    assert(hm_expire_tick(hm, now, 30) == 30);
+    assert(hm_expire_tick(hm, now, 100) == 40);
+    assert(hm_expire_tick(hm, now, 100) == 0);
+    assert(hm_search(hm, &val, "SESSIONS", NULL) == HM_SUCCESS && ((hashmap_t*)val)->size == 1);
+    assert(hm_search(hm, &val, "SESSIONS", "KEEP", NULL) == HM_SUCCESS);
+
+    // Timers far in the future are found once the wheel gets there
+    assert(hm_expire_tick(hm, now + 3600 * 1000 + 10, 10) == 1);
+    assert(hm_search(hm, &val, "SESSIONS", NULL) == HM_SUCCESS && ((hashmap_t*)val)->size == 0);
+
+    // Pending timers are released with the map
+    hm_insert_ttl(hm, 60 * 1000, HM_VALUE_STR, "pending", "SESSIONS", "LATER", NULL);
+    hm_free((void**)&hm);
+}
+
+static size_t stats_bytes(hashmap_t* hm)
+{
+    hm_stats_t stats;
+
+    assert(hm_stats(hm, &stats, true) == HM_SUCCESS);
+
+    return stats.key_bytes + stats.value_bytes + stats.struct_bytes;
+}
+
+void test_budget(void)
+{
+    hashmap_t* hm = hm_create_default();
+    void* val = NULL;
+    int64_t hits = 0;
+    hm_blob_t blob = { "\x00\x01\x02", 3 };
+    char key[16];
+
+    HM_LOG(LOG_LEVEL_INFO, "Testing HM memory budget");
+
+    hm_insert(hm, HM_VALUE_STR, "on", "CONFIG", "MODE", NULL);
+    assert(hm_get_memory_usage(hm) == 0);
+
+    // Accounting only, every change is reflected in the total
+    assert(hm_set_budget(hm, 0) == HM_SUCCESS);
+    assert(hm_get_memory_usage(hm) == stats_bytes(hm));
+
+    hm_insert(hm, HM_VALUE_BLOB, &blob, "CONFIG", "RAW", NULL);
+    hm_insert(hm, HM_VALUE_LIST, NULL, "CONFIG", "CARDS", NULL);
+    hm_update_str(hm, "a much longer mode than before", "CONFIG", "MODE", NULL);
+    hm_incr(hm, 1, &hits, "CONFIG", "HITS", NULL);
+    for (int i = 0; i < 50; i++) {
+        snprintf(key, sizeof(key), "T%d", i);
+        hm_insert(hm, HM_VALUE_STR, key, "TMP", key, NULL);
+    }
+    assert(hm_get_memory_usage(hm) == stats_bytes(hm));
+    for (int i = 0; i < 45; i++) {
+        snprintf(key, sizeof(key), "T%d", i);
+        assert(hm_remove(hm, "TMP", key, NULL) == HM_SUCCESS);
+    }
+    assert(hm_get_memory_usage(hm) == stats_bytes(hm));
+
+    hashmap_t* extra = hm_create_default();
+    hm_insert(extra, HM_VALUE_STR, "merged", "TMP", "M", NULL);
+    hm_insert(extra, HM_VALUE_BLOB, &blob, "CONFIG", "MODE", NULL);
+    assert(hm_merge(hm, extra, HM_MERGE_OVERWRITE) == HM_SUCCESS);
+    hm_free((void**)&extra);
+    assert(hm_compact(hm) == HM_SUCCESS);
+    assert(hm_get_memory_usage(hm) == stats_bytes(hm));
+
+    // Over budget, unreferenced entries are evicted first
+    size_t budget = hm_get_memory_usage(hm) + 16 * 1024;
+    assert(hm_set_budget(hm, budget) == HM_SUCCESS);
+    for (int i = 0; i < 2000; i++) {
+        snprintf(key, sizeof(key), "U%d", i);
+        hm_insert(hm, HM_VALUE_STR, "session data", "USERS", key, NULL);
+        assert(hm_search(hm, &val, "CONFIG", "HITS", NULL) == HM_SUCCESS);
+        assert(hm_get_memory_usage(hm) <= budget);
+    }
+    assert(hm_get_memory_usage(hm) == stats_bytes(hm));
+    assert(hm_search(hm, &val, "USERS", NULL) == HM_SUCCESS);
+    assert(((hashmap_t*)val)->size > 0 && ((hashmap_t*)val)->size < 2000);
+    assert(hm_search(hm, &val, "USERS", "U1999", NULL) == HM_SUCCESS);
+    assert(hm_search(hm, &val, "USERS", "U0", NULL) == HM_NOT_FOUND);
+
+    // Lowering the budget evicts right away
+    assert(hm_set_budget(hm, budget / 2) == HM_SUCCESS);
+    assert(hm_get_memory_usage(hm) <= budget / 2);
+    assert(hm_get_memory_usage(hm) == stats_bytes(hm));
+
+    hm_free((void**)&hm);
+}
+
+void test_large_tables(void)
+{
+    size_t buckets = HM_HUGE_TABLE_BYTES / sizeof(node_t*);
+    hashmap_t* hm = hm_create(buckets);
+    void* val = NULL;
+    char key[16];
+
+    HM_LOG(LOG_LEVEL_INFO, "Testing HM large tables");
+
+    // Tables above the threshold are mapped, with huge pages where available
+    assert(hm != NULL && hm->list != NULL && hm->mapped);
+    for (int i = 0; i < 1000; i++) {
+        snprintf(key, sizeof(key), "K%d", i);
+        hm_insert(hm, HM_VALUE_STR, key, key, NULL);
+    }
+    assert(hm_resize(hm, 2.0) == HM_SUCCESS && hm->capacity == 2 * buckets && hm->mapped);
+    assert(hm_search(hm, &val, "K999", NULL) == HM_SUCCESS && !strcmp(val, "K999"));
+
+    // Compacting moves the table back to the heap
+    assert(hm_compact(hm) == HM_SUCCESS && !hm->mapped);
+    assert(hm_search(hm, &val, "K0", NULL) == HM_SUCCESS && !strcmp(val, "K0"));
+
+    // Growth that would overflow fails instead of wrapping around
+    assert(hm_resize(hm, 1e30) == HM_ERROR);
+    assert(hm_reserve(hm, SIZE_MAX) == HM_ERROR);
+    assert(hm->size == 1000);
+
+    // Hashes use the full 64 bits
+    bool high_bits = false;
+    for (int i = 0; i < 16; i++) {
+        snprintf(key, sizeof(key), "K%d", i);
+        high_bits |= hm_key_hash(key, strlen(key)) > UINT32_MAX;
+    }
+    assert(high_bits);
+    assert(hm_hash(hm, "K1") >= 0 && (size_t)hm_hash(hm, "K1") < hm->capacity);
+
+    hm_free((void**)&hm);
+}
+
+void test_path_str(void)
+{
+    hashmap_t* hm = hm_create_default();
+    void* val = NULL;
+    int64_t limit = 10;
+    char path[256];
+
+    HM_LOG(LOG_LEVEL_INFO, "Testing HM delimited paths");
+
+    hm_insert_str(hm, HM_VALUE_STR, "VSA", "POSPAGO/ANUAL/VSA", '/');
+    hm_insert_str(hm, HM_VALUE_INT64, &limit, "POSPAGO.LIMITS.DAILY", '.');
+    assert(hm_search(hm, &val, "POSPAGO", "ANUAL", "VSA", NULL) == HM_SUCCESS && !strcmp(val, "VSA"));
+    assert(hm_search_str(hm, &val, "POSPAGO/LIMITS/DAILY", '/') == HM_SUCCESS && *(int64_t*)val == 10);
+    assert(hm_search_str(hm, &val, "POSPAGO/ANUAL", '/') == HM_SUCCESS && ((hashmap_t*)val)->size == 1);
+    assert(hm_search_str(hm, &val, "POSPAGO/ANUAL/MCI", '/') == HM_NOT_FOUND);
+    assert(hm_search_str(hm, &val, "POSPAGO/ANUAL/VSA", '.') == HM_NOT_FOUND);
+    assert(hm_search_str(hm, &val, "", '/') == HM_ERROR);
+
+    // Empty segments are empty keys
+    hm_insert_str(hm, HM_VALUE_STR, "root", "/ROOT", '/');
+    assert(hm_search(hm, &val, "", "ROOT", NULL) == HM_SUCCESS && !strcmp(val, "root"));
+
+    // Paths deeper than HM_MAX_PATH_DEPTH are rejected
+    path[0] = '\0';
+    for (int i = 0; i <= HM_MAX_PATH_DEPTH; i++) {
+        strcat(path, i ? "/K" : "K");
+    }
+    assert(hm_search_str(hm, &val, path, '/') == HM_ERROR);
+
+    // Cached paths follow updates and removals
+    assert(hm_enable_path_cache(hm, 100) == HM_SUCCESS);
+    for (int i = 0; i < 3; i++) {
+        assert(hm_search_str(hm, &val, "POSPAGO/ANUAL/VSA", '/') == HM_SUCCESS && !strcmp(val, "VSA"));
+    }
+    hm_update_str(hm, "visa", "POSPAGO", "ANUAL", "VSA", NULL);
+    assert(hm_search_str(hm, &val, "POSPAGO/ANUAL/VSA", '/') == HM_SUCCESS && !strcmp(val, "visa"));
+    assert(hm_remove(hm, "POSPAGO", "ANUAL", "VSA", NULL) == HM_SUCCESS);
+    assert(hm_search_str(hm, &val, "POSPAGO/ANUAL/VSA", '/') == HM_NOT_FOUND);
+
+    assert(hm_search_str(hm, &val, "POSPAGO/LIMITS/DAILY", '/') == HM_SUCCESS);
+    hm_insert(hm, HM_VALUE_STR, "none", "POSPAGO", "LIMITS", NULL);
+    assert(hm_search_str(hm, &val, "POSPAGO/LIMITS/DAILY", '/') == HM_NOT_FOUND);
+
+    // Paths longer than the cache keys are still resolved
+    memset(path, 'X', HM_PATH_CACHE_KEY_MAX + 10);
+    path[HM_PATH_CACHE_KEY_MAX + 10] = '\0';
+    hm_insert_str(hm, HM_VALUE_STR, "long", path, '/');
+    assert(hm_search_str(hm, &val, path, '/') == HM_SUCCESS && !strcmp(val, "long"));
+
+    // Removals reach the cache through hashmaps given by the caller, but not from other trees
+    hashmap_t* outer = hm_create_default();
+    hm_insert(outer, HM_VALUE_STR, "deep", "A", "B", NULL);
+    hm_insert(hm, HM_VALUE_MAP, outer, "OUTER", NULL);
+    assert(hm_search_str(hm, &val, "OUTER/A/B", '/') == HM_SUCCESS && !strcmp(val, "deep"));
+    uint64_t generation = hm->generation;
+    hashmap_t* other = hm_create_default();
+    hm_insert(other, HM_VALUE_STR, "x", "A", "B", NULL);
+    assert(hm_remove(other, "A", "B", NULL) == HM_SUCCESS);
+    hm_free((void**)&other);
+    assert(hm->generation == generation);
+    assert(hm_remove(hm, "OUTER", "A", "B", NULL) == HM_SUCCESS);
+    assert(hm->generation != generation);
+    assert(hm_search_str(hm, &val, "OUTER/A/B", '/') == HM_NOT_FOUND);
+
+    // Cached leaves expire with the hashmaps above them
+    hashmap_t* session = hm_create_default();
+    hm_insert(session, HM_VALUE_STR, "alice", "USER", NULL);
+    hm_insert_ttl(hm, 50, HM_VALUE_MAP, session, "SESSION", NULL);
+    assert(hm_search_str(hm, &val, "SESSION/USER", '/') == HM_SUCCESS && !strcmp(val, "alice"));
+    assert(hm_search_str(hm, &val, "SESSION/USER", '/') == HM_SUCCESS);
+    usleep(100 * 1000);
+    assert(hm_search(hm, &val, "SESSION", "USER", NULL) == HM_NOT_FOUND);
+    assert(hm_search_str(hm, &val, "SESSION/USER", '/') == HM_NOT_FOUND);
+
+    assert(hm_enable_path_cache(hm, 0) == HM_SUCCESS && hm->path_cache == NULL);
+    assert(hm_enable_path_cache(hm, 8) == HM_SUCCESS);
+    hm_free((void**)&hm);
+}
+
 int main()
 {
 
     hashmap_t* hm = NULL;
 
+    global_log_level = LOG_LEVEL_INFO;
+
     if ((hm = hm_create_default()) == NULL) {
         printf("Erro ao criar hashmap\n");
         return 1;
     }
 
     fill_test_map_struct(hm);
+    test_remove_update_upsert();
+    test_shrink_compact();
+    test_typed_values();
+    test_binary_keys();
+    test_ownership();
+    test_stats();
+    test_log_sink();
+    test_typed_maps();
+    test_clone_merge();
+    test_digest_diff();
+    test_durable();
+    test_shared_memory();
+    test_ttl();
+    test_budget();
+    test_large_tables();
+    test_path_str();
 
     hm_free((void**)&hm);
 }